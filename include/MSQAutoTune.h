@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "MSQData/Table.h"
+#include "MSQUtils.h"
+
+using namespace std;
+
+/**
+ * Closed loop tuning of a ve table from the measured air fuel
+ * ratio, as msq-ve_tuner does but inside msqdev.
+ *
+ * Each frame of real time data (frame()) is credited to the four
+ * cells around its rpm and load, weighted by how close it is to
+ * each (as the ecu interpolates), as the ratio of the measured to
+ * the goal air fuel ratio.
+ * Once a cell has collected enough weight its ve is multiplied
+ * by the weighted mean ratio, limited to a maximum step, and the
+ * cell is left alone for a while so the engine can settle on the
+ * new value (apply()).
+ *
+ * Frames during and shortly after a transient (a large rpmdot or
+ * tpsDOT, or a closed throttle at high rpm) are not used.
+ *
+ * frame() and apply() may be called from different threads.
+ */
+template <class T, class U>
+class MSQAutoTune {
+	private:
+		MSQDataTable<T, U>* table;
+
+		// indexes of the channels in the frame values, -1 if absent
+		int rpm_ch;
+		int load_ch;
+		int afr_ch;
+		int rpmdot_ch;
+		int tpsdot_ch;
+		int tps_ch;
+
+		// settings (see the set*() operations)
+		float goal_afr;
+		float min_weight;
+		float max_step;
+		float deadband;
+		float change_delay;
+		float transient_delay;
+		float min_value;
+		float max_value;
+		float resolution;
+
+		// axes of the table, refreshed by apply()
+		vector<float> x_bins;
+		vector<float> y_bins;
+
+		// per cell, x + y * x size
+		vector<float> weights;		// total weight collected
+		vector<float> sums;			// sum of weight * afr ratio
+		vector<double> changed;		// time of the last change
+		vector<char> ready;			// enough weight, see apply()
+		int num_ready;
+
+		double transient_time;		// time of the last transient
+
+		unsigned long num_changes;
+
+		pthread_mutex_t lock;
+
+		MSQAutoTune() {};  // prevent use of the default constructor
+		MSQAutoTune(const MSQAutoTune&);  // no copies
+		MSQAutoTune& operator=(const MSQAutoTune&);
+
+		// {{{ _bins()
+		void _bins() {
+			x_bins.resize(table->xSize());
+			for (int i = 0; i < table->xSize(); i++)
+				x_bins[i] = table->fileXCoord(i);
+
+			y_bins.resize(table->ySize());
+			for (int i = 0; i < table->ySize(); i++)
+				y_bins[i] = table->fileYCoord(i);
+		}
+		// }}}
+
+		// {{{ _credit()
+		void _credit(const int x, const int y, const float w, const float ratio) {
+			if (w <= 0)
+				return;
+
+			int c = x + y * x_bins.size();
+
+			weights[c] += w;
+			sums[c] += w * ratio;
+
+			if (! ready[c] && weights[c] >= min_weight) {
+				ready[c] = 1;
+				num_ready++;
+			}
+		}
+		// }}}
+
+	public:
+
+		// {{{ MSQAutoTune()
+		/**
+		 * Create a tuner for a table.
+		 *
+		 * @arg table, the x axis is rpm and the y axis is load
+		 * @arg index of each channel in the frame values
+		 * (see MSQRealTime::channelIndex()): rpm, load (the y
+		 * axis, such as fuelload) and afr1 are required, the
+		 * transient channels rpmdot, tpsDOT and tps may be -1
+		 */
+		MSQAutoTune(MSQDataTable<T, U>* _table,
+					const int _rpm_ch, const int _load_ch, const int _afr_ch,
+					const int _rpmdot_ch, const int _tpsdot_ch, const int _tps_ch)
+		{
+			table = _table;
+
+			rpm_ch = _rpm_ch;
+			load_ch = _load_ch;
+			afr_ch = _afr_ch;
+			rpmdot_ch = _rpmdot_ch;
+			tpsdot_ch = _tpsdot_ch;
+			tps_ch = _tps_ch;
+
+			// the defaults of msq-ve_tuner
+			goal_afr = 13.0;
+			min_weight = 10;
+			max_step = 0.05;
+			deadband = 0.2;
+			change_delay = 2;
+			transient_delay = 3;
+			min_value = 0;
+			max_value = 255;
+			resolution = 1;
+
+			_bins();
+
+			int n = x_bins.size() * y_bins.size();
+			weights.assign(n, 0);
+			sums.assign(n, 0);
+			changed.assign(n, 0);
+			ready.assign(n, 0);
+			num_ready = 0;
+
+			transient_time = 0;
+			num_changes = 0;
+
+			pthread_mutex_init(&lock, NULL);
+		}
+		// }}}
+
+		// {{{ ~MSQAutoTune
+		~MSQAutoTune() {
+			pthread_mutex_destroy(&lock);
+		}
+		// }}}
+
+		// {{{ setGoal(), setWeight(), setStep(), setDelays(), setLimits()
+		/**
+		 * Set the goal air fuel ratio, the default is 13.0.
+		 *
+		 * Mean ratios within the deadband (0.2 AFR by default)
+		 * of the goal are left alone.
+		 */
+		void setGoal(const float afr, const float _deadband = 0.2) {
+			goal_afr = afr;
+			deadband = _deadband;
+		}
+
+		/**
+		 * Set the weight a cell must collect before it is changed,
+		 * a frame exactly on a cell has a weight of 1.
+		 * The default is 10.
+		 */
+		void setWeight(const float weight) {
+			min_weight = weight;
+		}
+
+		/**
+		 * Set the largest change of a value at a time, as a
+		 * fraction, the default is 0.05 (5%).
+		 */
+		void setStep(const float step) {
+			max_step = step;
+		}
+
+		/**
+		 * Set the seconds to leave a cell alone after it was
+		 * changed (2 by default) and to ignore all frames after
+		 * a transient (3 by default).
+		 */
+		void setDelays(const float change, const float transient) {
+			change_delay = change;
+			transient_delay = transient;
+		}
+
+		/**
+		 * Set the range of the values and their resolution,
+		 * 0 to 255 by 1 by default.
+		 */
+		void setLimits(const float min, const float max, const float res) {
+			min_value = min;
+			max_value = max;
+			resolution = res;
+		}
+		// }}}
+
+		// {{{ frame()
+		/**
+		 * Collect a frame of real time data.
+		 *
+		 * @arg time the frame was received
+		 * @arg value of each channel (see MSQRealTime::values())
+		 *
+		 * @returns true if cells are ready to be changed (see
+		 * apply()), false otherwise
+		 */
+		bool frame(const struct timeval& tv, const vector<float>& vals) {
+			double t = tv.tv_sec + tv.tv_usec / 1.0e6;
+
+			float rpm = vals[rpm_ch];
+
+			bool transient = (rpmdot_ch > -1 && fabs(vals[rpmdot_ch]) > 400)
+					|| (tpsdot_ch > -1 && fabs(vals[tpsdot_ch]) > 50)
+					|| (tps_ch > -1 && rpm > 3000 && vals[tps_ch] < 5);
+
+			pthread_mutex_lock(&lock);
+
+			if (transient)
+				transient_time = t;
+
+			if (t - transient_time >= transient_delay && vals[afr_ch] > 0) {
+				int x, y;
+				float fx, fy;
+				msq_axis(x_bins, rpm, x, fx);
+				msq_axis(y_bins, vals[load_ch], y, fy);
+
+				float ratio = vals[afr_ch] / goal_afr;
+
+				// cells that were just changed wait for the engine
+				// to settle on the new value
+				int xs = x_bins.size();
+				int c = x + y * xs;
+				if (t - changed[c] >= change_delay)
+					_credit(x, y, (1 - fx) * (1 - fy), ratio);
+				if (x + 1 < xs && t - changed[c + 1] >= change_delay)
+					_credit(x + 1, y, fx * (1 - fy), ratio);
+				if (y + 1 < (int) y_bins.size()) {
+					if (t - changed[c + xs] >= change_delay)
+						_credit(x, y + 1, (1 - fx) * fy, ratio);
+					if (x + 1 < xs && t - changed[c + xs + 1] >= change_delay)
+						_credit(x + 1, y + 1, fx * fy, ratio);
+				}
+			}
+
+			bool any = (num_ready > 0);
+
+			pthread_mutex_unlock(&lock);
+
+			return any;
+		}
+		// }}}
+
+		// {{{ apply()
+		/**
+		 * Change the file data of the cells which are ready.
+		 *
+		 * Only the table data is changed, use writeEcu() to send
+		 * the changed cells to the ecu.
+		 *
+		 * @returns the number of cells changed
+		 */
+		int apply() {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			double t = tv.tv_sec + tv.tv_usec / 1.0e6;
+
+			int n = 0;
+
+			pthread_mutex_lock(&lock);
+
+			int xs = x_bins.size();
+			for (int c = 0; c < (int) ready.size() && num_ready > 0; c++) {
+				if (! ready[c])
+					continue;
+
+				float ratio = sums[c] / weights[c];
+
+				ready[c] = 0;
+				num_ready--;
+				weights[c] = 0;
+				sums[c] = 0;
+
+				if (fabs(ratio - 1) * goal_afr <= deadband)
+					continue;
+
+				if (ratio > 1 + max_step)
+					ratio = 1 + max_step;
+				else if (ratio < 1 - max_step)
+					ratio = 1 - max_step;
+
+				// lean (a ratio above 1) needs more fuel
+				float old_v = table->fileValue(c % xs, c / xs);
+				float v = old_v * ratio;
+
+				if (resolution > 0) {
+					v = floor(v / resolution + 0.5) * resolution;
+
+					// at least one step, small values would never move
+					if (v == old_v)
+						v += (ratio > 1) ? resolution : -resolution;
+				}
+
+				if (v < min_value)
+					v = min_value;
+				else if (v > max_value)
+					v = max_value;
+
+				if (v == old_v)
+					continue;
+
+				table->setFileValue(c % xs, c / xs, v);
+				changed[c] = t;
+				n++;
+			}
+
+			// the file may have been reloaded with new axes
+			_bins();
+
+			num_changes += n;
+
+			pthread_mutex_unlock(&lock);
+
+			return n;
+		}
+		// }}}
+
+		// {{{ changes()
+		/**
+		 * Total number of cells changed.
+		 */
+		unsigned long changes() {
+			return num_changes;
+		}
+		// }}}
+};
@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "MSQUtils.h"
+
+using namespace std;
+
+/**
+ * Statistics of the values of a channel in one cell of a table.
+ */
+struct MSQCellStat {
+	uint64_t frames;	// frames with any weight in the cell
+	double weight;		// total weight, a frame on the cell is 1
+	double mean;		// weighted mean of the values
+	double m2;			// weighted sum of squared differences from the mean
+	double dwell;		// seconds spent in the cell, weighted
+
+	/**
+	 * @returns the weighted (population) variance, 0 if empty
+	 */
+	double variance() const {
+		return (weight > 0) ? m2 / weight : 0;
+	}
+
+	double sd() const {
+		return sqrt(variance());
+	}
+};
+
+/**
+ * Running statistics of a real time channel over the cells of
+ * a table, such as afr1 over the rpm and fuelload cells of
+ * veTable1.
+ *
+ * Each frame (frame()) is credited to the four cells around it,
+ * weighted by how close it is to each (as the ecu interpolates).
+ * The mean and variance are updated in place (West's weighted
+ * algorithm) so the values of a whole session are never kept.
+ *
+ * There must be only one writer (frame()), but any number of
+ * threads may read (cell(), writeFile()) without blocking it.
+ * Each cell has a sequence number which is odd while the cell
+ * is being changed (a seqlock), a reader copies the cell and
+ * tries again if the number changed.
+ *
+ * The axes are copied when it is created, later changes to the
+ * table axes are not seen.
+ */
+class MSQCellStats {
+	private:
+		struct Cell {
+			volatile uint32_t seq;
+			MSQCellStat s;
+		};
+
+		vector<float> x_bins;
+		vector<float> y_bins;
+
+		// indexes of the channels in the frame values
+		int x_ch;
+		int y_ch;
+		int value_ch;
+
+		vector<Cell> cells;		// x + y * x size
+
+		double last_time;		// of the previous frame, 0 if none
+		double max_gap;			// longer gaps are not dwell time
+
+		MSQCellStats(const MSQCellStats&);  // no copies
+		MSQCellStats& operator=(const MSQCellStats&);
+
+		// {{{ _credit()
+		void _credit(const int c, const float w, const float v, const double dt) {
+			if (w <= 0)
+				return;
+
+			Cell& cell = cells[c];
+			MSQCellStat& s = cell.s;
+
+			cell.seq++;  // odd, being changed
+			__sync_synchronize();
+
+			s.frames++;
+			s.weight += w;
+			double delta = v - s.mean;
+			s.mean += delta * w / s.weight;
+			s.m2 += w * delta * (v - s.mean);
+			s.dwell += w * dt;
+
+			__sync_synchronize();
+			cell.seq++;  // even, done
+		}
+		// }}}
+
+	public:
+
+		// {{{ MSQCellStats()
+		/**
+		 * Create empty statistics.
+		 *
+		 * @arg bins of the x and y axes, ascending or descending
+		 * @arg index of the channel of each axis and of the value
+		 * in the frame values (see MSQRealTime::channelIndex())
+		 */
+		MSQCellStats(const vector<float>& _x_bins, const vector<float>& _y_bins,
+					const int _x_ch, const int _y_ch, const int _value_ch)
+		{
+			x_bins = _x_bins;
+			y_bins = _y_bins;
+
+			x_ch = _x_ch;
+			y_ch = _y_ch;
+			value_ch = _value_ch;
+
+			Cell empty;
+			memset(&empty, 0, sizeof(empty));
+			cells.assign(x_bins.size() * y_bins.size(), empty);
+
+			last_time = 0;
+			max_gap = 1.0;
+		}
+		// }}}
+
+		// {{{ frame()
+		/**
+		 * Collect a frame of real time data.
+		 *
+		 * The time since the previous frame is the dwell time,
+		 * unless it is over a second (such as while the serial
+		 * device was used for a table) when it is not counted.
+		 *
+		 * @arg time the frame was received
+		 * @arg value of each channel (see MSQRealTime::values())
+		 */
+		void frame(const struct timeval& tv, const vector<float>& vals) {
+			double t = tv.tv_sec + tv.tv_usec / 1.0e6;
+			double dt = t - last_time;
+			if (0 == last_time || dt < 0 || dt > max_gap)
+				dt = 0;
+			last_time = t;
+
+			int x, y;
+			float fx, fy;
+			msq_axis(x_bins, vals[x_ch], x, fx);
+			msq_axis(y_bins, vals[y_ch], y, fy);
+
+			float v = vals[value_ch];
+
+			int xs = x_bins.size();
+			int c = x + y * xs;
+
+			_credit(c, (1 - fx) * (1 - fy), v, dt);
+			if (x + 1 < xs)
+				_credit(c + 1, fx * (1 - fy), v, dt);
+			if (y + 1 < (int) y_bins.size()) {
+				_credit(c + xs, (1 - fx) * fy, v, dt);
+				if (x + 1 < xs)
+					_credit(c + xs + 1, fx * fy, v, dt);
+			}
+		}
+		// }}}
+
+		// {{{ xSize(), ySize(), cell()
+		int xSize() const {
+			return x_bins.size();
+		}
+
+		int ySize() const {
+			return y_bins.size();
+		}
+
+		/**
+		 * A consistent copy of the statistics of a cell,
+		 * safe to call while another thread calls frame().
+		 */
+		MSQCellStat cell(const int x, const int y) const {
+			const Cell& cell = cells[x + y * x_bins.size()];
+			MSQCellStat s;
+
+			while (1) {
+				uint32_t seq = cell.seq;
+				if (seq & 1)
+					continue;  // being changed
+
+				__sync_synchronize();
+				s = cell.s;
+				__sync_synchronize();
+
+				if (seq == cell.seq)
+					break;
+			}
+
+			return s;
+		}
+		// }}}
+
+		// {{{ writeFile()
+		/**
+		 * Write a snapshot of all the cells as comma separated
+		 * values, one line per cell:
+		 *
+		 *   x,y,x_bin,y_bin,frames,weight,mean,sd,dwell
+		 *
+		 * The file is written under another name and then
+		 * renamed so that a reader never sees a partial file.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool writeFile(const string& file) const {
+			string tmp = file + ".tmp";
+			ofstream out(tmp.c_str(), ios_base::trunc);
+			if (out.fail()) {
+				perror(("unable to open " + tmp).c_str());
+				return true;  // error
+			}
+
+			out << "x,y,x_bin,y_bin,frames,weight,mean,sd,dwell\n";
+
+			for (int y = 0; y < ySize(); y++) {
+				for (int x = 0; x < xSize(); x++) {
+					MSQCellStat s = cell(x, y);
+
+					out << x << "," << y << ","
+						<< x_bins[x] << "," << y_bins[y] << ","
+						<< s.frames << "," << s.weight << ","
+						<< s.mean << "," << s.sd() << ","
+						<< s.dwell << "\n";
+				}
+			}
+
+			out.close();
+			if (out.fail()) {
+				perror(("unable to write " + tmp).c_str());
+				return true;  // error
+			}
+
+			if (-1 == rename(tmp.c_str(), file.c_str())) {
+				perror(("unable to rename " + tmp).c_str());
+				return true;  // error
+			}
+
+			return false;  // OK
+		}
+		// }}}
+};
@@ -21,6 +21,8 @@
 #include <string>
 #include <iostream>
 
+#include <sys/stat.h>
+
 using namespace std;
 
 /**
@@ -40,10 +42,12 @@ using namespace std;
 //template <class T>
 class MSQData {
 	private:
-		time_t file_last_modified;
+		struct timespec file_written;  // see fileWritten()
 		string name;
 		string file_name;
 
+		bool file_modified;  // see setFileModified()
+
 		MSQData() {};  // prevent use of uninitialized constructor
 	public:
 		virtual ~MSQData() {};
@@ -51,6 +55,9 @@ class MSQData {
 		MSQData(string _name, string _file_name) {
 			name = _name;
 			file_name = _file_name;
+			file_modified = false;
+			file_written.tv_sec = 0;
+			file_written.tv_nsec = 0;
 		}
 
 		/**
@@ -83,9 +90,71 @@ class MSQData {
 		 * it internally.
 		 *
 		 * @returns true on error, false otherwise
+		 *
+		 * If the file cannot be read, perhaps because it is in
+		 * the middle of being written, it is retried several times.
 		 */
 		virtual bool readFile()=0;
 
+		/**
+		 * Read the data from its associated file once, without
+		 * retrying.
+		 *
+		 * This is for when the file is known to be complete, such
+		 * as after a notification that it was closed.
+		 * Either read operation clears the file modified flag.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		virtual bool loadFile()=0;
+
+		/**
+		 * Mark whether the associated file has been modified
+		 * since it was last read.
+		 *
+		 * This is set by whatever watches the file (such as the
+		 * inotify watch in msqdev) so that only the data which
+		 * actually changed has to be read and compared.
+		 */
+		void setFileModified(const bool modified) {
+			file_modified = modified;
+		}
+
+		/**
+		 * Has the associated file been modified since it was read?
+		 *
+		 * @returns true if yes, false if no
+		 */
+		bool fileModified() {
+			return file_modified;
+		}
+
+		/**
+		 * Remember the modification time of the associated file
+		 * after writing it, so that the notification of our own
+		 * write can be told apart (see ownFileWrite()).
+		 */
+		void fileWritten() {
+			struct stat st;
+			if (0 == stat(file_name.c_str(), &st))
+				file_written = st.st_mtim;
+		}
+
+		/**
+		 * Is the associated file still as it was last written
+		 * (see fileWritten())?
+		 *
+		 * @returns true if yes, false if it was changed since
+		 */
+		bool ownFileWrite() {
+			struct stat st;
+			if (0 != stat(file_name.c_str(), &st))
+				return false;
+
+			return st.st_mtim.tv_sec == file_written.tv_sec
+					&& st.st_mtim.tv_nsec == file_written.tv_nsec;
+		}
+
 		/**
 		 * Write the currently stored FILE data to the ecu.
 		 *
@@ -20,10 +20,14 @@
 #include "LookUpTable.h"
 #include "MSQSerial.h"
 #include "MSQData.h"
+#include "MSQPageCache.h"
+#include "MSQUtils.h"
 
+#include <algorithm>  // sort()
 #include <cmath>  // fabs()
 #include <iostream>
 #include <set>
+#include <vector>
 #include <unistd.h> // sleep
 
 #ifndef DEBUG
@@ -46,6 +50,7 @@ class MSQDataTable : public MSQData
 		int y_size;
 
 		MSQSerial* serial;
+		MSQPageCache* cache;  // NULL if pages are not cached
 
 		// cmd_r options
 		int x_idx;
@@ -66,6 +71,22 @@ class MSQDataTable : public MSQData
 		float v_add;
 		float v_mult;
 
+		// Unchanged bytes allowed between two changes that
+		// are written with a single command (see setWriteGap()).
+		int write_gap;
+
+		// parts of a table as stored on the ecu
+		enum { X, Y, V, END };
+
+		// Elements of each part (in ecu order) where the file data
+		// differs from the ecu data.
+		// The flags are exact, the list holds the index of every
+		// element that was flagged since the last write and may
+		// include some that have since been cleared (see _mark()).
+		vector<char> dirty[END];
+		vector<int> dirty_list[END];
+		int num_dirty;
+
 		MSQDataTable() {};  // prevent use of the default constructor
 
 		// table_idx'es that have changed and need to be burned
@@ -94,6 +115,7 @@ class MSQDataTable : public MSQData
 			// for when the ecu data is copied to the file data.
 
 			serial = _serial;
+			cache = NULL;
 
 			x_size = _x_size;
 			y_size = _y_size;
@@ -115,6 +137,12 @@ class MSQDataTable : public MSQData
 			y_type = _y_type; // TODO - check types
 			y_add = _y_add;
 			y_mult = _y_mult;
+
+			write_gap = 8;
+
+			for (int i = 0; i < END; i++)
+				dirty[i].assign(_part_size(i), 0);
+			num_dirty = 0;
 		};
 		// }}}
 
@@ -139,8 +167,6 @@ class MSQDataTable : public MSQData
 			//  the x coordinates, y coordinates, and the values.
 			// Each one must be obtained seperately and aggregated together.
 
-			enum { X, Y, V, END };
-
 			for (int i = 0; i < END; i++) {
 				string type;
 				if (X == i)
@@ -154,19 +180,13 @@ class MSQDataTable : public MSQData
 					return true; // error
 				}
 
-				int byte_mult = 1;
-				if (type == "U16")
-					byte_mult = 2;
-				else if (type == "U08")
-					byte_mult = 1;
-				else if (type == "S16")
-					byte_mult = 2;
-				else if (type == "S08")
-					byte_mult = 1;
-				else {
-					cerr << "unknown byte_mult '" << byte_mult << "'\n";
+				MSQType data_type = strToType(type);
+				int byte_mult = typeBytes(data_type);
+				if (0 == byte_mult) {
+					cerr << "unknown type '" << type << "'\n";
 					return true; // error
 				}
+				MSQDecodeFn decode = decoderFor(data_type);
 
 				float mult;
 				float add;
@@ -203,7 +223,11 @@ class MSQDataTable : public MSQData
 				// The values read are always integers (signed, unsigned, 8, 16),
 				// they will be converted to floats later if needed.
 
-				int n = serial->cmd_r(idx, offset, num_bytes, buf);
+				int n;
+				if (cache != NULL)
+					n = cache->read(idx, offset, num_bytes, buf);
+				else
+					n = serial->cmd_r(idx, offset, num_bytes, buf);
 				if (num_bytes != n) {
 					// read error
 					delete[] buf; 
@@ -213,31 +237,9 @@ class MSQDataTable : public MSQData
 					return true;  // error
 				}
 
-				// TODO - use bufToValue()
-
 				// convert the values by their integer type
 				for (int j = 0, k = 0; j < num_bytes; j += byte_mult, k++) {
-					if ("U16" == type) {
-						unsigned short s;
-						s = buf[j] & 0xFF;
-						s = (s << 8);
-						s = (buf[j+1] & 0xFF) | s;
-						vals[k] = s;
-					} else if ("S16" == type) {
-						short s;
-						s = buf[j] & 0xFF;
-						s = (s << 8);
-						s = (buf[j+1] & 0xFF) | s;
-						vals[k] = s;
-					} else if ("U08") {
-						unsigned char c;
-						c = buf[j] & 0xFF;
-						vals[k] = c;
-					} else if ("S08") {
-						char c;
-						c = buf[j] & 0xFF;
-						vals[k] = c;
-					}
+					vals[k] = (int) decode(&buf[j]);
 				}
 
 				// Assign the values/coordinates to the look up table.
@@ -279,6 +281,24 @@ class MSQDataTable : public MSQData
 				delete[] buf; 
 				delete[] vals; 
 			}
+			_update_dirty();
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ loadFile()
+		bool loadFile() {
+			setFileModified(false);
+
+			bool err = (! file_data->load_file());
+
+			// even a failed load may have changed some values
+			_update_dirty();
+
+			if (err) {
+				return true;  // error
+			}
 
 			return false;  // OK
 		}
@@ -290,7 +310,7 @@ class MSQDataTable : public MSQData
 			int max_err = 5;
 
 			while (1) {
-				if (! file_data->load_file()) {
+				if (loadFile()) {
 					n++;
 
 					if (n >= max_err) {
@@ -314,39 +334,273 @@ class MSQDataTable : public MSQData
 		// {{{ writeEcu()
 	private:
 
-		// {{{ _type_val_buf()
-		void _type_val_buf(const string type, const float v, int &num_bytes,
-							char* bytes)
+		// {{{ _part_size(), _part_get()
+		/*
+		 * Each part of a table (X coordinates, Y coordinates and
+		 * Values) is stored on the ecu as a flat array.
+		 * These map an index in to that array to the corresponding
+		 * element of a LookUpTable.
+		 */
+		int _part_size(const int part) {
+			if (X == part)
+				return x_size;
+			else if (Y == part)
+				return y_size;
+
+			return x_size * y_size;
+		}
+
+		float _part_get(LookUpTable<T, U>* tbl, const int part, const int j) {
+			if (X == part)
+				return tbl->get_x_coord(j);
+			else if (Y == part)
+				return tbl->get_y_coord((y_size - 1) - j);  // reverse
+
+			// values are stored by rows, starting from the last row
+			return tbl->get(j % x_size, (y_size - 1) - (j / x_size));
+		}
+
+		bool _part_changed(const int part, const int j) {
+			float eval = _part_get(ecu_data, part, j);
+			float fval = _part_get(file_data, part, j);
+
+			return (fabs(eval - fval) >= EPSILON);
+		}
+
+		void _part_set(LookUpTable<T, U>* tbl, const int part, const int j,
+						const float v)
+		{
+			if (X == part)
+				tbl->set_x_coord(j, v);
+			else if (Y == part)
+				tbl->set_y_coord((y_size - 1) - j, v);
+			else
+				tbl->set(j % x_size, (y_size - 1) - (j / x_size), v);
+		}
+		// }}}
+
+		// {{{ _mark(), _update_dirty(), _clear_dirty()
+		/*
+		 * Update the dirty flag of one element after either copy
+		 * of it has changed.
+		 *
+		 * Clearing a flag does not remove it from the list since
+		 * that would require a search, stale entries are skipped
+		 * by _write_part().
+		 */
+		void _mark(const int part, const int j) {
+			bool changed = _part_changed(part, j);
+
+			if (changed && ! dirty[part][j]) {
+				dirty[part][j] = 1;
+				dirty_list[part].push_back(j);
+				num_dirty++;
+			} else if (! changed && dirty[part][j]) {
+				dirty[part][j] = 0;
+				num_dirty--;
+			}
+		}
+
+		/*
+		 * Compare every element, needed only when a whole copy
+		 * has been replaced (readEcu(), loadFile()).
+		 */
+		void _update_dirty() {
+			_clear_dirty();
+
+			for (int i = 0; i < END; i++) {
+				int size = _part_size(i);
+				for (int j = 0; j < size; j++)
+					_mark(i, j);
+			}
+		}
+
+		void _clear_dirty() {
+			for (int i = 0; i < END; i++) {
+				vector<int>::iterator it;
+				for (it = dirty_list[i].begin(); it != dirty_list[i].end(); it++)
+					dirty[i][*it] = 0;
+				dirty_list[i].clear();
+			}
+			num_dirty = 0;
+		}
+		// }}}
+
+		// {{{ _write_part()
+		/*
+		 * Write the changed elements of one part of a table to the ecu.
+		 *
+		 * Only the elements in the dirty list are visited.
+		 * Changed elements are gathered in to contiguous runs and
+		 * each run is sent with a single cmd_w().
+		 * Runs separated by no more than write_gap bytes of unchanged
+		 * elements are merged, since re-sending a few unchanged bytes
+		 * is cheaper than another command.
+		 * Once a run is written it is copied to the ecu data.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool _write_part(const int part, const int idx, MSQEncodeFn encode,
+							const int offset, const float mult,
+							const float add, const int byte_mult)
 		{
-			if ("U16" == type) {
-				unsigned short s = v;
-				bytes[1] = s & 0xFF;
-				s = s & (0xFF << 8);
-				s = s >> 8;
-				bytes[0] = s;
-				num_bytes = 2;
-			} else if ("S16" == type) {
-				signed short s = v;
-				bytes[1] = s & 0xFF;
-				s = s & (0xFF << 8);
-				s = s >> 8;
-				bytes[0] = s;
-				num_bytes = 2;
-			} else if ("U08") {
-				unsigned char c = v;
-				bytes[0] = c & 0xFF;
-				num_bytes = 1;
-			} else if ("S08") {
-				unsigned char c = v;
-				bytes[0] = c & 0xFF;
-				num_bytes = 1;
+			int gap = write_gap / byte_mult;  // in elements
+
+			// put the changes in order, without duplicates or
+			// elements that are no longer dirty
+			vector<int>& list = dirty_list[part];
+			sort(list.begin(), list.end());
+			list.erase(unique(list.begin(), list.end()), list.end());
+
+			vector<int> changes;
+			changes.reserve(list.size());
+			for (unsigned int c = 0; c < list.size(); c++) {
+				if (dirty[part][list[c]])
+					changes.push_back(list[c]);
+			}
+			list = changes;
+
+			unsigned int c = 0;
+			while (c < changes.size()) {
+
+				// find the end of this run (one past the last change)
+				int start = changes[c];
+				int end = start + 1;
+				for (c++; c < changes.size() && (changes[c] - end) <= gap; c++) {
+					end = changes[c] + 1;
+				}
+
+				// de-translate and convert the whole run
+				int num_bytes = (end - start) * byte_mult;
+				char* buf = new char[num_bytes];
+
+				for (int k = start; k < end; k++) {
+					float fval = _part_get(file_data, part, k);
+
+					fval /= mult;
+					fval -= add;
+					// division should be performed in floating point
+					// to minimize roundoff errors.
+
+					encode(fval, &buf[(k - start) * byte_mult]);
+				}
+
+				if (-1 == serial->cmd_w(idx, offset + start * byte_mult, num_bytes, buf)) {
+					delete[] buf;
+
+					cerr << "serial->cmd_w error\n";
+					return true;  // error
+				}
+
+				if (cache != NULL)
+					cache->written(idx, offset + start * byte_mult, num_bytes, buf);
+
+				delete[] buf;
+
+				need_burn.insert(idx);
+
+				for (int k = start; k < end; k++) {
+					_part_set(ecu_data, part, k, _part_get(file_data, part, k));
+
+					if (dirty[part][k]) {
+						dirty[part][k] = 0;
+						num_dirty--;
+					}
+				}
 			}
+			list.clear();
+
+			return false;  // OK
 		}
 		// }}}
 
 	public:
+
+		// {{{ setWriteGap()
+		/**
+		 * Set the number of unchanged bytes that may separate two
+		 * changes and still be sent together by writeEcu().
+		 *
+		 * A value of zero only merges changes that are adjacent.
+		 */
+		void setWriteGap(const int bytes) {
+			write_gap = (bytes < 0) ? 0 : bytes;
+		}
+		// }}}
+
+		// {{{ setCache()
+		/**
+		 * Read the ecu through a page cache, and keep it up to
+		 * date when writing.
+		 *
+		 * @arg opened cache, or NULL to read the ecu directly
+		 */
+		void setCache(MSQPageCache* _cache) {
+			cache = _cache;
+		}
+		// }}}
+
+		// {{{ xSize(), ySize(), fileXCoord(), fileYCoord()
+		int xSize() {
+			return x_size;
+		}
+
+		int ySize() {
+			return y_size;
+		}
+
+		/**
+		 * Get a coordinate of the x axis of the file data.
+		 *
+		 * @arg x index, 0 to x size - 1
+		 */
+		U fileXCoord(const int x) {
+			return file_data->get_x_coord(x);
+		}
+
+		/**
+		 * Get a coordinate of the y axis of the file data.
+		 *
+		 * @arg y index, 0 to y size - 1
+		 */
+		U fileYCoord(const int y) {
+			return file_data->get_y_coord(y);
+		}
+		// }}}
+
+		// {{{ fileValue(), setFileValue()
+		/**
+		 * Get a value of the file data.
+		 *
+		 * @arg x index, 0 to x size - 1
+		 * @arg y index, 0 to y size - 1
+		 */
+		T fileValue(const int x, const int y) {
+			return file_data->get(x, y);
+		}
+
+		/**
+		 * Change a value of the file data.
+		 *
+		 * Like loading the file, this only changes the stored data,
+		 * use writeEcu() and writeFile() to send it anywhere.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool setFileValue(const int x, const int y, const T v) {
+			if (x < 0 || x >= x_size || y < 0 || y >= y_size)
+				return true;  // error
+
+			if (! file_data->set(x, y, v))
+				return true;  // error
+
+			_mark(V, ((y_size - 1) - y) * x_size + x);
+
+			return false;  // OK
+		}
+		// }}}
+
 		bool writeEcu() {
-			enum { X, Y, V, END };
 
 			for (int i = 0; i < END; i++) {
 				string type;
@@ -359,17 +613,13 @@ class MSQDataTable : public MSQData
 				else
 					return true; // error
 
-				int byte_mult = 1;
-				if (type == "U16")
-					byte_mult = 2;
-				else if (type == "U08")
-					byte_mult = 1;
-				else if (type == "S16")
-					byte_mult = 2;
-				else if (type == "S08")
-					byte_mult = 1;
-				else
+				MSQType data_type = strToType(type);
+				int byte_mult = typeBytes(data_type);
+				if (0 == byte_mult) {
+					cerr << "unknown type '" << type << "'\n";
 					return true; // error
+				}
+				MSQEncodeFn encode = encoderFor(data_type);
 
 				float mult;
 				float add;
@@ -394,87 +644,11 @@ class MSQDataTable : public MSQData
 					return true;  // error
 				}
 
-				// find differences and write changes
-
-				if (X == i) {
-					for (int j = 0; j < x_size; j++) {
-						T eval = ecu_data->get_y_coord(j);
-						T fval = file_data->get_y_coord(j);
-						if (fabs(eval - fval) < EPSILON) {
-							continue;  // no differences
-						}
-						// de-translate and write a single value
-
-						fval /= mult;
-						fval -= add;
-
-						char buf[2];
-						int num_bytes = 0;
-
-						_type_val_buf(type, fval, num_bytes, buf);
-
-						if (-1 == serial->cmd_w(idx, offset + j * byte_mult, num_bytes, buf)) {
-							cerr << "serial->cmd_w X error\n";
-							return true;  // error
-						}
-						need_burn.insert(idx);
-					}
-				} else if (Y == i) {
-					for (int j = 0; j < y_size; j++) {
-
-						T eval = ecu_data->get_y_coord(j);
-						T fval = file_data->get_y_coord(j);
-						if (fabs(eval - fval) < EPSILON) {
-							continue;
-						}
-
-						fval /= mult;
-						fval -= add;
-						// division should be performed in floating point
-						// to minimize roundoff errors.
-
-						char buf[2];
-						int num_bytes;
-
-						_type_val_buf(type, fval, num_bytes, buf);
-
-						if (-1 == serial->cmd_w(idx, offset + ((y_size - 1) - j) * byte_mult, num_bytes, buf)) {
-							cerr << "serial->cmd_w Y error\n";
-							return true;  // error
-						}
-						need_burn.insert(idx);
-					}
-				} else if (V == i) {
-					int p = 0;
-					//int size = x_size * y_size;
-					for (int y = 0; y < y_size; y++) {
-						for (int x = 0; x < x_size; x++, p++) {
-							int _y = (y_size - 1) - y;  // reverse
-
-							T eval = ecu_data->get(x, _y);
-							T fval = file_data->get(x, _y);
-							if (fabs(eval - fval) < EPSILON) {
-								continue;
-							}
-							
-							fval /= mult;
-							fval -= add;
-
-							char buf[2];
-							int num_bytes;
-
-							_type_val_buf(type, fval, num_bytes, buf);
-
-							if (-1 == serial->cmd_w(idx, offset + (p * byte_mult), num_bytes, buf)) {
-								cerr << "serial->cmd_w error\n";
-								return true;  // error
-							}
-							need_burn.insert(idx);
-						}
-					}
+				// write the changes
+				if (_write_part(i, idx, encode, offset, mult, add, byte_mult)) {
+					return true;  // error
 				}
 			}
-			*ecu_data = *file_data;
 
 			return false;  // OK
 		}
@@ -517,12 +691,17 @@ class MSQDataTable : public MSQData
 		// {{{ cpEcuToFile()
 		void cpEcuToFile() {
 			*file_data = *ecu_data;
+			_clear_dirty();
 		}
 		// }}}
 
 		// {{{ hasChanges
+		/*
+		 * The differences are tracked as the data changes
+		 * so this does not compare the tables.
+		 */
 		bool hasChanges() {
-			return (*ecu_data != *file_data);
+			return (num_dirty > 0);
 		}
 		// }}}
 
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstring>
+#include <sys/time.h>
+
+/**
+ * A lock free queue of real time data frames for exactly one
+ * producer thread and one consumer thread.
+ *
+ * All of the slots are allocated when it is constructed, push()
+ * and pop() only copy a frame and never block.
+ * If the queue is full the new frame is dropped and counted
+ * so that a slow consumer can never stall the producer.
+ */
+class MSQFrameQueue {
+	private:
+		unsigned long capacity;
+		unsigned int frame_bytes;
+
+		char* frames;
+		struct timeval* times;
+
+		// Total frames pushed and popped.  Each is only changed by
+		// one thread, the difference is the current depth.
+		volatile unsigned long head;
+		volatile unsigned long tail;
+
+		// statistics, only changed by the producer
+		volatile unsigned long num_dropped;
+		volatile unsigned long max_depth;
+
+		MSQFrameQueue() {};  // prevent use of the default constructor
+		MSQFrameQueue(const MSQFrameQueue&);  // no copies
+		MSQFrameQueue& operator=(const MSQFrameQueue&);
+
+	public:
+
+		// {{{ MSQFrameQueue(capacity, frame_bytes)
+		/**
+		 * Create a new queue.
+		 *
+		 * @arg maximum number of frames held
+		 * @arg bytes in each frame
+		 */
+		MSQFrameQueue(const unsigned long _capacity,
+						const unsigned int _frame_bytes)
+		{
+			capacity = (_capacity > 0) ? _capacity : 1;
+			frame_bytes = _frame_bytes;
+
+			frames = new char[capacity * frame_bytes];
+			times = new struct timeval[capacity];
+
+			head = 0;
+			tail = 0;
+			num_dropped = 0;
+			max_depth = 0;
+		}
+		// }}}
+
+		// {{{ ~MSQFrameQueue
+		~MSQFrameQueue() {
+			delete[] frames;
+			delete[] times;
+		}
+		// }}}
+
+		// {{{ push()
+		/**
+		 * Add a frame to the queue (producer only).
+		 *
+		 * @arg time the frame was received
+		 * @arg frame of frame_bytes
+		 *
+		 * @returns true if the queue was full and the frame was
+		 * dropped, false otherwise
+		 */
+		bool push(const struct timeval& tv, const char* frame) {
+			unsigned long h = head;
+			unsigned long depth = h - tail;
+
+			if (depth >= capacity) {
+				num_dropped = num_dropped + 1;
+				return true;  // full
+			}
+
+			unsigned long slot = h % capacity;
+			memcpy(&frames[slot * frame_bytes], frame, frame_bytes);
+			times[slot] = tv;
+
+			// the frame must be complete before it is visible
+			__sync_synchronize();
+			head = h + 1;
+
+			if (depth + 1 > max_depth)
+				max_depth = depth + 1;
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ pop()
+		/**
+		 * Remove the oldest frame from the queue (consumer only).
+		 *
+		 * @arg time the frame was received
+		 * @arg buffer of at least frame_bytes
+		 *
+		 * @returns true if the queue was empty, false otherwise
+		 */
+		bool pop(struct timeval& tv, char* frame) {
+			unsigned long t = tail;
+
+			if (t == head)
+				return true;  // empty
+
+			// do not read the frame before seeing head
+			__sync_synchronize();
+
+			unsigned long slot = t % capacity;
+			memcpy(frame, &frames[slot * frame_bytes], frame_bytes);
+			tv = times[slot];
+
+			// the copy must be done before the slot is reused
+			__sync_synchronize();
+			tail = t + 1;
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ statistics
+		/**
+		 * Number of frames currently in the queue.
+		 */
+		unsigned long depth() {
+			unsigned long t = tail;
+			return head - t;
+		}
+
+		/**
+		 * Largest number of frames that have been in the queue.
+		 */
+		unsigned long maxDepth() {
+			return max_depth;
+		}
+
+		/**
+		 * Total number of frames that were pushed.
+		 */
+		unsigned long pushed() {
+			return head;
+		}
+
+		/**
+		 * Total number of frames dropped because the queue was full.
+		 */
+		unsigned long dropped() {
+			return num_dropped;
+		}
+
+		unsigned int frameBytes() {
+			return frame_bytes;
+		}
+		// }}}
+};
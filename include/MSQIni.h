@@ -0,0 +1,706 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "MSQUtils.h"
+
+using namespace std;
+
+// {{{ MSQIniConstant, MSQIniChannel, MSQIniTable
+/**
+ * A value stored in a page of the ecu ([Constants]).
+ *
+ * The user value is (raw + translate) * scale.
+ */
+struct MSQIniConstant {
+	string name;
+	string cls;			// scalar, array or bits
+	string type;		// U08, S16, ...
+	MSQType data_type;
+	int page;			// as numbered in the ini, from 1
+	int tbl_idx;		// of the page (pageIdentifier)
+	int offset;
+	int x_size;			// [x_size] or [x_sizexy_size], 1 for scalars
+	int y_size;
+	string units;
+	float scale;
+	float translate;
+};
+
+/**
+ * A value in the real time data ([OutputChannels]).
+ *
+ * Channels which are computed from others ({ ... }) are not
+ * included since they are not in the data sent by the ecu.
+ */
+struct MSQIniChannel {
+	string name;
+	string cls;			// scalar or bits
+	string type;
+	MSQType data_type;
+	int offset;
+	string units;
+	float scale;
+	float translate;
+	int bit_lo;			// bits only, [bit_lo:bit_hi]
+	int bit_hi;
+};
+
+/**
+ * A table as shown by the table editor ([TableEditor]),
+ * made of three constants.
+ */
+struct MSQIniTable {
+	string id;
+	string title;
+	string x_bins;		// constant of the x coordinates
+	string x_channel;	// real time channel of the x axis
+	string y_bins;
+	string y_channel;
+	string z_bins;		// constant of the values
+};
+// }}}
+
+/**
+ * Reader of a MegaSquirt ini file.
+ *
+ * Only what msqdev needs is read: the page layout and delays,
+ * the constants, the real time channels, the burst command and
+ * the tables.
+ *
+ * The file is read once (load()) and every entry is converted,
+ * checked and indexed by name, so nothing is parsed after that.
+ *
+ * The preprocessor lines (#set, #unset, #if, #else, #endif) are
+ * applied while reading.  Symbols which are not set in the file,
+ * such as CELSIUS or LAMBDA, can be set with define() before the
+ * file is loaded.
+ */
+class MSQIni {
+	private:
+		set<string> symbols;
+
+		string file;
+		int line_num;
+		int num_errors;
+
+		int page_delay;			// pageActivationDelay
+		int write_delay;		// interWriteDelay
+		vector<int> page_sizes;	// pageSize, for each page
+		vector<int> page_ids;	// tbl_idx of pageIdentifier, for each page
+
+		int och_block_size;
+		string burst_command;	// getCommand in [BurstMode]
+
+		vector<MSQIniConstant> constants;
+		map<string, int> constant_names;
+
+		vector<MSQIniChannel> channels;
+		map<string, int> channel_names;
+
+		vector<MSQIniTable> tables;
+		map<string, int> table_names;  // by z_bins and by id
+
+		// {{{ _error()
+		void _error(const string msg) {
+			cerr << file << ":" << line_num << ": " << msg << "\n";
+			num_errors++;
+		}
+		// }}}
+
+		// {{{ _trim(), _unquote(), _unescape()
+		static string _trim(const string& s) {
+			string::size_type a = s.find_first_not_of(" \t\r\n");
+			if (string::npos == a)
+				return "";
+
+			string::size_type b = s.find_last_not_of(" \t\r\n");
+
+			return s.substr(a, b - a + 1);
+		}
+
+		static string _unquote(const string& s) {
+			if (s.size() >= 2 && '"' == s[0] && '"' == s[s.size() - 1])
+				return s.substr(1, s.size() - 2);
+
+			return s;
+		}
+
+		/*
+		 * Convert the \x00 style escapes of a command string.
+		 */
+		static string _unescape(const string& s) {
+			string out;
+
+			for (string::size_type i = 0; i < s.size(); i++) {
+				if ('\\' == s[i] && i + 3 < s.size() && 'x' == s[i + 1]) {
+					out += (char) strtol(s.substr(i + 2, 2).c_str(), NULL, 16);
+					i += 3;
+				} else {
+					out += s[i];
+				}
+			}
+
+			return out;
+		}
+		// }}}
+
+		// {{{ _strip_comment(), _split()
+		/*
+		 * Remove a ';' comment, ignoring any inside quotes.
+		 */
+		static string _strip_comment(const string& line) {
+			bool quoted = false;
+
+			for (string::size_type i = 0; i < line.size(); i++) {
+				if ('"' == line[i])
+					quoted = !quoted;
+				else if (';' == line[i] && !quoted)
+					return line.substr(0, i);
+			}
+
+			return line;
+		}
+
+		/*
+		 * Split a value on the commas that are not inside
+		 * quotes, braces or brackets.
+		 */
+		static vector<string> _split(const string& value) {
+			vector<string> fields;
+			string field;
+			bool quoted = false;
+			int depth = 0;
+
+			for (string::size_type i = 0; i < value.size(); i++) {
+				char c = value[i];
+
+				if ('"' == c)
+					quoted = !quoted;
+				else if (!quoted && ('{' == c || '[' == c))
+					depth++;
+				else if (!quoted && ('}' == c || ']' == c))
+					depth--;
+
+				if (',' == c && !quoted && 0 == depth) {
+					fields.push_back(_trim(field));
+					field.clear();
+				} else {
+					field += c;
+				}
+			}
+			fields.push_back(_trim(field));
+
+			return fields;
+		}
+		// }}}
+
+		// {{{ _shape()
+		/*
+		 * Parse an array shape, "[16x16]" or "[ 12]".
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		static bool _shape(const string& s, int& x_size, int& y_size) {
+			if (s.size() < 3 || '[' != s[0] || ']' != s[s.size() - 1])
+				return true;  // error
+
+			string inner = s.substr(1, s.size() - 2);
+			string::size_type x = inner.find('x');
+
+			x_size = atoi(inner.substr(0, x).c_str());
+			y_size = (string::npos == x) ? 1 : atoi(inner.substr(x + 1).c_str());
+
+			if (x_size <= 0 || y_size <= 0)
+				return true;  // error
+
+			return false;  // OK
+		}
+
+		/*
+		 * Parse a bit range, "[2:3]".
+		 */
+		static bool _bits(const string& s, int& lo, int& hi) {
+			string::size_type colon = s.find(':');
+
+			if (s.size() < 5 || '[' != s[0] || string::npos == colon)
+				return true;  // error
+
+			lo = atoi(s.substr(1, colon - 1).c_str());
+			hi = atoi(s.substr(colon + 1).c_str());
+
+			return (lo < 0 || hi < lo || hi > 31);
+		}
+		// }}}
+
+		// {{{ _constant()
+		/*
+		 * name = scalar, type, offset, units, scale, translate, ...
+		 * name = array,  type, offset, shape, units, scale, translate, ...
+		 * name = bits,   type, offset, [lo:hi], labels ...
+		 */
+		void _constant(const string& name, const vector<string>& f,
+						const int page)
+		{
+			MSQIniConstant c;
+
+			c.name = name;
+			c.cls = f[0];
+			c.type = (f.size() > 1) ? f[1] : "";
+			c.data_type = strToType(c.type);
+			c.page = page;
+			c.offset = (f.size() > 2) ? atoi(f[2].c_str()) : -1;
+			c.x_size = 1;
+			c.y_size = 1;
+			c.scale = 1;
+			c.translate = 0;
+
+			if (MSQ_BAD_TYPE == c.data_type) {
+				_error("unknown type '" + c.type + "' of '" + name + "'");
+				return;
+			}
+
+			if (page < 1 || page > (int) page_ids.size()) {
+				_error("'" + name + "' is not in a known page");
+				return;
+			}
+			c.tbl_idx = page_ids[page - 1];
+
+			unsigned int n = 3;  // next field
+			if ("array" == c.cls) {
+				if (f.size() < 4 || _shape(f[3], c.x_size, c.y_size)) {
+					_error("bad shape of '" + name + "'");
+					return;
+				}
+				n = 4;
+			} else if ("bits" == c.cls) {
+				n = f.size();  // only labels follow
+			}
+
+			if (n < f.size())
+				c.units = _unquote(f[n]);
+			if (n + 1 < f.size())
+				c.scale = atof(f[n + 1].c_str());
+			if (n + 2 < f.size())
+				c.translate = atof(f[n + 2].c_str());
+
+			int bytes = c.x_size * c.y_size * typeBytes(c.data_type);
+			if (c.offset < 0 || c.offset + bytes > page_sizes[page - 1]) {
+				_error("'" + name + "' does not fit in its page");
+				return;
+			}
+
+			constant_names[name] = constants.size();
+			constants.push_back(c);
+		}
+		// }}}
+
+		// {{{ _channel()
+		/*
+		 * name = scalar, type, offset, units, scale, translate
+		 * name = bits,   type, offset, [lo:hi]
+		 */
+		void _channel(const string& name, const vector<string>& f) {
+			MSQIniChannel c;
+
+			c.name = name;
+			c.cls = f[0];
+			c.type = (f.size() > 1) ? f[1] : "";
+			c.data_type = strToType(c.type);
+			c.offset = (f.size() > 2) ? atoi(f[2].c_str()) : -1;
+			c.scale = 1;
+			c.translate = 0;
+			c.bit_lo = 0;
+			c.bit_hi = 0;
+
+			if (MSQ_BAD_TYPE == c.data_type) {
+				_error("unknown type '" + c.type + "' of '" + name + "'");
+				return;
+			}
+
+			if ("bits" == c.cls) {
+				if (f.size() < 4 || _bits(f[3], c.bit_lo, c.bit_hi)) {
+					_error("bad bits of '" + name + "'");
+					return;
+				}
+			} else {
+				if (f.size() > 3)
+					c.units = _unquote(f[3]);
+				if (f.size() > 4)
+					c.scale = atof(f[4].c_str());
+				if (f.size() > 5)
+					c.translate = atof(f[5].c_str());
+			}
+
+			// The block size may not be known yet, offsets
+			// are checked once the whole file is read.
+
+			channel_names[name] = channels.size();
+			channels.push_back(c);
+		}
+		// }}}
+
+		// {{{ _check()
+		/*
+		 * Check what can only be checked once everything is read.
+		 */
+		void _check() {
+			line_num = 0;
+
+			for (unsigned int i = 0; i < channels.size(); i++) {
+				const MSQIniChannel& c = channels[i];
+
+				if (c.offset < 0
+					|| c.offset + typeBytes(c.data_type) > och_block_size)
+				{
+					_error("channel '" + c.name + "' is beyond ochBlockSize");
+				}
+			}
+
+			for (unsigned int i = 0; i < tables.size(); i++) {
+				const MSQIniTable& t = tables[i];
+
+				const MSQIniConstant* x = constant(t.x_bins);
+				const MSQIniConstant* y = constant(t.y_bins);
+				const MSQIniConstant* z = constant(t.z_bins);
+
+				if (NULL == x || NULL == y || NULL == z) {
+					// tables of other firmware options
+					continue;
+				}
+
+				if (x->x_size != z->x_size || y->x_size != z->y_size)
+					_error("table '" + t.id + "' bins do not match its shape");
+			}
+		}
+		// }}}
+
+		// {{{ _clear()
+		void _clear() {
+			page_delay = 0;
+			write_delay = 0;
+			page_sizes.clear();
+			page_ids.clear();
+			och_block_size = 0;
+			burst_command = "";
+			constants.clear();
+			constant_names.clear();
+			channels.clear();
+			channel_names.clear();
+			tables.clear();
+			table_names.clear();
+			num_errors = 0;
+		}
+		// }}}
+
+	public:
+
+		// {{{ MSQIni()
+		MSQIni() {
+			line_num = 0;
+			_clear();
+		}
+		// }}}
+
+		// {{{ define()
+		/**
+		 * Set a symbol for the #if lines before the file is loaded.
+		 */
+		void define(const string symbol) {
+			symbols.insert(symbol);
+		}
+		// }}}
+
+		// {{{ load()
+		/**
+		 * Read and check an ini file.
+		 *
+		 * @arg file name
+		 *
+		 * @returns true on error, false otherwise
+		 *
+		 * Each problem is reported with its line number.
+		 */
+		bool load(const string _file) {
+			_clear();
+			file = _file;
+
+			ifstream in(file.c_str());
+			if (in.fail()) {
+				cerr << "unable to open ini file '" << file << "'\n";
+				return true;  // error
+			}
+
+			// One entry for each #if, true if its lines are used.
+			vector<bool> active;
+			int skip = 0;  // number of false entries in active
+
+			string section;
+			int page = 0;
+			MSQIniTable* table = NULL;
+
+			string raw;
+			line_num = 0;
+			while (getline(in, raw)) {
+				line_num++;
+
+				string line = _trim(_strip_comment(raw));
+				if (line.empty())
+					continue;
+
+				// {{{ preprocessor
+				if ('#' == line[0]) {
+					string::size_type sp = line.find_first_of(" \t");
+					string cmd = line.substr(0, sp);
+					string arg = (string::npos == sp) ? "" : _trim(line.substr(sp));
+
+					if ("#if" == cmd) {
+						bool on = (symbols.count(arg) > 0);
+						active.push_back(on);
+						if (!on)
+							skip++;
+					} else if ("#else" == cmd) {
+						if (active.empty()) {
+							_error("#else without #if");
+							continue;
+						}
+						skip += active.back() ? 1 : -1;
+						active.back() = !active.back();
+					} else if ("#endif" == cmd) {
+						if (active.empty()) {
+							_error("#endif without #if");
+							continue;
+						}
+						if (!active.back())
+							skip--;
+						active.pop_back();
+					} else if (skip > 0) {
+						// not used
+					} else if ("#set" == cmd) {
+						symbols.insert(arg);
+					} else if ("#unset" == cmd) {
+						symbols.erase(arg);
+					} else if ("#error" == cmd) {
+						_error(arg);
+					}
+
+					continue;
+				}
+				// }}}
+
+				if (skip > 0)
+					continue;
+
+				if ('[' == line[0]) {
+					section = line;
+					table = NULL;
+					continue;
+				}
+
+				string::size_type eq = line.find('=');
+				if (string::npos == eq)
+					continue;
+
+				string key = _trim(line.substr(0, eq));
+				vector<string> f = _split(_trim(line.substr(eq + 1)));
+
+				if ("[Constants]" == section) {
+					if ("page" == key) {
+						page = atoi(f[0].c_str());
+					} else if ("pageActivationDelay" == key) {
+						page_delay = atoi(f[0].c_str());
+					} else if ("interWriteDelay" == key) {
+						write_delay = atoi(f[0].c_str());
+					} else if ("pageSize" == key) {
+						page_sizes.clear();
+						for (unsigned int i = 0; i < f.size(); i++)
+							page_sizes.push_back(atoi(f[i].c_str()));
+					} else if ("pageIdentifier" == key) {
+						page_ids.clear();
+						for (unsigned int i = 0; i < f.size(); i++) {
+							string id = _unescape(_unquote(f[i]));
+							if (id.empty()) {
+								_error("empty pageIdentifier");
+								id = string(1, '\0');
+							}
+							page_ids.push_back((unsigned char) id[id.size() - 1]);
+						}
+					} else if ("scalar" == f[0] || "array" == f[0] || "bits" == f[0]) {
+						if (page_sizes.size() != page_ids.size()) {
+							_error("pageSize and pageIdentifier do not match");
+							page_sizes.resize(page_ids.size(), 0);
+						}
+						_constant(key, f, page);
+					}
+				} else if ("[OutputChannels]" == section) {
+					if ("ochBlockSize" == key) {
+						och_block_size = atoi(f[0].c_str());
+					} else if ("scalar" == f[0] || "bits" == f[0]) {
+						_channel(key, f);
+					}
+				} else if ("[BurstMode]" == section) {
+					if ("getCommand" == key)
+						burst_command = _unescape(_unquote(f[0]));
+				} else if ("[TableEditor]" == section) {
+					if ("table" == key) {
+						MSQIniTable t;
+						t.id = f[0];
+						t.title = (f.size() > 2) ? _unquote(f[2]) : "";
+						tables.push_back(t);
+						table = &tables.back();
+					} else if (NULL == table) {
+						// not part of a table
+					} else if ("xBins" == key) {
+						table->x_bins = f[0];
+						table->x_channel = (f.size() > 1) ? f[1] : "";
+					} else if ("yBins" == key) {
+						table->y_bins = f[0];
+						table->y_channel = (f.size() > 1) ? f[1] : "";
+					} else if ("zBins" == key) {
+						table->z_bins = f[0];
+					}
+				}
+			}
+
+			if (! active.empty())
+				_error("#if without #endif");
+
+			for (unsigned int i = 0; i < tables.size(); i++) {
+				table_names[tables[i].id] = i;
+				table_names[tables[i].z_bins] = i;
+			}
+
+			_check();
+
+			return (num_errors > 0);
+		}
+		// }}}
+
+		// {{{ constant(), channel(), table()
+		/**
+		 * Find a constant by name.
+		 *
+		 * @returns the constant, NULL if there is none
+		 */
+		const MSQIniConstant* constant(const string& name) {
+			map<string, int>::iterator it = constant_names.find(name);
+
+			return (constant_names.end() == it) ? NULL : &constants[it->second];
+		}
+
+		/**
+		 * Find a real time channel by name.
+		 *
+		 * @returns the channel, NULL if there is none
+		 */
+		const MSQIniChannel* channel(const string& name) {
+			map<string, int>::iterator it = channel_names.find(name);
+
+			return (channel_names.end() == it) ? NULL : &channels[it->second];
+		}
+
+		/**
+		 * Find a table by the name of its values (zBins),
+		 * or by its table id.
+		 *
+		 * @returns the table, NULL if there is none
+		 */
+		const MSQIniTable* table(const string& name) {
+			map<string, int>::iterator it = table_names.find(name);
+
+			return (table_names.end() == it) ? NULL : &tables[it->second];
+		}
+
+		/**
+		 * All of the real time channels, in the order of the file.
+		 */
+		const vector<MSQIniChannel>& outputChannels() {
+			return channels;
+		}
+		// }}}
+
+		// {{{ settings
+		/**
+		 * Milliseconds to wait after activating a page
+		 * (see MSQSerial::setDelays()).
+		 */
+		int pageActivationDelay() {
+			return page_delay;
+		}
+
+		/**
+		 * Minimum milliseconds between writes.
+		 */
+		int interWriteDelay() {
+			return write_delay;
+		}
+
+		/**
+		 * The tbl_idx of each page (pageIdentifier).
+		 */
+		const vector<int>& pageIds() {
+			return page_ids;
+		}
+
+		/**
+		 * Size of a page (pageSize).
+		 *
+		 * @arg tbl_idx of the page
+		 * @returns bytes in the page, 0 if there is no such page
+		 */
+		int pageSize(const int tbl_idx) {
+			for (unsigned int i = 0; i < page_ids.size(); i++) {
+				if (page_ids[i] == tbl_idx)
+					return page_sizes[i];
+			}
+
+			return 0;
+		}
+
+		/**
+		 * Number of bytes of real time data (see MSQSerial::cmd_A()).
+		 */
+		int ochBlockSize() {
+			return och_block_size;
+		}
+
+		/**
+		 * Command used to get the real time data, "A" for the
+		 * burst mode of the MS2.
+		 */
+		string burstCommand() {
+			return burst_command;
+		}
+
+		unsigned int numConstants() {
+			return constants.size();
+		}
+
+		unsigned int numTables() {
+			return tables.size();
+		}
+		// }}}
+};
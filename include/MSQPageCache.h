@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "MSQSerial.h"
+#include "MSQUtils.h"
+
+using namespace std;
+
+/**
+ * A copy on disk of the pages of ecu ram so that pages which
+ * have not changed since the last run do not have to be read.
+ *
+ * Pages are stored in <dir>/<signature>/page<tbl_idx>, the signature
+ * (cmd_S()) keeps the pages of different firmware apart.
+ *
+ * The first time a page is needed the crc of the stored copy is
+ * compared with the crc from the ecu (cmd_k()), which is only a
+ * few bytes.
+ * If they match the stored copy is used, otherwise the whole page
+ * is read once and stored.
+ * Every write to the ecu must also be given to written() so that
+ * the copy stays the same as the ecu.
+ */
+class MSQPageCache {
+	private:
+		string base_dir;
+		string dir;  // of the current signature, set by open()
+
+		MSQSerial* serial;
+		int default_page_size;
+		map<int, int> page_sizes;  // by tbl_idx, if not the default
+
+		// pages known to be the same as the ecu
+		map<int, vector<char> > pages;
+
+		// pages which could not be cached, they are read directly
+		map<int, bool> bad_pages;
+
+		int num_verified;	// pages whose crc matched
+		int num_fetched;	// pages that had to be read
+
+		MSQPageCache() {};  // prevent use of the default constructor
+
+		// {{{ _pageSize()
+		int _pageSize(const int tbl_idx) {
+			map<int, int>::const_iterator it = page_sizes.find(tbl_idx);
+
+			return (page_sizes.end() == it) ? default_page_size : it->second;
+		}
+		// }}}
+
+		// {{{ _path()
+		string _path(const int tbl_idx) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "/page%i", tbl_idx);
+
+			return dir + buf;
+		}
+		// }}}
+
+		// {{{ _mkdir()
+		bool _mkdir(const string& path) {
+			if (-1 == mkdir(path.c_str(), 0755) && EEXIST != errno) {
+				string msg = "unable to create cache directory '" + path + "'";
+				perror(msg.c_str());
+				return true;  // error
+			}
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ _save()
+		/*
+		 * Store a page, the file is replaced in one step
+		 * so it is never left partially written.
+		 */
+		bool _save(const int tbl_idx) {
+			string path = _path(tbl_idx);
+			string tmp = path + ".tmp";
+
+			vector<char>& page = pages[tbl_idx];
+
+			ofstream out(tmp.c_str(), ios::out | ios::binary | ios::trunc);
+			out.write(&page[0], page.size());
+			out.close();
+
+			if (out.fail() || -1 == rename(tmp.c_str(), path.c_str())) {
+				cerr << "unable to save cached page '" << path << "'\n";
+				unlink(tmp.c_str());
+				return true;  // error
+			}
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ _load()
+		/*
+		 * Get a page that is the same as the ecu, from the file
+		 * if its crc matches, otherwise from the ecu.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool _load(const int tbl_idx) {
+			int page_size = _pageSize(tbl_idx);
+			if (page_size <= 0)
+				return true;  // error
+
+			uint32_t ecu_crc;
+			if (serial->cmd_k(tbl_idx, ecu_crc))
+				return true;  // error
+
+			vector<char> page(page_size);
+
+			ifstream in(_path(tbl_idx).c_str(), ios::in | ios::binary);
+			if (in.read(&page[0], page_size)
+					&& crc32(&page[0], page_size) == ecu_crc)
+			{
+				pages[tbl_idx] = page;
+				num_verified++;
+
+				return false;  // OK
+			}
+
+			// missing or out of date
+			int n = serial->cmd_r(tbl_idx, 0, page_size, &page[0]);
+			if (n != page_size) {
+				cerr << "unable to read page " << tbl_idx << " to cache\n";
+				return true;  // error
+			}
+
+			pages[tbl_idx] = page;
+			num_fetched++;
+
+			_save(tbl_idx);
+
+			return false;  // OK
+		}
+		// }}}
+
+	public:
+
+		// {{{ MSQPageCache(dir, serial)
+		/**
+		 * Create a new page cache.
+		 *
+		 * Nothing is read until open().
+		 *
+		 * @arg directory to store pages in
+		 * @arg connected serial device
+		 */
+		MSQPageCache(const string _dir, MSQSerial* _serial) {
+			base_dir = _dir;
+			serial = _serial;
+			default_page_size = 1024;
+
+			num_verified = 0;
+			num_fetched = 0;
+		}
+		// }}}
+
+		// {{{ setPageSize()
+		/**
+		 * Set the number of bytes in a page (pageSize in the ini).
+		 *
+		 * Pages that are not given are 1024 bytes.
+		 *
+		 * @arg tbl_idx of the page
+		 * @arg bytes in the page
+		 */
+		void setPageSize(const int tbl_idx, const int bytes) {
+			page_sizes[tbl_idx] = bytes;
+			pages.erase(tbl_idx);
+		}
+		// }}}
+
+		// {{{ open()
+		/**
+		 * Find the cached pages for the signature of the ecu.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool open() {
+			string sig = serial->cmd_S();
+			if (sig.empty()) {
+				cerr << "unable to get the ecu signature for the page cache\n";
+				return true;  // error
+			}
+
+			// use it as a file name
+			string name;
+			for (unsigned int i = 0; i < sig.size(); i++) {
+				char c = sig[i];
+				if (isalnum(c) || '.' == c || '-' == c)
+					name += c;
+				else if (! name.empty() && '_' != name[name.size() - 1])
+					name += '_';
+			}
+			while (! name.empty() && '_' == name[name.size() - 1])
+				name.erase(name.size() - 1);
+
+			if (name.empty())
+				name = "unknown";
+
+			if (_mkdir(base_dir) || _mkdir(base_dir + "/" + name))
+				return true;  // error
+
+			dir = base_dir + "/" + name;
+			pages.clear();
+			bad_pages.clear();
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ read()
+		/**
+		 * Read data from a page of the ecu.
+		 *
+		 * This is used the same as MSQSerial::cmd_r().
+		 * If a page can not be cached it is read from
+		 * the ecu every time.
+		 *
+		 * @returns number of bytes read, -1 on error
+		 */
+		int read(const int tbl_idx,
+					const int offset, const int num_bytes, char* buf)
+		{
+			if (dir.empty() || offset < 0 || offset + num_bytes > _pageSize(tbl_idx)
+					|| bad_pages.count(tbl_idx))
+			{
+				return serial->cmd_r(tbl_idx, offset, num_bytes, buf);
+			}
+
+			if (! pages.count(tbl_idx) && _load(tbl_idx)) {
+				cerr << "page " << tbl_idx << " will not be cached\n";
+				bad_pages[tbl_idx] = true;
+
+				return serial->cmd_r(tbl_idx, offset, num_bytes, buf);
+			}
+
+			memcpy(buf, &pages[tbl_idx][offset], num_bytes);
+
+			return num_bytes;
+		}
+		// }}}
+
+		// {{{ written()
+		/**
+		 * Update a cached page after data was written to the ecu
+		 * (MSQSerial::cmd_w()).
+		 */
+		void written(const int tbl_idx,
+						const int offset, const int num_bytes,
+						const char* bytes)
+		{
+			if (! pages.count(tbl_idx) || offset < 0
+					|| offset + num_bytes > _pageSize(tbl_idx))
+			{
+				// not cached yet, its crc will be checked when it is
+				return;
+			}
+
+			memcpy(&pages[tbl_idx][offset], bytes, num_bytes);
+
+			_save(tbl_idx);
+		}
+		// }}}
+
+		// {{{ verified(), fetched()
+		/**
+		 * Number of pages whose stored copy was the same as the ecu.
+		 */
+		int verified() {
+			return num_verified;
+		}
+
+		/**
+		 * Number of pages that had to be read from the ecu.
+		 */
+		int fetched() {
+			return num_fetched;
+		}
+		// }}}
+};
@@ -18,7 +18,11 @@
 #pragma once
 
 #include <cerrno>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <string>
 #include <sstream>
@@ -26,9 +30,12 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <zlib.h>
 
+#include "MSQRingLog.h"
 #include "MSQSerial.h"
 #include "MSQUtils.h"
+#include "msq_shm.h"
 
 using namespace std;
 
@@ -47,11 +54,17 @@ public:
 		name = _name;
 		type = _type;
 		offset = _offset;
+
+		data_type = strToType(type);
+		if (MSQ_BAD_TYPE == data_type) {
+			cerr << "unknown type '" << type << "' for '" << name << "'\n";
+		}
 	}
 
 	virtual ~RTConfig() {};
 	string name;
 	string type;			// U16, S16, ...
+	MSQType data_type;		// type, resolved when constructed
 	string config_type;
 	unsigned int offset;
 };
@@ -63,10 +76,36 @@ public:
 	{
 		mult = _mult;
 		add = _add;
+
+		divisor = 1;
+		deadband = -1;
+
+		decode = decoderFor(data_type);
 	}
 	string units;
 	float add;
 	float mult;
+
+	// Only log every divisor'th frame, and only when the value
+	// moved at least deadband (0 -> any change, -1 -> not checked)
+	// since it was last logged (see MSQRealTime::append()).
+	unsigned int divisor;
+	float deadband;
+
+	// decoder for the data type, resolved when constructed
+	MSQDecodeFn decode;
+
+	/**
+	 * Get the value of this channel from a frame of real time data.
+	 */
+	float value(const char* frame) {
+		double v = decode(frame + offset);
+
+		v += add;
+		v *= mult;
+
+		return v;
+	}
 };
 
 class RTConfigBits : public RTConfig {
@@ -77,6 +116,277 @@ public:
 };
 // }}}
 
+// {{{ RTDecoder
+/**
+ * Decoder for all the scalar channels of a frame.
+ *
+ * The channel configuration is compiled once in to flat arrays
+ * of offsets, shifts, masks, signs, mults and adds.
+ * Decoding a frame is then a single loop with the same
+ * straight line code for every channel, no matter its type.
+ */
+class RTDecoder {
+	private:
+		vector<unsigned int> offsets;
+		vector<unsigned int> shifts;	// 32 - bits of the type
+		vector<unsigned int> masks;		// 0 for an unknown type
+		vector<unsigned int> signs;		// sign bit of signed types, else 0
+		vector<double> mults;
+		vector<double> adds;
+
+		// Copy of the frame padded so that a 4 byte load at any
+		// channel offset stays within the buffer.
+		vector<unsigned char> pad;
+		unsigned int frame_bytes;
+
+	public:
+		RTDecoder() {
+			frame_bytes = 0;
+		}
+
+		// {{{ compile()
+		/**
+		 * Compile the channels in to the decoder.
+		 *
+		 * @arg channels to decode, values are decoded in this order
+		 * @arg number of bytes in each frame
+		 */
+		void compile(const vector<RTConfigScalar*>& scalars,
+						const unsigned int _frame_bytes)
+		{
+			offsets.clear();
+			shifts.clear();
+			masks.clear();
+			signs.clear();
+			mults.clear();
+			adds.clear();
+
+			frame_bytes = _frame_bytes;
+			unsigned int pad_bytes = frame_bytes;
+
+			vector<RTConfigScalar*>::const_iterator it;
+			for (it = scalars.begin(); it != scalars.end(); it++) {
+				RTConfigScalar* rtc = *it;
+
+				unsigned int bits = 8 * typeBytes(rtc->data_type);
+				if (rtc->offset + bits / 8 > frame_bytes) {
+					cerr << "channel '" << rtc->name << "' is beyond the end of"
+						<< " the frame, it will be decoded as 0\n";
+				}
+
+				offsets.push_back(rtc->offset);
+				if (0 == bits) {
+					// unknown type, the raw value is always 0
+					shifts.push_back(0);
+					masks.push_back(0);
+					signs.push_back(0);
+				} else {
+					shifts.push_back(32 - bits);
+					masks.push_back(0xFFFFFFFF >> (32 - bits));
+
+					bool is_signed = (MSQ_S08 == rtc->data_type
+										|| MSQ_S16 == rtc->data_type
+										|| MSQ_S32 == rtc->data_type);
+					signs.push_back(is_signed ? (1U << (bits - 1)) : 0);
+				}
+				mults.push_back(rtc->mult);
+				adds.push_back(rtc->add);
+
+				if (rtc->offset + 4 > pad_bytes)
+					pad_bytes = rtc->offset + 4;
+			}
+
+			pad.assign(pad_bytes, 0);
+		}
+		// }}}
+
+		// {{{ size()
+		/**
+		 * @returns the number of values in a decoded frame
+		 */
+		int size() {
+			return offsets.size();
+		}
+		// }}}
+
+		// {{{ decode()
+		/**
+		 * Decode a frame.
+		 *
+		 * @arg frame of real time data (cmd_A())
+		 * @arg array of at least size() values to store the results
+		 */
+		void decode(const char* frame, float* vals) {
+			if (offsets.empty())
+				return;
+
+			memcpy(&pad[0], frame, frame_bytes);
+
+			const unsigned char* f = &pad[0];
+			const unsigned int* off = &offsets[0];
+			const unsigned int* sh = &shifts[0];
+			const unsigned int* mask = &masks[0];
+			const unsigned int* sign = &signs[0];
+			const double* mult = &mults[0];
+			const double* add = &adds[0];
+
+			int n = offsets.size();
+			for (int i = 0; i < n; i++) {
+				const unsigned char* p = f + off[i];
+
+				// Big endian load of 4 bytes.  The value is in the
+				// upper bits, after it is moved down the sign is
+				// extended by flipping and subtracting the sign bit.
+				unsigned int raw = ((unsigned int) p[0] << 24)
+									| ((unsigned int) p[1] << 16)
+									| ((unsigned int) p[2] << 8)
+									| (unsigned int) p[3];
+
+				unsigned int u = (raw >> sh[i]) & mask[i];
+				int64_t v = (int64_t) (u ^ sign[i]) - (int64_t) sign[i];
+
+				vals[i] = (v + add[i]) * mult[i];
+			}
+		}
+		// }}}
+};
+// }}}
+
+// {{{ RTFilter
+/**
+ * Separates the steady state frames of real time data from those
+ * during a transient or while the engine warms up, so that tools
+ * such as the ve tuner only see frames where the air fuel ratio
+ * settled for the current cell (see MSQRealTime::steady()).
+ *
+ * A frame is a transient if the magnitude of rpmdot, tpsDOT or
+ * mapDOT is over its limit, or the throttle is closed at high rpm
+ * (overrun).  Frames up to delay seconds after a transient, and
+ * those with the coolant below its limit, are not steady either.
+ *
+ * A limit of 0 is not checked, nor is a channel that is not
+ * logged.  The defaults are those of msq-ve_tuner.
+ */
+class RTFilter {
+	private:
+		// indexes of the channels in the values, -1 if absent
+		int rpm_ch;
+		int rpmdot_ch;
+		int tpsdot_ch;
+		int mapdot_ch;
+		int tps_ch;
+		int coolant_ch;
+
+		double transient_time;  // of the last transient
+
+		static int _index(const vector<RTConfigScalar*>& scalars,
+							const string& name)
+		{
+			for (unsigned int i = 0; i < scalars.size(); i++) {
+				if (scalars[i]->name == name)
+					return i;
+			}
+
+			return -1;
+		}
+
+	public:
+		bool drop;			// leave the frames out rather than tag them
+
+		float max_rpmdot;	// rpm/s
+		float max_tpsdot;	// %/s
+		float max_mapdot;	// kPa/s
+		float overrun_rpm;	// a closed throttle above this rpm ...
+		float overrun_tps;	// ... is below this tps
+		float min_coolant;	// in the units of the coolant channel
+		float delay;		// seconds after a transient
+
+		RTFilter() {
+			drop = false;
+
+			max_rpmdot = 400;
+			max_tpsdot = 50;
+			max_mapdot = 0;
+			overrun_rpm = 3000;
+			overrun_tps = 5;
+			min_coolant = 0;
+			delay = 3;
+
+			rpm_ch = rpmdot_ch = tpsdot_ch = mapdot_ch = tps_ch = coolant_ch = -1;
+			transient_time = 0;
+		}
+
+		// {{{ compile()
+		/**
+		 * Find the channels in the order they are decoded.
+		 */
+		void compile(const vector<RTConfigScalar*>& scalars) {
+			rpm_ch = _index(scalars, "rpm");
+			rpmdot_ch = _index(scalars, "rpmdot");
+			tpsdot_ch = _index(scalars, "tpsDOT");
+			mapdot_ch = _index(scalars, "mapDOT");
+			tps_ch = _index(scalars, "tps");
+			coolant_ch = _index(scalars, "coolant");
+		}
+		// }}}
+
+		// {{{ steady()
+		/**
+		 * Check the next frame.
+		 *
+		 * The first frames wait for the delay as if there had
+		 * been a transient, the engine may have just started.
+		 *
+		 * @arg time the frame was received, seconds
+		 * @arg decoded values
+		 *
+		 * @returns true if the frame is steady, false otherwise
+		 */
+		bool steady(const double t, const float* vals) {
+			if (0 == transient_time)
+				transient_time = t;
+
+			if ((max_rpmdot > 0 && rpmdot_ch > -1
+					&& fabs(vals[rpmdot_ch]) > max_rpmdot)
+				|| (max_tpsdot > 0 && tpsdot_ch > -1
+					&& fabs(vals[tpsdot_ch]) > max_tpsdot)
+				|| (max_mapdot > 0 && mapdot_ch > -1
+					&& fabs(vals[mapdot_ch]) > max_mapdot)
+				|| (overrun_rpm > 0 && rpm_ch > -1 && tps_ch > -1
+					&& vals[rpm_ch] > overrun_rpm && vals[tps_ch] < overrun_tps))
+			{
+				transient_time = t;
+			}
+
+			if (t - transient_time < delay)
+				return false;
+
+			if (min_coolant > 0 && coolant_ch > -1 && vals[coolant_ch] < min_coolant)
+				return false;
+
+			return true;
+		}
+		// }}}
+};
+// }}}
+
+// {{{ MSQRTIndexEntry
+/**
+ * An entry of the index of a real time data file (see
+ * MSQRealTime::openIndex()).
+ *
+ * The index file is a list of these in the native byte order,
+ * one for every so many rows and one for the first row of each
+ * run of msqdev.
+ * Read by MSQ::RTData in lib/perl5/MSQ/RTData.pm.
+ */
+struct MSQRTIndexEntry {
+	uint64_t offset;	// of the start of the row in the data file
+	double time;		// the frame was received, seconds since the epoch
+	double base;		// seconds since the epoch of localtime 0 for the run
+};
+// }}}
+
 /**
  * The MSQRealTimeData object is used to obtain real time
  * data (cmd_A()) and append it to a file.
@@ -88,6 +398,20 @@ class MSQRealTime {
 		string file;
 		ofstream out;
 
+		// Index of the rows (see openIndex()), not open if unused.
+		ofstream idx;
+		unsigned long index_interval;	// rows between entries
+		uint64_t start_offset;			// size of the file when opened
+		bool new_file;					// the file was created
+
+		// Compressed output, NULL if the file is not compressed.
+		// Lines are collected in to chunks and each chunk is
+		// compressed and flushed to the file as a whole, so that
+		// at most one chunk is lost if msqdev stops abruptly.
+		gzFile gz;
+		string chunk;
+		unsigned int chunk_bytes;
+
 		// Number of bytes that will be read by the "A" command (cmd_A()).
 		// Found under config option 'ochBlockSize' in the ini.
 		int num_bytes;
@@ -95,6 +419,156 @@ class MSQRealTime {
 
 		vector<RTConfig*> config;
 		string sep;  // separator for output
+
+		// The scalar channels of config, found once when constructed
+		// so that readAppend() does not have to check each type.
+		vector<RTConfigScalar*> scalars;
+
+		RTDecoder decoder;	 // compiled from scalars
+		vector<float> vals;  // values of the last frame
+
+		// Transient filter, NULL if every frame is steady.
+		RTFilter* filter;
+		bool is_steady;				// of the last frame
+		volatile unsigned long num_filtered;	// not steady
+
+		// decimation of each of the scalars
+		vector<unsigned int> divisors;
+		vector<float> deadbands;
+		vector<float> logged;  // last value written
+		bool decimate;         // false if every value is written
+
+		// counters, read by other threads (frames(), ...)
+		volatile unsigned long num_frames;  // appended so far
+		volatile uint64_t bytes_written;    // text written, before compression
+		unsigned long key_interval;  // frames between full rows
+
+		// first_time is used to change seconds since epoch to
+		// seconds since the first frame.
+		// This is to make the time number smaller so it works
+		// better with applications such as R.
+		time_t first_time;
+
+		MSQRingLog* ring;  // binary log, NULL if not used (see openRing())
+
+		// Live feed in shared memory, NULL if not used (see openShm()).
+		// It has its own decoder as publish() is called from
+		// another thread than append().
+		struct msq_shm* shm;
+		RTDecoder shm_decoder;
+		vector<float> shm_vals;
+
+		// {{{ _write(), _write_chunk()
+		void _write(const string& s) {
+			bytes_written += s.size();
+
+			if (NULL == gz) {
+				out << s;
+				return;
+			}
+
+			chunk += s;
+			if (chunk.size() >= chunk_bytes)
+				_write_chunk();
+		}
+
+		void _write_chunk() {
+			if (NULL == gz || chunk.empty())
+				return;
+
+			if (gzwrite(gz, chunk.data(), chunk.size()) <= 0
+				|| Z_OK != gzflush(gz, Z_SYNC_FLUSH))
+			{
+				cerr << "error writing compressed real time data\n";
+			}
+			chunk.clear();
+		}
+		// }}}
+
+		// {{{ _stale_index()
+		/*
+		 * Does an index not match the file?
+		 * Either it was cut short or its last entry is past the
+		 * end of the file.
+		 */
+		bool _stale_index(const string& idx_file) {
+			struct stat st;
+			if (0 != stat(idx_file.c_str(), &st) || 0 == st.st_size)
+				return false;  // nothing to check
+
+			if (0 != st.st_size % sizeof(MSQRTIndexEntry))
+				return true;
+
+			ifstream in(idx_file.c_str(), ios_base::in | ios_base::binary);
+			MSQRTIndexEntry e;
+			in.seekg(st.st_size - sizeof(e));
+			in.read((char*) &e, sizeof(e));
+
+			return in.fail() || e.offset >= start_offset;
+		}
+		// }}}
+
+		// {{{ _header(), _move_aside()
+		/*
+		 * The first line (the column names) of an existing file,
+		 * compressed or not, without the newline.
+		 */
+		static string _header(const string& f, const bool compressed) {
+			string line;
+
+			if (compressed) {
+				gzFile in = gzopen(f.c_str(), "rb");
+				if (NULL == in)
+					return line;
+
+				char b[4096];
+				if (NULL != gzgets(in, b, sizeof(b)))
+					line = b;
+				gzclose(in);
+			} else {
+				ifstream in(f.c_str());
+				getline(in, line);
+			}
+
+			if (! line.empty() && '\n' == line[line.size() - 1])
+				line.erase(line.size() - 1);
+
+			return line;
+		}
+
+		/*
+		 * Rename a file whose columns no longer match, such as
+		 * 'rtdata' to 'rtdata.20110626-101500', so that a new
+		 * file is started instead of appending mismatched rows.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		static bool _move_aside(const string& f, const bool compressed) {
+			char stamp[32];
+			time_t now = time(NULL);
+			strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+			string moved;
+			if (compressed)
+				moved = f.substr(0, f.size() - 3) + "." + stamp + ".gz";
+			else
+				moved = f + "." + stamp;
+
+			if (-1 == rename(f.c_str(), moved.c_str())) {
+				perror("unable to move real time data with other columns");
+				return true;  // error
+			}
+
+			// its index goes with it (see openIndex())
+			if (! compressed)
+				rename((f + ".idx").c_str(), (moved + ".idx").c_str());
+
+			cerr << "the columns of '" << f << "' changed, it was moved to '"
+				<< moved << "'\n";
+
+			return false;  // OK
+		}
+		// }}}
 	public:
 
 		// {{{ MSQRealTime
@@ -106,11 +580,16 @@ class MSQRealTime {
 		 * the .ini file for a particular version.
 		 * Usually it is found in the [BurstMode] and [OutputChannels]
 		 * section.
+		 *
+		 * With a transient filter each row gets a "steady" column
+		 * of 1 or 0, or if it drops frames only the steady frames
+		 * are written (see RTFilter).
 		 */
 		MSQRealTime(MSQSerial* _serial,
 						const string _file,
 						const int _num_bytes,
-						vector<RTConfig*> _config)
+						vector<RTConfig*> _config,
+						const RTFilter* _filter = NULL)
 		{
 			serial = _serial;
 			file = _file;
@@ -118,6 +597,55 @@ class MSQRealTime {
 			num_bytes = _num_bytes;
 			sep = ",";  // separator
 
+			vector<RTConfig*>::iterator cit;
+			for (cit = config.begin(); cit != config.end(); cit++) {
+				if (RTConfigScalar* rtc = dynamic_cast<RTConfigScalar*>(*cit)) {
+					scalars.push_back(rtc);
+				}
+				// TODO RTConfigBits
+			}
+
+			decoder.compile(scalars, num_bytes);
+			vals.resize(decoder.size());
+
+			filter = NULL;
+			if (NULL != _filter) {
+				filter = new RTFilter(*_filter);
+				filter->compile(scalars);
+			}
+			is_steady = true;
+			num_filtered = 0;
+
+			decimate = false;
+			for (unsigned int i = 0; i < scalars.size(); i++) {
+				unsigned int div = scalars[i]->divisor;
+				if (0 == div)
+					div = 1;
+
+				divisors.push_back(div);
+				deadbands.push_back(scalars[i]->deadband);
+
+				if (div > 1 || scalars[i]->deadband >= 0)
+					decimate = true;
+			}
+			logged.resize(scalars.size());
+
+			num_frames = 0;
+			bytes_written = 0;
+			key_interval = 100;
+
+			bool compressed = (file.size() > 3
+								&& ".gz" == file.substr(file.size() - 3));
+
+			vector<RTConfigScalar*>::iterator it;
+			string cols = "localtime";  // add special "time" column
+
+			for (it = scalars.begin(); it != scalars.end(); it++) {
+				cols += sep + (*it)->name;
+			}
+			if (NULL != filter && ! filter->drop)
+				cols += sep + "steady";
+
 			// If the file does not exists,
 			// set a flag to add the columns after the
 			// file is created.
@@ -128,91 +656,469 @@ class MSQRealTime {
 			}
 			out.close();
 
-			out.open(file.c_str(), ios_base::app);
-			if (out.fail()) {
-				perror("unable to open file for real time data");
+			// Rows are only appended under the same columns,
+			// such as after channels were added or the steady
+			// column was turned on or off.
+			if (! write_cols && _header(file, compressed) != cols) {
+				if (! _move_aside(file, compressed))
+					write_cols = true;
 			}
-			// add the column names if this is a new file
-			if (write_cols) {
-				vector<RTConfig*>::iterator it;
 
-				out << "localtime" << sep;  // add special "time" column
-				for (it = config.begin(); (it + 1) != config.end(); it++) {
-					out << ((*it)->name) << sep;
+			new_file = write_cols;
+			index_interval = 0;
+
+			struct stat st;
+			start_offset = (0 == stat(file.c_str(), &st)) ? st.st_size : 0;
+
+			// A file named *.gz is compressed.  Each run appends
+			// another gzip member which gzip, zcat and R read as
+			// one file.
+			gz = NULL;
+			chunk_bytes = 64 * 1024;
+			if (compressed) {
+				gz = gzopen(file.c_str(), "ab");
+				if (NULL == gz) {
+					perror("unable to open file for real time data");
+				}
+			} else {
+				out.open(file.c_str(), ios_base::app);
+				if (out.fail()) {
+					perror("unable to open file for real time data");
 				}
-				out << ((*it)->name) ;  // without sep
-				out << endl;
+			}
+
+			// add the column names if this is a new file
+			if (write_cols) {
+				_write(cols + '\n');
+				if (NULL == gz)
+					out.flush();
 			}
 
 			buf = new char[num_bytes];
+
+			ring = NULL;
+			shm = NULL;
+			first_time = 0;
 		}
 		// }}}
 
 		// {{{ ~MSQRealTime
 		~MSQRealTime() {
+			if (gz != NULL) {
+				_write_chunk();
+				gzclose(gz);
+				gz = NULL;
+			}
+
 			delete[] buf;
+
+			if (filter != NULL) {
+				delete filter;
+				filter = NULL;
+			}
+
+			if (ring != NULL) {
+				delete ring;
+				ring = NULL;
+			}
+
+			if (shm != NULL) {
+				msq_shm_close(shm);
+				delete shm;
+				shm = NULL;
+			}
 		};
 		// }}}
 
-		// {{{ readAppend()
+		// {{{ openRing()
 		/**
-		 * Read one chunk of data and append it to the output file.
+		 * In addition to the text file, log the raw data
+		 * to a binary ring file (see MSQRingLog).
+		 *
+		 * @arg ring file
+		 * @arg number of records in the ring
+		 *
+		 * @returns true on error, false otherwise
+		 *
+		 * Only scalar channels are described in the ring header.
 		 */
-		void readAppend() {
+		bool openRing(const string ring_file, const unsigned int records) {
+			vector<MSQRingChannel> channels;
 
-			static struct timeval tv;
-			static struct timezone tz;
-			static time_t first_time = 0;
-			// first_time is used to change seconds since epoch to
-			// seconds since first readAppend call.
-			// This is to make the time number smaller so it works
-			// better with applications such as R.
-			//static float max_suseconds = pow(2, (sizeof(suseconds_t) * 8)) - 1;
-			double t;
+			vector<RTConfigScalar*>::iterator it;
+			for (it = scalars.begin(); it != scalars.end(); it++) {
+				RTConfigScalar* rtc = *it;
+				MSQRingChannel ch;
+				memset(&ch, 0, sizeof(ch));
+
+				strncpy(ch.name, rtc->name.c_str(), sizeof(ch.name) - 1);
+				strncpy(ch.type, rtc->type.c_str(), sizeof(ch.type) - 1);
+				ch.offset = rtc->offset;
+				ch.mult = rtc->mult;
+				ch.add = rtc->add;
+
+				channels.push_back(ch);
+			}
+
+			if (ring != NULL)
+				delete ring;
+
+			ring = new MSQRingLog(ring_file);
+			if (ring->create(records, num_bytes, channels)) {
+				delete ring;
+				ring = NULL;
+
+				return true;  // error
+			}
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ openIndex()
+		/**
+		 * Keep a sparse index of the rows in the file '<file>.idx'
+		 * (see MSQRTIndexEntry) so that readers can find the last
+		 * row or the rows at a time without reading the whole file.
+		 *
+		 * @arg rows between entries, the first row of each run
+		 * always has one
+		 *
+		 * @returns true on error, false otherwise
+		 *
+		 * Compressed files can not be indexed.
+		 * An index that does not belong to the file, because the
+		 * file was replaced, is started over.
+		 */
+		bool openIndex(const unsigned long rows) {
+			if (gz != NULL) {
+				cerr << "compressed real time data can not be indexed\n";
+				return true;  // error
+			}
+
+			if (0 == rows) {
+				cerr << "the index needs at least one row per entry\n";
+				return true;  // error
+			}
+
+			string idx_file = file + ".idx";
+
+			ios_base::openmode mode = ios_base::out | ios_base::binary;
+			if (new_file || _stale_index(idx_file))
+				mode |= ios_base::trunc;
+			else
+				mode |= ios_base::app;
+
+			if (idx.is_open())
+				idx.close();
+
+			idx.open(idx_file.c_str(), mode);
+			if (idx.fail()) {
+				perror("unable to open real time data index");
+				return true;  // error
+			}
+
+			index_interval = rows;
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ openShm(), publish()
+		/**
+		 * Publish the decoded values of each frame to a ring in
+		 * shared memory (see msq_shm.h) for live clients.
+		 *
+		 * @arg name of the shared memory object
+		 * @arg number of frames in the ring
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool openShm(const string name, const unsigned int frames) {
+			vector<const char*> names;
+			for (unsigned int i = 0; i < scalars.size(); i++)
+				names.push_back(scalars[i]->name.c_str());
+
+			if (shm != NULL) {
+				msq_shm_close(shm);
+				delete shm;
+			}
+
+			shm = new struct msq_shm;
+			if (msq_shm_create(shm, name.c_str(), frames, names.size(),
+								names.empty() ? NULL : &names[0]))
+			{
+				delete shm;
+				shm = NULL;
+
+				return true;  // error
+			}
+
+			shm_decoder.compile(scalars, num_bytes);
+			shm_vals.resize(shm_decoder.size());
 
+			return false;  // OK
+		}
 
-			if (serial->cmd_A(num_bytes, buf)) {
-				cerr << "readAppend(), cmd_A() failed\n";
+		/**
+		 * Decode a frame and publish it to the shared memory ring,
+		 * if there is one (see openShm()).
+		 *
+		 * It only touches memory, so it can be called as soon as
+		 * a frame is read, ahead of the slower append().
+		 */
+		void publish(const struct timeval& tv, const char* frame) {
+			if (NULL == shm)
 				return;
+
+			if (! shm_vals.empty())
+				shm_decoder.decode(frame, &shm_vals[0]);
+
+			msq_shm_publish(shm, &tv, shm_vals.empty() ? NULL : &shm_vals[0]);
+		}
+		// }}}
+
+		// {{{ setChunkBytes()
+		/**
+		 * Set the size of the chunks of a compressed file.
+		 *
+		 * Larger chunks compress better, smaller chunks lose
+		 * less data if msqdev stops abruptly.
+		 *
+		 * @arg bytes of text in each chunk, the default is 64 KiB
+		 */
+		void setChunkBytes(const unsigned int bytes) {
+			chunk_bytes = bytes;
+		}
+		// }}}
+
+		// {{{ setKeyInterval()
+		/**
+		 * When channels are decimated, write every value once
+		 * in this many frames, so that a reader starting in the
+		 * middle of the file soon has all of the values.
+		 *
+		 * @arg frames between full rows, 0 to only write the first
+		 *
+		 * The default is 100.  Rows with an index entry (see
+		 * openIndex()) are always full rows as well.
+		 */
+		void setKeyInterval(const unsigned long frames) {
+			key_interval = frames;
+		}
+		// }}}
+
+		// {{{ channelIndex(), values()
+		/**
+		 * @returns the index of a scalar channel in values(),
+		 * -1 if there is no such channel
+		 */
+		int channelIndex(const string& name) {
+			for (unsigned int i = 0; i < scalars.size(); i++) {
+				if (scalars[i]->name == name)
+					return i;
 			}
 
-			vector<RTConfig*>::iterator it;
+			return -1;
+		}
 
-			stringstream line;  // build a line of the data
+		/**
+		 * @returns the value of each scalar channel of the frame
+		 * last appended (see append())
+		 */
+		const vector<float>& values() {
+			return vals;
+		}
+		// }}}
+
+		// {{{ steady()
+		/**
+		 * @returns true if the frame last appended was steady
+		 * (see RTFilter), always true without a filter
+		 */
+		bool steady() {
+			return is_steady;
+		}
+		// }}}
+
+		// {{{ frames(), filtered(), bytesWritten()
+		/**
+		 * @returns the number of frames written to the output file
+		 */
+		unsigned long frames() {
+			return num_frames;
+		}
+
+		/**
+		 * @returns the number of frames that were not steady
+		 * (see RTFilter), whether they were dropped or tagged
+		 */
+		unsigned long filtered() {
+			return num_filtered;
+		}
+
+		/**
+		 * @returns the number of bytes of text written to the
+		 * output file, before any compression
+		 */
+		uint64_t bytesWritten() {
+			return bytes_written;
+		}
+		// }}}
+
+		// {{{ frameBytes()
+		/**
+		 * @returns the number of bytes in each frame of real time data
+		 */
+		int frameBytes() {
+			return num_bytes;
+		}
+		// }}}
+
+		// {{{ read()
+		/**
+		 * Read one frame of real time data from the ecu.
+		 *
+		 * @arg time the frame was received
+		 * @arg buffer of at least frameBytes()
+		 *
+		 * @returns true on error, false otherwise
+		 *
+		 * Along with append() this allows the serial communication
+		 * and the output to be performed separately.
+		 */
+		bool read(struct timeval& tv, char* frame) {
+			if (serial->cmd_A(num_bytes, frame)) {
+				cerr << "read(), cmd_A() failed\n";
+				return true;  // error
+			}
+
+			gettimeofday(&tv, NULL);
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ append()
+		/**
+		 * Decode a frame and append it to the output file(s).
+		 *
+		 * @arg time the frame was received
+		 * @arg frame from read()
+		 *
+		 * The output is buffered, see flush().
+		 *
+		 * A decimated channel (see RTConfigScalar::divisor and
+		 * deadband) that is not logged in a frame is left empty,
+		 * readers should use its previous value.
+		 *
+		 * Frames that are not steady are not written if the
+		 * filter drops them, see steady().
+		 */
+		void append(const struct timeval& tv, const char* frame) {
+			double t;
 
-			gettimeofday(&tv, &tz);
 			if (0 == first_time) {
 				first_time = tv.tv_sec;
 			}
 
+			if (ring != NULL) {
+				ring->append(tv, frame);
+			}
+
 			t = tv.tv_sec - first_time;
 			t += (tv.tv_usec / 1.0e6);  // add microseconds converted to seconds
 
-			line << t << sep;
+			if (! vals.empty())
+				decoder.decode(frame, &vals[0]);
+
+			if (NULL != filter) {
+				is_steady = filter->steady(tv.tv_sec + tv.tv_usec / 1.0e6,
+											vals.empty() ? NULL : &vals[0]);
+				if (! is_steady) {
+					num_filtered++;
+					if (filter->drop)
+						return;
+				}
+			}
+
+			stringstream line;  // build a line of the data
+
+			line << t;
+
+			// a reader starting at an indexed row has every value
+			bool indexed = (index_interval > 0 && 0 == num_frames % index_interval);
 
-			for (it = config.begin(); it != config.end(); it++) {
+			if (indexed) {
+				MSQRTIndexEntry e;
+				e.offset = start_offset + bytes_written;
+				e.time = tv.tv_sec + tv.tv_usec / 1.0e6;
+				e.base = first_time;
+
+				idx.write((const char*) &e, sizeof(e));
+			}
 
-				unsigned int offset = (*it)->offset;
-				if (RTConfigScalar* rtc = dynamic_cast<RTConfigScalar*>(*it)) {
-					float add = rtc->add;
-					float mult = rtc->mult;
+			bool key = (! decimate || 0 == num_frames || indexed
+						|| (key_interval > 0 && 0 == num_frames % key_interval));
 
-					string type = rtc->type;
-					float val = bufToValue(type, add, mult, &buf[offset]);
+			int n = vals.size();
+			for (int i = 0; i < n; i++) {
+				line << sep;
 
-					line << val;
-					if ((it + 1) != config.end()) {
-						line << sep;
-					}
+				if (! key) {
+					if (0 != num_frames % divisors[i])
+						continue;
 
-				// TODO
-				//} else if (RTConfigBits* rtc
-				//				= dynamic_cast<RTConfigBits*>(*it)) {
+					if (deadbands[i] >= 0
+						&& (vals[i] == logged[i]
+							|| fabs(vals[i] - logged[i]) < deadbands[i]))
+						continue;
 				}
-				// else unkown type, ignore
+
+				line << vals[i];
+				logged[i] = vals[i];
+			}
+			if (NULL != filter && ! filter->drop)
+				line << sep << (is_steady ? 1 : 0);
+			line << '\n';
+
+			_write(line.str());
+
+			num_frames++;
+		}
+		// }}}
+
+		// {{{ flush()
+		/**
+		 * Write any buffered output to the file.
+		 *
+		 * A compressed file is only written a chunk at a time
+		 * (see setChunkBytes()).
+		 */
+		void flush() {
+			if (NULL == gz)
+				out.flush();
+
+			// after the rows, so the index never points past them
+			if (index_interval > 0)
+				idx.flush();
+		}
+		// }}}
+
+		// {{{ readAppend()
+		/**
+		 * Read one chunk of data and append it to the output file.
+		 */
+		void readAppend() {
+			struct timeval tv;
+
+			if (read(tv, buf)) {
+				cerr << "readAppend(), read() failed\n";
+				return;
 			}
 
-			out << line.str() << endl;
+			append(tv, buf);
+			flush();
 		}
 		// }}}
 
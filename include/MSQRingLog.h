@@ -0,0 +1,441 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define MSQRING_MAGIC "MSQRING1"
+#define MSQRING_VERSION 1
+
+// {{{ MSQRingHeader, MSQRingChannel, MSQRingRecord
+/**
+ * A ring file begins with a header, followed by a description
+ * of each channel, followed by the records.
+ *
+ * All values are stored in the native byte order.
+ */
+struct MSQRingHeader {
+	char magic[8];			// MSQRING_MAGIC, without the null
+	uint32_t version;
+	uint32_t header_size;	// offset of the first record
+	uint32_t frame_bytes;	// bytes of cmd_A() data in each record
+	uint32_t record_size;	// bytes per record, including the time stamp
+	uint32_t capacity;		// number of records in the ring
+	uint32_t num_channels;
+	volatile uint64_t count;  // total number of records ever written
+	uint32_t reserved[6];
+};
+
+/**
+ * Description of one real time channel, copied from the
+ * RTConfig it was built from.
+ * The value of a channel is (raw + add) * mult.
+ */
+struct MSQRingChannel {
+	char name[32];
+	char type[4];			// U08, S08, U16, S16, U32, S32
+	uint32_t offset;		// in to the frame
+	float mult;
+	float add;
+};
+
+/**
+ * Each record is a time stamp followed by the raw frame.
+ */
+struct MSQRingRecord {
+	uint32_t tv_sec;
+	uint32_t tv_usec;
+	// char frame[frame_bytes];
+};
+// }}}
+
+/**
+ * A fixed size ring of raw real time data (cmd_A()) records
+ * stored in a memory mapped file.
+ *
+ * Once the ring is full the oldest records are overwritten,
+ * so the space used on disk is bounded no matter how long data
+ * is logged.
+ * Records are stored exactly as they are received so there is no
+ * formatting while logging; readers decode the values using the
+ * channel descriptions stored in the header.
+ *
+ * There can be one writer (see create()) and any number of
+ * readers (see open()).
+ */
+class MSQRingLog {
+	private:
+		string file;
+		int fd;
+
+		char* map;
+		size_t map_size;
+		MSQRingHeader* hdr;
+
+		MSQRingLog() {};  // prevent use of the default constructor
+
+		// {{{ _map(), _unmap()
+		bool _map(const size_t size, const int prot) {
+			void* p = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+			if (MAP_FAILED == p) {
+				perror("unable to map ring file");
+				return true;  // error
+			}
+
+			map = (char*) p;
+			map_size = size;
+			hdr = (MSQRingHeader*) map;
+
+			return false;  // OK
+		}
+
+		void _unmap() {
+			if (map != NULL) {
+				munmap(map, map_size);
+				map = NULL;
+				hdr = NULL;
+			}
+
+			if (fd > -1) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		// }}}
+
+		// {{{ _record()
+		char* _record(const uint64_t i) {
+			return map + hdr->header_size + (i % hdr->capacity) * hdr->record_size;
+		}
+		// }}}
+
+		// {{{ _same_layout()
+		/*
+		 * Does an existing ring have exactly the requested layout?
+		 */
+		bool _same_layout(const unsigned int capacity,
+							const unsigned int frame_bytes,
+							const vector<MSQRingChannel>& channels)
+		{
+			if (0 != memcmp(hdr->magic, MSQRING_MAGIC, sizeof(hdr->magic))
+					|| MSQRING_VERSION != hdr->version
+					|| capacity != hdr->capacity
+					|| frame_bytes != hdr->frame_bytes
+					|| channels.size() != hdr->num_channels)
+			{
+				return false;
+			}
+
+			const char* chans = map + sizeof(MSQRingHeader);
+			for (unsigned int i = 0; i < channels.size(); i++) {
+				if (0 != memcmp(chans + i * sizeof(MSQRingChannel),
+								&channels[i], sizeof(MSQRingChannel)))
+					return false;
+			}
+
+			return true;
+		}
+		// }}}
+
+	public:
+
+		// {{{ MSQRingLog(file)
+		/**
+		 * Create a new ring log object.
+		 *
+		 * The file is not opened here (see create() and open()).
+		 */
+		MSQRingLog(const string _file) {
+			file = _file;
+			fd = -1;
+			map = NULL;
+			map_size = 0;
+			hdr = NULL;
+		}
+		// }}}
+
+		// {{{ ~MSQRingLog
+		~MSQRingLog() {
+			_unmap();
+		}
+		// }}}
+
+		// {{{ create()
+		/**
+		 * Open the ring for writing, creating it if needed.
+		 *
+		 * @arg number of records in the ring
+		 * @arg number of bytes in each cmd_A() frame
+		 * @arg description of each channel
+		 *
+		 * @returns true on error, false otherwise
+		 *
+		 * If the file already exists with the same layout logging
+		 * continues after its last record, otherwise it is
+		 * recreated.
+		 * The whole file is allocated up front so that logging
+		 * does not fail later when the disk fills up.
+		 */
+		bool create(const unsigned int capacity,
+					const unsigned int frame_bytes,
+					const vector<MSQRingChannel>& channels)
+		{
+			if (0 == capacity || 0 == frame_bytes) {
+				cerr << "ring capacity and frame size must be non-zero\n";
+				return true;  // error
+			}
+
+			uint32_t header_size = sizeof(MSQRingHeader)
+								+ channels.size() * sizeof(MSQRingChannel);
+			header_size = (header_size + 7) & ~7;
+
+			uint32_t record_size = sizeof(MSQRingRecord) + frame_bytes;
+			record_size = (record_size + 7) & ~7;
+
+			size_t size = header_size + (size_t) capacity * record_size;
+
+			fd = ::open(file.c_str(), O_RDWR | O_CREAT, 0644);
+			if (fd == -1) {
+				char buf[1000];
+
+				snprintf(buf, sizeof(buf), "Unable to open ring file '%s'", file.c_str());
+				perror(buf);
+
+				return true;  // error
+			}
+
+			struct stat st;
+			if (-1 == fstat(fd, &st)) {
+				perror("unable to stat ring file");
+				_unmap();
+				return true;  // error
+			}
+
+			if ((size_t) st.st_size == size) {
+				if (_map(size, PROT_READ | PROT_WRITE)) {
+					_unmap();
+					return true;  // error
+				}
+
+				if (_same_layout(capacity, frame_bytes, channels))
+					return false;  // OK, continue the existing ring
+
+				munmap(map, map_size);
+				map = NULL;
+				hdr = NULL;
+			}
+
+			// (re)create the file
+			if (-1 == ftruncate(fd, 0) || -1 == ftruncate(fd, size)) {
+				perror("unable to size ring file");
+				_unmap();
+				return true;  // error
+			}
+
+			int err = posix_fallocate(fd, 0, size);
+			if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+				errno = err;
+				perror("unable to allocate ring file");
+				_unmap();
+				return true;  // error
+			}
+
+			if (_map(size, PROT_READ | PROT_WRITE)) {
+				_unmap();
+				return true;  // error
+			}
+
+			memset(hdr, 0, sizeof(MSQRingHeader));
+			memcpy(hdr->magic, MSQRING_MAGIC, sizeof(hdr->magic));
+			hdr->version = MSQRING_VERSION;
+			hdr->header_size = header_size;
+			hdr->frame_bytes = frame_bytes;
+			hdr->record_size = record_size;
+			hdr->capacity = capacity;
+			hdr->num_channels = channels.size();
+			hdr->count = 0;
+
+			char* chans = map + sizeof(MSQRingHeader);
+			for (unsigned int i = 0; i < channels.size(); i++) {
+				memcpy(chans + i * sizeof(MSQRingChannel),
+						&channels[i], sizeof(MSQRingChannel));
+			}
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ open()
+		/**
+		 * Open an existing ring for reading.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool open() {
+			fd = ::open(file.c_str(), O_RDONLY);
+			if (fd == -1) {
+				char buf[1000];
+
+				snprintf(buf, sizeof(buf), "Unable to open ring file '%s'", file.c_str());
+				perror(buf);
+
+				return true;  // error
+			}
+
+			struct stat st;
+			if (-1 == fstat(fd, &st)) {
+				perror("unable to stat ring file");
+				_unmap();
+				return true;  // error
+			}
+
+			if ((size_t) st.st_size < sizeof(MSQRingHeader)
+					|| _map(st.st_size, PROT_READ))
+			{
+				cerr << "invalid ring file '" << file << "'\n";
+				_unmap();
+				return true;  // error
+			}
+
+			size_t size = hdr->header_size
+						+ (size_t) hdr->capacity * hdr->record_size;
+
+			if (0 != memcmp(hdr->magic, MSQRING_MAGIC, sizeof(hdr->magic))
+					|| MSQRING_VERSION != hdr->version
+					|| 0 == hdr->capacity
+					|| size != map_size)
+			{
+				cerr << "invalid ring file '" << file << "'\n";
+				_unmap();
+				return true;  // error
+			}
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ append()
+		/**
+		 * Append a frame to the ring, overwriting the oldest
+		 * record if it is full.
+		 *
+		 * @arg time the frame was received
+		 * @arg frame of frameBytes() bytes
+		 */
+		void append(const struct timeval& tv, const char* frame) {
+			uint64_t n = hdr->count;
+			char* rec = _record(n);
+
+			MSQRingRecord* r = (MSQRingRecord*) rec;
+			r->tv_sec = tv.tv_sec;
+			r->tv_usec = tv.tv_usec;
+			memcpy(rec + sizeof(MSQRingRecord), frame, hdr->frame_bytes);
+
+			// the record must be complete before it is counted
+			__sync_synchronize();
+			hdr->count = n + 1;
+		}
+		// }}}
+
+		// {{{ count(), first()
+		/**
+		 * Total number of records that have been written.
+		 * The newest record is count() - 1.
+		 */
+		uint64_t count() {
+			return hdr->count;
+		}
+
+		/**
+		 * The oldest record that can still be read.
+		 *
+		 * When the ring is full the record about to be overwritten
+		 * is not included.
+		 */
+		uint64_t first() {
+			uint64_t n = hdr->count;
+
+			return (n >= hdr->capacity) ? (n - hdr->capacity + 1) : 0;
+		}
+		// }}}
+
+		// {{{ read()
+		/**
+		 * Read a record.
+		 *
+		 * @arg record number, from first() to count() - 1
+		 * @arg time stamp of the record
+		 * @arg buffer of at least frameBytes() bytes
+		 *
+		 * @returns true on error, false otherwise
+		 *
+		 * An error is returned if the record has not been written
+		 * yet or if it was overwritten while it was being read.
+		 */
+		bool read(const uint64_t i, struct timeval& tv, char* frame) {
+			if (i < first() || i >= count())
+				return true;  // error
+
+			const char* rec = _record(i);
+			const MSQRingRecord* r = (const MSQRingRecord*) rec;
+
+			tv.tv_sec = r->tv_sec;
+			tv.tv_usec = r->tv_usec;
+			memcpy(frame, rec + sizeof(MSQRingRecord), hdr->frame_bytes);
+
+			// check that the writer did not catch up while copying
+			__sync_synchronize();
+			if (i < first())
+				return true;  // error
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ capacity(), frameBytes(), numChannels(), channel()
+		unsigned int capacity() {
+			return hdr->capacity;
+		}
+
+		unsigned int frameBytes() {
+			return hdr->frame_bytes;
+		}
+
+		unsigned int numChannels() {
+			return hdr->num_channels;
+		}
+
+		const MSQRingChannel& channel(const unsigned int i) {
+			return ((const MSQRingChannel*) (map + sizeof(MSQRingHeader)))[i];
+		}
+		// }}}
+};
@@ -17,18 +17,31 @@
 
 #pragma once
 
+#include <cctype>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <sstream>
 #include <string>
+#include <vector>
 
+#include <poll.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
 /* http://www.easysw.com/~mike/serial/serial.html */
 #include <sys/ioctl.h>
 
+#include "MSQStats.h"
+#include "MSQTransport.h"
+#include "MSQUtils.h"
+
 #ifndef DEBUG
 #define DEBUG false
 #endif
@@ -51,76 +64,497 @@ int usleep(__useconds_t usec);  // to appease the compiler
 class MSQSerial {
 	private:
 		string dev_file;
-		int devfd;
+		MSQTransport* transport;  // created by connect() (see msq_transport())
+		int devfd;  // transport->fd()
+
+		// The page (tbl_idx) the ecu currently has active,
+		// -1 if unknown.
+		int cur_page;
+
+		// Baud rates to try, in order (see setBauds()),
+		// and the one in use.
+		vector<int> bauds;
+		int baud;
+
+		// delays in milliseconds (see setDelays())
+		int page_delay;
+		int write_delay;
+
+		int64_t last_write;  // end of the last 'w' command, see _now()
+
+		// Pipelined real time data (see setPipelined()).
+		// a_pending 'A' commands have been sent whose responses,
+		// of a_bytes each, have not been read yet.
+		int a_depth;
+		int a_pending;
+		int a_bytes;
+
+		// Time allowed for the response of each command, in micro
+		// seconds, not counting the time to send the bytes
+		// (see setTimeout()).
+		map<char, long> timeouts;
+
+		// Framed (newserial) protocol (see setFramed()).
+		bool framed;
+		int block_bytes;	// largest block read by one 'r' frame
+		unsigned long num_corrupt;	// response frames with a bad crc
+		vector<char> frame_buf;
+
+		// latency of each command (see latency())
+		map<char, MSQHistogram> latencies;
+		map<char, unsigned long> failures;
+
+		// totals for monitoring (see flushes(), bytesSent())
+		unsigned long num_flushes;
+		uint64_t bytes_sent;
+		uint64_t bytes_received;
+
+		// {{{ _now()
+		/*
+		 * Monotonic time in micro seconds.
+		 */
+		static int64_t _now() {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+
+			return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+		}
+		// }}}
+
+		// {{{ _budget(), _record()
+		/*
+		 * Micro seconds allowed for a command to return num_bytes.
+		 *
+		 * Each byte is 10 bits (8N1), about 87 us at 115200 baud.
+		 */
+		long _budget(const char cmd, const int num_bytes) {
+			long t = 100000;  // 100 ms for unknown commands
+			map<char, long>::iterator it = timeouts.find(cmd);
+			if (it != timeouts.end())
+				t = it->second;
+
+			return t + (num_bytes * 10000000L) / baud;
+		}
+
+		/*
+		 * Count the latency of a command started at start.
+		 */
+		void _record(const char cmd, const int64_t start, const bool err) {
+			if (err)
+				failures[cmd]++;
+			else
+				latencies[cmd].record(_now() - start);
+		}
+		// }}}
 
 		// {{{ sread()
 		/**
 		 * sread() - serial read
 		 *
-		 * Reading from the serial port is not straightforward.
 		 * Sometimes only part of the data is sent at a time.
+		 * The device is non-blocking and poll() waits for the rest
+		 * until a deadline, so a missing byte costs no more than
+		 * the time allowed for the command.
+		 *
+		 * @arg device
+		 * @arg buffer of at least size bytes
+		 * @arg number of bytes to read
+		 * @arg micro seconds allowed to read all of them
 		 *
-		 * This function encapsulates the error detection and correction
-		 * need for reading from a serial device.
+		 * @returns number of bytes read (size) on success,
+		 * -1 on error or time out
 		 */
-		int sread(int fd, char* buf, const int size, const int max_errs) {
-			char* buf_start = buf;
-			int errs = 0;  // number of errors
+		int sread(int fd, char* buf, const int size, const long timeout_us) {
+			int64_t deadline = _now() + timeout_us;
 			int nr = 0;    // total num read
 			int n; 		   // sing num read or possibly error
 
 			if (DEBUG) { cout << "sread()\n"; }
 			if (DEBUG) { cout << "  size req: " << size << "\n"; }
 
-			//fcntl(devfd, F_SETFL, FNDELAY);
-			fcntl(fd, F_SETFL, 0);
+			while (nr < size) {
+				n = read(fd, buf + nr, size - nr);
+
+				if (n > 0) {
+					// got some good data
+					if (DEBUG) { cout << "  got: " << n << "\n"; }
+
+					nr += n;
+					bytes_received += n;
+					continue;
+				}
+
+				if (n < 0 && EAGAIN != errno && EWOULDBLOCK != errno
+						&& EINTR != errno)
+				{
+					// some error we are not prepared to handle
+					perror("read failed");
+					return -1; // error
+				}
+
+				// nothing available yet, wait for the rest
+				int64_t left = deadline - _now();
+				if (left <= 0) {
+					cerr << "sread() timed out after " << timeout_us
+						<< " us, got " << nr << " of " << size << " bytes\n";
+					return -1; // error
+				}
+
+				struct pollfd pfd;
+				pfd.fd = fd;
+				pfd.events = POLLIN;
+
+				struct timespec ts;
+				ts.tv_sec = left / 1000000;
+				ts.tv_nsec = (left % 1000000) * 1000;
+
+				if (-1 == ppoll(&pfd, 1, &ts, NULL) && EINTR != errno) {
+					perror("poll failed");
+					return -1; // error
+				}
+			}
+
+			return nr; 		  // OK
+		}
+		// }}}
 
-			while (errs < max_errs) {
+		// {{{ swrite()
+		/**
+		 * swrite() - serial write
+		 *
+		 * Write all the bytes of a buffer, continuing after
+		 * partial writes and interrupts.
+		 * When the output buffer is full it waits up to a second
+		 * for it to drain.
+		 *
+		 * @returns number of bytes written on success, -1 on error
+		 */
+		int swrite(int fd, const char* buf, const int size) {
+			int nw = 0;  // total num written
+			int n;
 
-				if (DEBUG) { cout << "read()..."; }
-				n = read(fd, buf, size - nr);
-				if (DEBUG) { cout << "done."; }
+			while (nw < size) {
+				n = write(fd, buf + nw, size - nw);
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;  // see write(2)
 
-				if (n < 0) {  // an error
-					errs++;
+					if (errno == EAGAIN || errno == EWOULDBLOCK) {
+						struct pollfd pfd;
+						pfd.fd = fd;
+						pfd.events = POLLOUT;
 
-					if (errno == EINTR) {
-						if (DEBUG) { cout << "  EINTR\n"; }
-						//perror("EINTR error");
-						// see read(2) for a description of EINTR
-					} else {
-						// some error we are not prepared to handle
-						perror("read failed");
+						n = poll(&pfd, 1, 1000);
+						if (n > 0 || (n < 0 && errno == EINTR))
+							continue;
 
-						buf = buf_start;  // reset to begining
-						return -1; // error
+						cerr << "write timed out\n";
+						return -1;  // error
 					}
-				} else if (0 == n) {
-					if (DEBUG) { cout << "  0 read\n"; }
 
-					errs++;
-				} else if (n > 0) {
-					// got some good data
-					if (DEBUG) { cout << "  got: " << n << "\n"; }
+					perror("write failed");
+					return -1;  // error
+				}
+				nw += n;
+				bytes_sent += n;
+			}
 
-					errs = 0; // reset
+			return nw;  // OK
+		}
+		// }}}
 
-					buf += n;
-					nr += n;
+		// {{{ _udelay(), _udelay_since()
+		/*
+		 * Sleep for a number of micro seconds.
+		 * Unlike usleep() the full time is slept even if
+		 * a signal interrupts it.
+		 */
+		void _udelay(const long usec) {
+			struct timespec ts;
+
+			ts.tv_sec = usec / 1000000;
+			ts.tv_nsec = (usec % 1000000) * 1000;
+
+			while (-1 == nanosleep(&ts, &ts) && EINTR == errno) {}
+		}
+
+		/*
+		 * Sleep until at least usec micro seconds have passed
+		 * since a time from _now(), which is not affected by
+		 * changes to the clock.
+		 */
+		void _udelay_since(const int64_t since, const long usec) {
+			int64_t elapsed = _now() - since;
+
+			if (elapsed >= 0 && elapsed < usec)
+				_udelay(usec - elapsed);
+		}
+		// }}}
+
+		// {{{ _flush()
+		/*
+		 * Flush both directions of the serial line.
+		 *
+		 * After a flush the state of a partially sent command
+		 * is unknown, so the page must be activated again.
+		 */
+		void _flush() {
+			num_flushes++;
+			transport->flush();
+			cur_page = -1;
+			a_pending = 0;
+		}
+		// }}}
+
+		// {{{ _drain_A()
+		/*
+		 * Read and discard the responses of pipelined 'A' commands
+		 * so that another command can be sent.
+		 *
+		 * Every command other than cmd_A() must call this first.
+		 */
+		void _drain_A() {
+			if (0 == a_pending)
+				return;
+
+			int n = a_pending * a_bytes;
+			long timeout = a_pending * _budget('A', a_bytes);
+			a_pending = 0;
+
+			char* buf = new char[n];
+			if (sread(devfd, buf, n, timeout) != n) {
+				cerr << "error draining pipelined A commands\n";
+				_flush();
+			}
+			delete[] buf;
+		}
+		// }}}
+
+		// {{{ _page_cmd()
+		/*
+		 * Send a page command ('r', 'w' or 'k') with its offset and size,
+		 * followed by an optional payload.
+		 *
+		 * The ecu needs time to activate a page before it accepts
+		 * the rest of a command, but only when the page changes.
+		 * When the page is already active the whole command
+		 * is sent with a single write.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool _page_cmd(const char cmd, const int tbl_idx,
+						const int offset, const int num_bytes,
+						const char* payload, const int payload_bytes)
+		{
+			_drain_A();
+
+			string msg;
+			msg.reserve(7 + payload_bytes);
+
+			msg += cmd;
+			msg += (char) 0;  // can-id
+			msg += (unsigned char) tbl_idx;
+
+			if (tbl_idx != cur_page) {
+				cur_page = -1;
+
+				if (swrite(devfd, msg.data(), msg.size()) < (int) msg.size())
+					return true;  // error
+				msg.clear();
+
+				_udelay(page_delay * 1000L);
+				cur_page = tbl_idx;
+			}
+
+			msg += (unsigned char)((offset >> 8) & 255);
+			msg += (unsigned char)(offset & 255);
+
+			msg += (unsigned char)((num_bytes >> 8) & 255);
+			msg += (unsigned char)(num_bytes & 255);
+
+			if (payload_bytes > 0)
+				msg.append(payload, payload_bytes);
+
+			if (swrite(devfd, msg.data(), msg.size()) < (int) msg.size()) {
+				cur_page = -1;
+				return true;  // error
+			}
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ _frame_cmd()
+		/*
+		 * Send a command in a frame and read its response frame
+		 * (see setFramed()).
+		 *
+		 * A frame is a 2 byte length, the payload and the CRC32 of
+		 * the payload, all big endian.  The payload of a response
+		 * is a status byte followed by the data.
+		 *
+		 * Because the length of a response is known a corrupt
+		 * frame is read completely, so only that command has to be
+		 * sent again.  The line is only flushed when the length
+		 * itself can not be trusted or the response is incomplete.
+		 *
+		 * @arg command, for the statistics
+		 * @arg payload of the request
+		 * @arg buffer for the data of the response
+		 * @arg size of the buffer
+		 *
+		 * @returns number of data bytes, -1 on error
+		 */
+		int _frame_cmd(const char cmd, const string& payload,
+						char* data, const int max_bytes)
+		{
+			string msg;
+			msg.reserve(payload.size() + 6);
+
+			msg += (unsigned char)((payload.size() >> 8) & 255);
+			msg += (unsigned char)(payload.size() & 255);
+			msg += payload;
+
+			uint32_t crc = crc32(payload.data(), payload.size());
+			for (int i = 24; i >= 0; i -= 8)
+				msg += (unsigned char)((crc >> i) & 255);
+
+			int max_tries = 3;
+			for (int tries = 0; tries < max_tries; tries++) {
+				int64_t start = _now();
+
+				if (swrite(devfd, msg.data(), msg.size()) < (int) msg.size()) {
+					_record(cmd, start, true);
+					_flush();
+					continue;
 				}
 
-				if (nr == size) {
-					break;
+				unsigned char hdr[2];
+				if (sread(devfd, (char*) hdr, 2, _budget(cmd, 2)) != 2) {
+					_record(cmd, start, true);
+					_flush();
+					continue;
 				}
-			}
-			if (errs >= max_errs) {
-				cerr << "sread() reached max_errs of " << errs << " got " << nr << " bytes\n";
-				buf = buf_start;  // reset to begining
-				return -1; // error
+
+				int len = (hdr[0] << 8) | hdr[1];
+				if (len < 1 || len > max_bytes + 1) {
+					cerr << "invalid frame length " << len << " for "
+						<< cmd << " command\n";
+					_record(cmd, start, true);
+					_flush();
+					continue;
+				}
+
+				frame_buf.resize(len + 4);
+				if (sread(devfd, &frame_buf[0], len + 4, _budget(cmd, len + 4)) != len + 4) {
+					_record(cmd, start, true);
+					_flush();
+					continue;
+				}
+
+				const unsigned char* c = (const unsigned char*) &frame_buf[len];
+				uint32_t got = ((uint32_t) c[0] << 24) | ((uint32_t) c[1] << 16)
+								| ((uint32_t) c[2] << 8) | (uint32_t) c[3];
+
+				if (got != crc32(&frame_buf[0], len)) {
+					// the whole frame was read, the line is still in sync
+					cerr << "corrupt response to " << cmd << " command, retrying\n";
+					num_corrupt++;
+					_record(cmd, start, true);
+					continue;
+				}
+
+				unsigned char status = frame_buf[0];
+				if (status >= 0x80) {
+					_record(cmd, start, true);
+
+					if (0x82 == status) {
+						// the ecu received a corrupt request
+						continue;
+					} else if (0x85 == status) {
+						// busy
+						_udelay(page_delay * 1000L);
+						continue;
+					}
+
+					cerr << "ecu returned error " << (int) status
+						<< " for " << cmd << " command\n";
+					return -1;  // error
+				}
+
+				if (len > 1)
+					memcpy(data, &frame_buf[1], len - 1);
+
+				_record(cmd, start, false);
+
+				return len - 1;  // OK
 			}
 
-			buf = buf_start;  // reset to begining
-			return nr; 		  // OK
+			cerr << "framed " << cmd << " command failed after "
+				<< max_tries << " tries\n";
+			return -1;  // error
+		}
+		// }}}
+
+		// {{{ _page_payload()
+		/*
+		 * A page command ('r', 'w' or 'k') as the payload of a frame.
+		 */
+		string _page_payload(const char cmd, const int tbl_idx,
+								const int offset, const int num_bytes,
+								const char* bytes, const int num_data)
+		{
+			string msg;
+			msg.reserve(7 + num_data);
+
+			msg += cmd;
+			msg += (char) 0;  // can-id
+			msg += (unsigned char) tbl_idx;
+			msg += (unsigned char)((offset >> 8) & 255);
+			msg += (unsigned char)(offset & 255);
+			msg += (unsigned char)((num_bytes >> 8) & 255);
+			msg += (unsigned char)(num_bytes & 255);
+
+			if (num_data > 0)
+				msg.append(bytes, num_data);
+
+			return msg;
+		}
+		// }}}
+
+		// {{{ _init()
+		/*
+		 * Defaults shared by the constructors.
+		 */
+		void _init() {
+			devfd = -1;
+
+			cur_page = -1;
+			page_delay = 200;
+			write_delay = 5;
+
+			last_write = 0;
+
+			a_depth = 0;
+			a_pending = 0;
+			a_bytes = 0;
+
+			bauds.push_back(115200);
+			baud = 115200;
+
+			framed = false;
+			block_bytes = 1024;
+			num_corrupt = 0;
+
+			num_flushes = 0;
+			bytes_sent = 0;
+			bytes_received = 0;
+
+			timeouts['A'] = 50000;
+			timeouts['Q'] = 100000;
+			timeouts['S'] = 100000;
+			timeouts['r'] = 100000;
+			timeouts['k'] = 100000;
 		}
 		// }}}
 
@@ -138,14 +572,263 @@ class MSQSerial {
 		 */
 		MSQSerial(const string _dev_file) {
 			dev_file = _dev_file;
-			devfd = -1;
+			transport = NULL;
+			_init();
+		}
+		// }}}
+
+		// {{{ MSQSerial(transport)
+		/**
+		 * Create a new MSQSerial object using a transport,
+		 * which it then owns.
+		 *
+		 * Connection to the device is not initiated here (see connect()).
+		 */
+		MSQSerial(MSQTransport* _transport) {
+			transport = _transport;
+			dev_file = transport->name();
+			_init();
 		}
 		// }}}
 
 		// {{{ ~MSQSerial
 		~MSQSerial() {
-			if (devfd > -1)
-				close(devfd);
+			if (transport != NULL)
+				delete transport;
+		}
+		// }}}
+
+		// {{{ setDelays()
+		/**
+		 * Set the delays needed by the ecu between commands.
+		 *
+		 * @arg milliseconds to wait after a page is activated
+		 * (or after a burn) before the rest of a command is sent
+		 * (pageActivationDelay in the ini)
+		 *
+		 * @arg minimum milliseconds between two write commands
+		 * (interWriteDelay in the ini)
+		 *
+		 * The defaults are 200 ms and 5 ms.
+		 */
+		void setDelays(const int _page_delay, const int _write_delay) {
+			page_delay = _page_delay;
+			write_delay = _write_delay;
+		}
+		// }}}
+
+		// {{{ setTimeout()
+		/**
+		 * Set the time allowed for the ecu to respond to a command.
+		 *
+		 * The time to send the bytes of the response is added
+		 * to this, so it only needs to cover the time the ecu
+		 * takes to start responding.
+		 * After a time out the command is retried (see each cmd_*).
+		 *
+		 * @arg command ('A', 'Q', 'S', 'r' or 'k')
+		 * @arg milliseconds
+		 *
+		 * The defaults are 50 ms for 'A' and 100 ms for the others.
+		 */
+		void setTimeout(const char cmd, const int ms) {
+			timeouts[cmd] = ms * 1000L;
+		}
+		// }}}
+
+		// {{{ latency(), failed(), latencyReport()
+		/**
+		 * Latency, in micro seconds, of the successful commands
+		 * of a type ('A', 'Q', 'S', 'r', 'k', 'w' or 'b').
+		 *
+		 * It is measured from when the command is started until
+		 * the last byte of the response is received (or until it
+		 * is written if there is no response).
+		 * Pipelined 'A' commands (see setPipelined()) only include
+		 * the time spent waiting for the frame.
+		 */
+		const MSQHistogram& latency(const char cmd) {
+			return latencies[cmd];
+		}
+
+		/**
+		 * Number of commands of a type that failed, including
+		 * those which succeeded after a retry.
+		 */
+		unsigned long failed(const char cmd) {
+			return failures[cmd];
+		}
+
+		/**
+		 * A summary of the latency of each type of command
+		 * that has been used, one line per type.
+		 */
+		string latencyReport() {
+			ostringstream out;
+
+			map<char, MSQHistogram>::iterator it;
+			for (it = latencies.begin(); it != latencies.end(); it++) {
+				out << it->first << ": " << it->second.summary()
+					<< " us, failed=" << failures[it->first] << "\n";
+			}
+
+			return out.str();
+		}
+		// }}}
+
+		// {{{ flushes(), bytesSent(), bytesReceived()
+		/**
+		 * Number of times the line was flushed, after an error
+		 * or while probing.
+		 */
+		unsigned long flushes() {
+			return num_flushes;
+		}
+
+		/**
+		 * Total bytes written to the device.
+		 */
+		uint64_t bytesSent() {
+			return bytes_sent;
+		}
+
+		/**
+		 * Total bytes read from the device.
+		 */
+		uint64_t bytesReceived() {
+			return bytes_received;
+		}
+		// }}}
+
+		// {{{ setFramed(), corruptFrames()
+		/**
+		 * Use the framed (newserial) protocol.
+		 *
+		 * Each command and response is sent with its length and
+		 * a CRC32 so that a corrupt response is detected and
+		 * only that command is sent again (see _frame_cmd()),
+		 * instead of flushing the line.
+		 * Reads ('r') larger than a block are split in to several
+		 * frames, each of which is retried on its own.
+		 *
+		 * Pipelining (setPipelined()) is not used when framed.
+		 *
+		 * @arg on or off, the default is off
+		 * @arg largest number of bytes read by one frame
+		 */
+		void setFramed(const bool on, const int _block_bytes = 1024) {
+			_drain_A();
+
+			framed = on;
+			block_bytes = (_block_bytes > 0) ? _block_bytes : 1024;
+		}
+
+		/**
+		 * Number of corrupt response frames that were retried.
+		 */
+		unsigned long corruptFrames() {
+			return num_corrupt;
+		}
+		// }}}
+
+		// {{{ setPipelined()
+		/**
+		 * Pipeline the real time data commands (cmd_A()).
+		 *
+		 * Normally the link is idle from the time one frame of
+		 * real time data is received until the next cmd_A().
+		 * When pipelined, cmd_A() sends the request for the next
+		 * frame as soon as the current one has been received, so
+		 * the ecu is already sending it while the caller decodes
+		 * and stores the current one.
+		 *
+		 * With a depth of 1 the next frame is requested when the
+		 * current one has been received, which hides the time
+		 * spent between calls.
+		 * With a depth of 2 a request is always waiting at the ecu
+		 * so that it sends frames back to back, hiding the latency
+		 * of the serial adapter as well.  This requires firmware
+		 * which accepts a command while it is still sending.
+		 *
+		 * Frames are requested ahead of time, so it is only useful
+		 * when cmd_A() is called again right away (not at a fixed
+		 * sample rate).
+		 * Any other command first reads and discards the
+		 * outstanding frames.
+		 *
+		 * @arg requests kept outstanding, 0 (the default) is off
+		 */
+		void setPipelined(const int depth) {
+			if (depth < a_pending)
+				_drain_A();
+
+			a_depth = depth;
+		}
+		// }}}
+
+		// {{{ _set_speed()
+		/*
+		 * Set the baud rate of the transport.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool _set_speed(const int rate) {
+			if (transport->setBaud(rate))
+				return true;  // error
+
+			baud = rate;
+			cur_page = -1;
+			a_pending = 0;
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ setBauds()
+		/**
+		 * Set the baud rates to use, in order of preference.
+		 *
+		 * connect() uses the first one, probe() tries each of them.
+		 * The default is only 115200.
+		 *
+		 * @arg baud rates, such as 230400 or 115200
+		 *
+		 * @returns true if a rate is not supported, false otherwise
+		 */
+		bool setBauds(const vector<int>& rates) {
+			if (rates.empty()) {
+				cerr << "no baud rates given\n";
+				return true;  // error
+			}
+
+			for (unsigned int i = 0; i < rates.size(); i++) {
+				if (B0 == msq_speed(rates[i])) {
+					cerr << "unsupported baud rate " << rates[i] << "\n";
+					return true;  // error
+				}
+			}
+
+			bauds = rates;
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ deviceName()
+		/**
+		 * @returns a description of the device (see MSQTransport::name())
+		 */
+		string deviceName() {
+			return (transport != NULL) ? transport->name() : dev_file;
+		}
+		// }}}
+
+		// {{{ getBaud()
+		/**
+		 * @returns the baud rate in use
+		 */
+		int getBaud() {
+			return baud;
 		}
 		// }}}
 
@@ -155,88 +838,67 @@ class MSQSerial {
 		 * 
 		 * @returns true on error, false otherwise
 		 *
-		 * Currently it only supports version 3.* series with a
-		 * baud rate of 115200.
+		 * The device name selects the transport, such as a serial
+		 * device or a simulated ecu (see msq_transport()).
+		 *
+		 * The device is configured for the first baud rate
+		 * (see setBauds()), nothing is sent to the ecu.
+		 * Use probe() to find the rate the ecu is using.
 		 */
 		bool connect() {
-			struct termios options;
+			if (NULL == transport) {
+				transport = msq_transport(dev_file);
+				if (NULL == transport)
+					return true;  // error
+			}
 
-			devfd = open(dev_file.c_str(), O_RDWR | O_NOCTTY | O_NDELAY);
-			if (devfd == -1) {
-				char buf[1000];
+			if (transport->open())
+				return true;  // error
 
-				sprintf(buf, "Unable to open device '%s'", dev_file.c_str());
-				perror(buf);
+			devfd = transport->fd();
+			cur_page = -1;
+			a_pending = 0;
 
-				return true;  // error
-			} else {
-				fcntl(devfd, F_SETFL, 0);
-			}
+			return _set_speed(bauds[0]);
+		}
+		// }}}
 
-			// get current options
-			tcgetattr(devfd, &options);
-
-			// flush both
-			tcflush(devfd, TCIOFLUSH);
-
-			//cfsetispeed(&options, 0);  // 0 -> same as ospeed
-			cfsetispeed(&options, B115200);
-			cfsetospeed(&options, B115200);
-
-			// Control options (c_cflag)
-			options.c_cflag &= ~( PARENB | CSTOPB | CSIZE );
-			options.c_cflag |= CLOCAL | CREAD;
-			// No parity (8N1)
-			options.c_cflag &= ~PARENB;
-			options.c_cflag &= ~CSTOPB;
-			options.c_cflag &= ~CSIZE;
-			options.c_cflag |= CS8;
-
-			// Line options (clflag)
-			options.c_lflag = ~(ICANON | ECHO | ECHOE | ECHONL | IEXTEN | ISIG);
-
-			// Input options (c_iflag)
-			// disable software flow control
-			options.c_iflag &= ~(IXON | IXOFF | IXANY);
-
-			// Output options (c_oflag)
-			options.c_oflag &= ~OPOST;
-
-			// Control characters
-			options.c_cc[VQUIT]    = 0;     /* Ctrl-\ */
-			options.c_cc[VERASE]   = 0;     /* del */
-			options.c_cc[VKILL]    = 0;     /* @ */
-			options.c_cc[VEOF]     = 0;     /* Ctrl-d */
-			options.c_cc[VEOL]     = 0;     /* '\0' */
-			options.c_cc[VMIN]     = 0;     
-			options.c_cc[VTIME]    = 1;     /* 100ms timeout */
-
-			// write, verify, retry if needed
-			int i = 0;
-			struct termios voptions;
-			for (i = 0; i < 5; i++) {
-				tcsetattr(devfd, TCSANOW, &options);
-
-				tcgetattr(devfd, &voptions);
-
-				if (B115200 != cfgetispeed(&voptions)) {
-					cerr << "cfsetispeed failed\n";
-					continue;  // retry
-				}
+		// {{{ probe()
+		/**
+		 * Find the baud rate of the ecu.
+		 *
+		 * Each rate (see setBauds()) is tried in order until the
+		 * ecu answers both the version (cmd_Q()) and signature
+		 * (cmd_S()) commands with text.
+		 * At the wrong rate the ecu sees garbage, so after each
+		 * failed attempt the line is allowed to go quiet and
+		 * then flushed.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool probe() {
+			for (unsigned int i = 0; i < bauds.size(); i++) {
+				if (_set_speed(bauds[i]))
+					continue;
 
-				if (B115200 != cfgetospeed(&voptions)) {
-					cout << "cfsetospeed failed\n";
-					continue;  // retry
+				string ver = cmd_Q();
+				bool ok = ! ver.empty();
+				for (unsigned int j = 0; j < ver.size(); j++) {
+					if (! isprint((unsigned char) ver[j]))
+						ok = false;
 				}
 
-				break;  // success
-			}
-			if (i == 5) {
-				cerr << "failed to configure serial port\n";
-				return true;  // error
+				if (ok && ! cmd_S().empty())
+					return false;  // OK
+
+				cerr << "no response from the ecu at " << bauds[i] << " baud\n";
+
+				_udelay(200000);
+				_flush();
 			}
 
-			return false;  // OK
+			cerr << "unable to find the baud rate of the ecu\n";
+			return true;  // error
 		}
 		// }}}
 
@@ -250,18 +912,35 @@ class MSQSerial {
 		{
 			int n;  // read/write counts
 
-			n = write(devfd, "Q", 1);
+			_drain_A();
+
+			if (framed) {
+				char buf[21];
+				n = _frame_cmd('Q', "Q", buf, 20);
+				if (n < 0)
+					return "";  // error
+
+				buf[n] = '\0';
+				return buf;  // OK
+			}
+
+			int64_t start = _now();
+
+			n = swrite(devfd, "Q", 1);
 			if (n != 1) {
 				cerr << "write of Q command failed\n";
+				_record('Q', start, true);
 				return "";
 			}
 
 			char buf[21];
-			n = sread(devfd, buf, 20, 3);
+			n = sread(devfd, buf, 20, _budget('Q', 20));
+			_record('Q', start, n < 0);
 			if (n < 0) {
 				cerr << "read of Q command failed\n";
 				return "";  // error
 			}
+			buf[20] = '\0';
 
 			string ver(buf);
 			return ver;  // OK
@@ -277,19 +956,36 @@ class MSQSerial {
 		string cmd_S()
 		{
 			int n;  // read/write counts
-			
-			n = write(devfd, "S", 1);
+
+			_drain_A();
+
+			if (framed) {
+				char buf[61];
+				n = _frame_cmd('S', "S", buf, 60);
+				if (n < 0)
+					return "";  // error
+
+				buf[n] = '\0';
+				return buf;  // OK
+			}
+
+			int64_t start = _now();
+
+			n = swrite(devfd, "S", 1);
 			if (n < 0)  {
 				cerr << "write of S command failed!\n";
+				_record('S', start, true);
 				return "";  // error
 			}
 
 			char buf[61];
-			n = sread(devfd, buf, 60, 5);
+			n = sread(devfd, buf, 60, _budget('S', 60));
+			_record('S', start, n < 0);
 			if (n < 0) {
 				cerr << "error reading result of S command\n";
 				return "";  // error
 			}
+			buf[60] = '\0';
 			string sig(buf);
 
 			return sig;  // OK
@@ -301,73 +997,60 @@ class MSQSerial {
 		 * Read data such as tables and settings from the ecu.
 		 *
 		 * cmd_r(<tbl_idx>, <offset>, <bytes>)
+		 *
+		 * The page activation delay is only paid when tbl_idx
+		 * differs from the page of the previous command.
+		 *
+		 * When framed (see setFramed()) the data is read in blocks.
 		 */
 		int cmd_r(const int tbl_idx,
 					const int offset, const int num_bytes, char* msg)
 		{
 			if (DEBUG) { cout << "cmd_r()\n"; }
 
-			int max_tries = 2;
-			int tries = 0;
-
-			int n;
-			while (tries++ < max_tries) {
-				char _buf[7];
-				char* buf;
-				buf = &_buf[0];
-
-				*buf = 114;  // 'r'
-				buf++;
-
-				*buf = 0;
-				buf++;
-
-				*buf = (unsigned char) tbl_idx;
-				buf++;
-
-				buf = &_buf[0]; /* reset to begining */
+			if (framed) {
+				for (int done = 0; done < num_bytes; ) {
+					int n = num_bytes - done;
+					if (n > block_bytes)
+						n = block_bytes;
 
-				n = write(devfd, buf, 3);
-				if (n < 3) {
-					cerr << "write of r command failed!\n";
-					tcflush(devfd, TCIOFLUSH);
-					continue;
+					string cmd = _page_payload('r', tbl_idx, offset + done, n, NULL, 0);
+					if (_frame_cmd('r', cmd, msg + done, n) != n) {
+						cerr << "cmd_r framed read failed\n";
+						return -1;  // error
+					}
+					done += n;
 				}
 
-				/* 200 ms delay required when switching pages (or anytime) */
-				usleep(200000);   /* 200 ms -> 200000 us (micro seconds) */
-
-
-				*buf = (unsigned char)((offset >> 8) & 255);
-				buf++;
-				*buf = (unsigned char)(offset & 255);
-				buf++;
+				return num_bytes;  // OK
+			}
 
-				*buf = (unsigned char)((num_bytes >> 8) & 255);
-				buf++;
-				*buf = (unsigned char)(num_bytes & 255);
-				/*buf++;*/
+			int max_tries = 2;
+			int tries;
 
-				buf = &_buf[0]; /* reset to begining */
+			int n;
+			for (tries = 0; tries < max_tries; tries++) {
+				int64_t start = _now();
 
-				n = write(devfd, buf, 4);
-				if (n < 4) {
+				if (_page_cmd('r', tbl_idx, offset, num_bytes, NULL, 0)) {
 					cerr << "write of r command failed!\n";
-					tcflush(devfd, TCIOFLUSH);
+					_record('r', start, true);
+					_flush();
 					continue;
 				}
 
-				n = sread(devfd, msg, num_bytes, 10);
+				n = sread(devfd, msg, num_bytes, _budget('r', num_bytes));
+				_record('r', start, n < num_bytes);
 				if (n < num_bytes) {
 					cerr << "cmd_r sread() returned too few bytes, got " << n << ", expecting " << num_bytes << endl;
-					tcflush(devfd, TCIOFLUSH);
+					_flush();
 					continue;
 				}
 
 				break;
 			}
 			if (tries >= max_tries) {
-				cerr << "cmd_r max_tries of " << tries << " reached\n";
+				cerr << "cmd_r max_tries of " << max_tries << " reached\n";
 				return -1;  // error
 			}
 
@@ -375,6 +1058,66 @@ class MSQSerial {
 		}
 		// }}}
 
+		// {{{ cmd_k
+		/**
+		 * Get the CRC32 of a page of the ecu ram.
+		 *
+		 * This is much faster than reading the page to find
+		 * out if it has changed (see crc32() in MSQUtils.h).
+		 *
+		 * @arg table index
+		 * @arg crc of the page
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool cmd_k(const int tbl_idx, uint32_t& crc)
+		{
+			int max_tries = 2;
+
+			if (framed) {
+				unsigned char buf[4];
+				string cmd = _page_payload('k', tbl_idx, 0, 4, NULL, 0);
+				if (_frame_cmd('k', cmd, (char*) buf, 4) != 4) {
+					cerr << "cmd_k framed read failed\n";
+					return true;  // error
+				}
+
+				crc = ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16)
+						| ((uint32_t) buf[2] << 8) | (uint32_t) buf[3];
+
+				return false;  // OK
+			}
+
+			for (int tries = 0; tries < max_tries; tries++) {
+				int64_t start = _now();
+
+				if (_page_cmd('k', tbl_idx, 0, 4, NULL, 0)) {
+					cerr << "write of k command failed!\n";
+					_record('k', start, true);
+					_flush();
+					continue;
+				}
+
+				unsigned char buf[4];
+				int n = sread(devfd, (char*) buf, 4, _budget('k', 4));
+				_record('k', start, n < 4);
+				if (n < 4) {
+					cerr << "cmd_k sread() returned too few bytes, got " << n << ", expecting 4\n";
+					_flush();
+					continue;
+				}
+
+				crc = ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16)
+						| ((uint32_t) buf[2] << 8) | (uint32_t) buf[3];
+
+				return false;  // OK
+			}
+
+			cerr << "cmd_k max_tries of " << max_tries << " reached\n";
+			return true;  // error
+		}
+		// }}}
+
 		// {{{ cmd_w
 		/**
 		 * Write data such as tables and settings to the ecu.
@@ -382,63 +1125,46 @@ class MSQSerial {
 		 * This command is the opposite of the "r" (read) command.
 		 *
 		 * cmd_w(<tbl_idx>, <offset>, <num_bytes>, <bytes>)
+		 *
+		 * Any number of contiguous bytes can be written with a
+		 * single command, which is much faster than writing
+		 * them one at a time.
+		 * Consecutive writes are spaced by the inter write delay
+		 * (see setDelays()).
 		 */
 		int cmd_w(const int tbl_idx,
-					const int offset, const int num_bytes, char* bytes)
+					const int offset, const int num_bytes, const char* bytes)
 		{
-			int n;
-			char _buf[7];
-			char* buf;
-			buf = &_buf[0];
-
-			*buf = 119;  // 'w'
-			buf++;
+			_udelay_since(last_write, write_delay * 1000L);
 
-			// can-id?
-			*buf = 0;
-			buf++;
+			if (framed) {
+				string cmd = _page_payload('w', tbl_idx, offset, num_bytes,
+											bytes, num_bytes);
+				int n = _frame_cmd('w', cmd, NULL, 0);
 
-			*buf = (unsigned char) tbl_idx;
-			buf++;
+				last_write = _now();
 
-			buf = &_buf[0]; /* reset to begining */
+				if (n < 0) {
+					cerr << "cmd_w(), write error\n";
+					return -1;  // error
+				}
 
-			n = write(devfd, buf, 3);
-			if (n < 3) {
-				fputs("write of w command failed!\n", stderr);
-				return -1;  // error
+				return 0;  // OK
 			}
 
-			/* 200 ms delay required when switching pages (or anytime) */
-			usleep(200000);   /* 200 ms -> 200000 us (micro seconds) */
-
-			*buf = (unsigned char)((offset >> 8) & 255);
-			buf++;
-			*buf = (unsigned char)(offset & 255);
-			buf++;
+			int64_t start = _now();
 
-			*buf = (unsigned char)((num_bytes >> 8) & 255);
-			buf++;
-			*buf = (unsigned char)(num_bytes & 255);
-			//buf++;
+			bool err = _page_cmd('w', tbl_idx, offset, num_bytes,
+									bytes, num_bytes);
 
-			buf = &_buf[0]; // reset to begining
+			last_write = _now();
+			_record('w', start, err);
 
-			n = write(devfd, buf, 4);
-			if (n < 4) {
-				cerr << "write of r command failed!\n";
+			if (err) {
+				cerr << "cmd_w(), write error\n";
 				return -1;  // error
 			}
 
-			for (int i = 0; i < num_bytes; i++) {
-				n = write(devfd, bytes, 1);
-				bytes++;
-				if (n != 1) {
-					cerr << "cmd_w(), write error\n";
-					return -1;  // error
-				}
-			}
-
 			return 0;  // OK
 		}
 		// }}}
@@ -459,34 +1185,67 @@ class MSQSerial {
 		 * The buffer must be large enough to store this many bytes.
 		 * And the actual values described by the bytes should also be
 		 * described in the ini file.
+		 *
+		 * When pipelined (see setPipelined()) the frame may have been
+		 * requested by the previous call and the next frame is
+		 * requested before returning.
 		 */
 		bool cmd_A(const int num_bytes, char* buf)
 		{
 			int n;  // read/write counts
 			int tries = 0;
 			int max_tries = 2;
-			
-			while (tries++ < max_tries) {
-				n = write(devfd, "A", 1);
-				if (n != 1)  {
-					cerr << "write of A command failed\n";
-					tcflush(devfd, TCIOFLUSH);	
-					continue;
+
+			if (framed) {
+				if (_frame_cmd('A', "A", buf, num_bytes) != num_bytes) {
+					cerr << "cmd_A() framed read failed\n";
+					return true;  // error
+				}
+
+				return false;  // OK
+			}
+
+			if (a_pending > 0 && a_bytes != num_bytes)
+				_drain_A();
+
+			for (tries = 0; tries < max_tries; tries++) {
+				int64_t start = _now();
+
+				if (0 == a_pending) {
+					n = swrite(devfd, "A", 1);
+					if (n != 1)  {
+						cerr << "write of A command failed\n";
+						_record('A', start, true);
+						_flush();
+						continue;
+					}
+				} else {
+					a_pending--;
 				}
 
-				n = sread(devfd, buf, num_bytes, 5);
+				n = sread(devfd, buf, num_bytes, _budget('A', num_bytes));
+				_record('A', start, n != num_bytes);
 				if (n != num_bytes) {
 					cerr << "error reading result of A command\n";
-					tcflush(devfd, TCIOFLUSH);	
+					_flush();
+					continue;
 				}
 
 				break;
 			}
 			if (tries >= max_tries) {
-				cerr << "cmd_A() max_tries of " << max_tries << "exceeded\n";
+				cerr << "cmd_A() max_tries of " << max_tries << " exceeded\n";
 				return true;  // error
 			}
 
+			// request the next frame(s) while this one is used
+			a_bytes = num_bytes;
+			while (a_pending < a_depth) {
+				if (1 != swrite(devfd, "A", 1))
+					break;
+				a_pending++;
+			}
+
 			return false;  // OK
 		}
 		// }}}
@@ -502,10 +1261,12 @@ class MSQSerial {
 		bool cmd_b(const int tbl_idx)
 		{
 			int n;  // read/write counts
-			char _buf[2];
+			char _buf[3];
 			char *buf;
 			buf = &_buf[0];
-			
+
+			_drain_A();
+
 			*buf = 'b';
 			buf++;
 
@@ -517,12 +1278,28 @@ class MSQSerial {
 
 			buf = &_buf[0]; // reset to begining
 
-			n = write(devfd, buf, 3);
+			if (framed) {
+				if (_frame_cmd('b', string(buf, 3), NULL, 0) < 0) {
+					cerr << "write of b command failed\n";
+					return true;  // error
+				}
+
+				cur_page = -1;
+				return false;  // OK
+			}
+
+			int64_t start = _now();
+
+			n = swrite(devfd, buf, 3);
+			_record('b', start, n < 3);
 			if (n < 3)  {
 				cerr << "write of b command failed\n";
 				return true;  // error
 			}
 
+			// The ecu must re-activate a page after a burn.
+			cur_page = -1;
+
 			return false;  // OK
 		}
 		// }}}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "MSQUtils.h"
+
+using namespace std;
+
+#define MSQSIM_FRAME_BYTES 169
+#define MSQSIM_PAGE_BYTES 1024
+
+/**
+ * A simulated MS2 ecu which serves the legacy serial protocol
+ * ('A', 'r', 'w', 'k', 'b', 'Q' and 'S') on a file descriptor,
+ * from its own thread.
+ *
+ * The time a real link takes is emulated: a command is seen a
+ * fixed latency after it was sent (such as that of a USB serial
+ * adapter) and the bytes of the command and response take their
+ * time at the baud rate (10 bits per byte).
+ * Only one response is sent at a time, but a command sent while
+ * the previous response is still being sent waits no longer than
+ * that response, so pipelined commands hide the latency as they
+ * would on a real link.
+ *
+ * The real time data follows a fixed pattern which only depends
+ * upon the number of frames sent, so runs are repeatable.
+ * The pages start out zeroed.
+ */
+class MSQSimEcu {
+	private:
+		int fd;
+		pthread_t thread;
+		bool running;
+
+		volatile long latency;	// us added to each response
+		volatile int baud;		// 0 -> no wire time
+
+		map<int, vector<char> > pages;
+		unsigned long num_frames;
+
+		// emulated times, micro seconds (see _now())
+		int64_t cmd_time;	// when the current command was sent
+		int64_t busy_until;	// end of the previous response
+
+		// number of each command received, only changed by the thread
+		volatile unsigned long counts[256];
+
+		MSQSimEcu(const MSQSimEcu&);  // no copies
+		MSQSimEcu& operator=(const MSQSimEcu&);
+
+		// {{{ _udelay()
+		void _udelay(const long usec) {
+			if (usec <= 0)
+				return;
+
+			struct timespec ts;
+
+			ts.tv_sec = usec / 1000000;
+			ts.tv_nsec = (usec % 1000000) * 1000;
+
+			while (-1 == nanosleep(&ts, &ts) && EINTR == errno) {}
+		}
+		// }}}
+
+		// {{{ _now()
+		static int64_t _now() {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+
+			return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+		}
+		// }}}
+
+		// {{{ _read(), _send()
+		/*
+		 * Read exactly n bytes.
+		 *
+		 * @returns false if the other end was closed
+		 */
+		bool _read(char* buf, const int n) {
+			int nr = 0;
+			while (nr < n) {
+				int r = read(fd, buf + nr, n - nr);
+				if (r > 0) {
+					nr += r;
+				} else if (0 == r || EINTR != errno) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		/*
+		 * Send a response to a command of in_bytes, after the
+		 * emulated latency and wire time.
+		 */
+		void _send(const char* buf, const int n, const int in_bytes) {
+			long wire = 0;
+			if (baud > 0)
+				wire = ((long) (in_bytes + n) * 10000000L) / baud;
+
+			int64_t start = cmd_time + latency;
+			if (start < busy_until)
+				start = busy_until;
+			busy_until = start + wire;
+
+			_udelay(busy_until - _now());
+
+			int nw = 0;
+			while (nw < n) {
+				int w = write(fd, buf + nw, n - nw);
+				if (w > 0)
+					nw += w;
+				else if (w < 0 && EINTR != errno)
+					return;
+			}
+		}
+		// }}}
+
+		// {{{ _page()
+		vector<char>& _page(const int tbl_idx) {
+			vector<char>& p = pages[tbl_idx];
+			if (p.empty())
+				p.resize(MSQSIM_PAGE_BYTES, 0);
+
+			return p;
+		}
+		// }}}
+
+		// {{{ _frame()
+		static void _put16(char* buf, const int offset, const int v) {
+			buf[offset] = (char) ((v >> 8) & 255);
+			buf[offset + 1] = (char) (v & 255);
+		}
+
+		/*
+		 * Build the next frame of real time data.
+		 *
+		 * The rpm sweeps from 800 to 6000 and back every 2000
+		 * frames with the load following it, the offsets and
+		 * scales are those of the MS2/Extra 3.1.1 ini.
+		 */
+		void _frame(char* buf) {
+			memset(buf, 0, MSQSIM_FRAME_BYTES);
+
+			unsigned long i = num_frames++;
+			int phase = i % 2000;
+			int sweep = (phase < 1000) ? phase : 2000 - phase;  // 0 to 1000
+
+			int rpm = 800 + sweep * 52 / 10;
+			int load = 300 + sweep * 7 / 10;	// map, 30.0 to 100.0 kPa
+
+			_put16(buf, 0, (int) ((i * 147 / 10000) & 0xffff));  // seconds
+			_put16(buf, 2, 1500 + load * 10);		// pulseWidth1
+			_put16(buf, 4, 1500 + load * 10);		// pulseWidth2
+			_put16(buf, 6, rpm);					// rpm
+			_put16(buf, 8, 350 - sweep / 5);		// advance, 0.1 deg
+			buf[12] = (char) 147;					// afrtgt1, 0.1 AFR
+			buf[13] = (char) 147;					// afrtgt2
+			_put16(buf, 16, 1000);					// barometer, 0.1 kPa
+			_put16(buf, 18, load);					// map, 0.1 kPa
+			_put16(buf, 20, 860);					// mat, 86.0 F (30 C)
+			_put16(buf, 22, 1760);					// coolant, 176.0 F (80 C)
+			_put16(buf, 24, sweep);					// tps, 0.1 %
+			_put16(buf, 26, 138);					// batteryVoltage, 0.1 v
+			_put16(buf, 28, 140 + (int) (i % 15));	// afr1, 0.1 AFR
+			_put16(buf, 34, 1000);					// egoCorrection1, 0.1 %
+			_put16(buf, 50, 600 + sweep / 4);		// veCurr1, 0.1 %
+			_put16(buf, 66, load);					// fuelload, 0.1 %
+		}
+		// }}}
+
+		// {{{ _serve()
+		/*
+		 * Answer commands until the other end is closed.
+		 */
+		void _serve() {
+			char cmd;
+			char hdr[6];
+			char buf[MSQSIM_PAGE_BYTES + 1];
+
+			while (1) {
+				// A command that is already waiting was sent while
+				// the previous response was being sent.
+				struct pollfd pfd;
+				pfd.fd = fd;
+				pfd.events = POLLIN;
+				bool waiting = (1 == poll(&pfd, 1, 0));
+
+				if (! _read(&cmd, 1))
+					break;
+
+				cmd_time = waiting ? busy_until - latency : _now();
+
+				counts[(unsigned char) cmd]++;
+
+				if ('A' == cmd) {
+					_frame(buf);
+					_send(buf, MSQSIM_FRAME_BYTES, 1);
+				} else if ('Q' == cmd) {
+					memset(buf, 0, 20);
+					strncpy(buf, "MS2Extra sim 3.1.1", 20);
+					_send(buf, 20, 1);
+				} else if ('S' == cmd) {
+					memset(buf, 0, 60);
+					strncpy(buf, "MS2Extra Serial310 sim", 60);
+					_send(buf, 60, 1);
+				} else if ('b' == cmd) {
+					if (! _read(hdr, 2))
+						break;
+					_send(buf, 0, 3);
+				} else if ('r' == cmd || 'w' == cmd || 'k' == cmd) {
+					// can-id, tbl_idx, offset, num_bytes
+					if (! _read(hdr, 6))
+						break;
+
+					int tbl_idx = (unsigned char) hdr[1];
+					int offset = ((unsigned char) hdr[2] << 8) | (unsigned char) hdr[3];
+					int n = ((unsigned char) hdr[4] << 8) | (unsigned char) hdr[5];
+
+					vector<char>& page = _page(tbl_idx);
+					bool valid = offset + n <= MSQSIM_PAGE_BYTES;
+
+					if ('r' == cmd) {
+						if (valid)
+							_send(&page[offset], n, 7);
+					} else if ('w' == cmd) {
+						if (n > MSQSIM_PAGE_BYTES || ! _read(buf, n))
+							break;
+						if (valid)
+							memcpy(&page[offset], buf, n);
+						_send(buf, 0, 7 + n);
+					} else {
+						uint32_t crc = crc32(&page[0], page.size());
+						for (int i = 0; i < 4; i++)
+							buf[i] = (char) ((crc >> (24 - 8 * i)) & 255);
+						_send(buf, 4, 7);
+					}
+				}
+				// anything else is ignored, as the ecu does
+			}
+		}
+
+		static void* _run(void* arg) {
+			((MSQSimEcu*) arg)->_serve();
+			return NULL;
+		}
+		// }}}
+
+	public:
+
+		// {{{ MSQSimEcu()
+		/**
+		 * Create a new simulated ecu with no latency at 115200 baud.
+		 */
+		MSQSimEcu() {
+			fd = -1;
+			running = false;
+			latency = 0;
+			baud = 115200;
+			num_frames = 0;
+			cmd_time = 0;
+			busy_until = 0;
+			memset((void*) counts, 0, sizeof(counts));
+		}
+		// }}}
+
+		// {{{ ~MSQSimEcu
+		/**
+		 * The other end of the descriptor must be closed first
+		 * so that the thread stops.
+		 */
+		~MSQSimEcu() {
+			stop();
+		}
+		// }}}
+
+		// {{{ setLatency(), setBaud()
+		/**
+		 * Set the micro seconds added before each response,
+		 * such as the latency of a USB serial adapter.
+		 */
+		void setLatency(const long usec) {
+			latency = usec;
+		}
+
+		/**
+		 * Set the baud rate of the emulated link, 0 sends
+		 * responses without any wire time.
+		 */
+		void setBaud(const int rate) {
+			baud = rate;
+		}
+		// }}}
+
+		// {{{ start()
+		/**
+		 * Start answering commands on a blocking descriptor.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		bool start(const int _fd) {
+			fd = _fd;
+
+			if (0 != pthread_create(&thread, NULL, _run, this)) {
+				cerr << "unable to start the simulated ecu\n";
+				return true;  // error
+			}
+			running = true;
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ stop()
+		/**
+		 * Wait for the thread to stop, the other end of the
+		 * descriptor must be closed first.
+		 */
+		void stop() {
+			if (running) {
+				pthread_join(thread, NULL);
+				running = false;
+			}
+		}
+		// }}}
+
+		// {{{ commands()
+		/**
+		 * Number of commands of a type ('A', 'r', ...) received.
+		 */
+		unsigned long commands(const char cmd) {
+			return counts[(unsigned char) cmd];
+		}
+		// }}}
+};
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <stdint.h>
+
+using namespace std;
+
+// sub buckets per power of two, must be a power of two
+#define MSQSTATS_SUB 4
+#define MSQSTATS_SUB_BITS 2
+// values up to 2^MSQSTATS_POW
+#define MSQSTATS_POW 32
+#define MSQSTATS_BUCKETS (MSQSTATS_POW * MSQSTATS_SUB)
+
+/**
+ * A histogram of latencies (or any other positive values).
+ *
+ * Each power of two is split in to MSQSTATS_SUB buckets so a
+ * percentile is accurate to within 25% of its value, while
+ * record() is only a few instructions and never allocates.
+ */
+class MSQHistogram {
+	private:
+		uint64_t buckets[MSQSTATS_BUCKETS];
+		uint64_t num;
+		uint64_t sum;
+		uint64_t max_val;
+
+		// {{{ _bucket(), _upper()
+		static unsigned int _bucket(uint64_t v) {
+			if (v < MSQSTATS_SUB)
+				return v;
+
+			unsigned int pow = 0;
+			for (uint64_t t = v; t > 1; t >>= 1)
+				pow++;
+
+			unsigned int sub = (v >> (pow - MSQSTATS_SUB_BITS)) & (MSQSTATS_SUB - 1);
+			unsigned int i = (pow - MSQSTATS_SUB_BITS + 1) * MSQSTATS_SUB + sub;
+
+			return (i < MSQSTATS_BUCKETS) ? i : MSQSTATS_BUCKETS - 1;
+		}
+
+		/*
+		 * Largest value that is counted in a bucket.
+		 */
+		static uint64_t _upper(unsigned int i) {
+			if (i < MSQSTATS_SUB)
+				return i;
+
+			unsigned int pow = i / MSQSTATS_SUB + MSQSTATS_SUB_BITS - 1;
+			uint64_t sub = i % MSQSTATS_SUB;
+
+			return ((MSQSTATS_SUB + sub + 1) << (pow - MSQSTATS_SUB_BITS)) - 1;
+		}
+		// }}}
+
+	public:
+
+		// {{{ MSQHistogram()
+		MSQHistogram() {
+			clear();
+		}
+		// }}}
+
+		// {{{ clear()
+		void clear() {
+			memset(buckets, 0, sizeof(buckets));
+			num = 0;
+			sum = 0;
+			max_val = 0;
+		}
+		// }}}
+
+		// {{{ record()
+		/**
+		 * Count one value.
+		 */
+		void record(const uint64_t v) {
+			buckets[_bucket(v)]++;
+			num++;
+			sum += v;
+			if (v > max_val)
+				max_val = v;
+		}
+		// }}}
+
+		// {{{ count(), mean(), max(), percentile()
+		uint64_t count() const {
+			return num;
+		}
+
+		double mean() const {
+			return (num > 0) ? (double) sum / num : 0;
+		}
+
+		uint64_t max() const {
+			return max_val;
+		}
+
+		/**
+		 * The value below which a percentage of the values fall.
+		 *
+		 * @arg percentage, such as 50 or 99.9
+		 *
+		 * @returns the upper bound of the bucket, 0 if empty
+		 */
+		uint64_t percentile(const double pct) const {
+			if (0 == num)
+				return 0;
+
+			uint64_t want = (uint64_t) (num * pct / 100.0 + 0.5);
+			if (want < 1)
+				want = 1;
+
+			uint64_t n = 0;
+			for (unsigned int i = 0; i < MSQSTATS_BUCKETS; i++) {
+				n += buckets[i];
+				if (n >= want)
+					return (_upper(i) < max_val) ? _upper(i) : max_val;
+			}
+
+			return max_val;
+		}
+		// }}}
+
+		// {{{ summary()
+		/**
+		 * One line summary of the values, such as
+		 * "n=12 mean=10.5 p50=10 p90=14 p99=15 max=15".
+		 */
+		string summary() const {
+			char buf[200];
+
+			snprintf(buf, sizeof(buf),
+					"n=%lu mean=%.1f p50=%lu p90=%lu p99=%lu max=%lu",
+					(unsigned long) num, mean(),
+					(unsigned long) percentile(50),
+					(unsigned long) percentile(90),
+					(unsigned long) percentile(99),
+					(unsigned long) max_val);
+
+			return buf;
+		}
+		// }}}
+};
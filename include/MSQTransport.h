@@ -0,0 +1,453 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "MSQSimEcu.h"
+
+using namespace std;
+
+// {{{ msq_speed()
+/**
+ * The termios speed of a baud rate.
+ *
+ * @returns speed, B0 if the rate is not supported
+ */
+inline speed_t msq_speed(const int rate) {
+	switch (rate) {
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 921600: return B921600;
+		case 1000000: return B1000000;
+		case 2000000: return B2000000;
+	}
+
+	return B0;
+}
+// }}}
+
+/**
+ * The connection to an ecu used by MSQSerial.
+ *
+ * A transport provides a non-blocking file descriptor that
+ * MSQSerial reads, writes and polls; only opening it, setting the
+ * baud rate and flushing differ between transports.
+ *
+ * See msq_transport() to create one from a device name.
+ */
+class MSQTransport {
+	public:
+		virtual ~MSQTransport() {}
+
+		/**
+		 * Open the transport.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		virtual bool open() = 0;
+
+		/**
+		 * Set the baud rate of the link.
+		 *
+		 * @returns true on error, false otherwise
+		 */
+		virtual bool setBaud(const int rate) = 0;
+
+		/**
+		 * Discard any data not yet read or sent.
+		 */
+		virtual void flush() = 0;
+
+		/**
+		 * @returns non-blocking descriptor to read and write, -1 if not open
+		 */
+		virtual int fd() = 0;
+
+		/**
+		 * @returns a description such as the device name
+		 */
+		virtual string name() = 0;
+};
+
+// {{{ MSQTtyTransport
+/**
+ * A serial device, such as /dev/ttyUSB0.
+ */
+class MSQTtyTransport : public MSQTransport {
+	private:
+		string dev_file;
+		int devfd;
+
+		// {{{ _udelay()
+		void _udelay(const long usec) {
+			struct timespec ts;
+
+			ts.tv_sec = usec / 1000000;
+			ts.tv_nsec = (usec % 1000000) * 1000;
+
+			while (-1 == nanosleep(&ts, &ts) && EINTR == errno) {}
+		}
+		// }}}
+
+	public:
+		MSQTtyTransport(const string _dev_file) {
+			dev_file = _dev_file;
+			devfd = -1;
+		}
+
+		~MSQTtyTransport() {
+			if (devfd > -1)
+				close(devfd);
+		}
+
+		// {{{ open()
+		bool open() {
+			if (devfd > -1)
+				close(devfd);
+
+			devfd = ::open(dev_file.c_str(), O_RDWR | O_NOCTTY | O_NDELAY);
+			if (devfd == -1) {
+				char buf[1000];
+
+				snprintf(buf, sizeof(buf), "Unable to open device '%s'", dev_file.c_str());
+				perror(buf);
+
+				return true;  // error
+			}
+
+			// reads wait in poll(), see MSQSerial::sread()
+			fcntl(devfd, F_SETFL, O_NONBLOCK);
+
+			return false;  // OK
+		}
+		// }}}
+
+		// {{{ setBaud()
+		/**
+		 * Configure the device for 8N1 raw data at a baud rate.
+		 *
+		 * Some USB serial adapters do not take the new settings
+		 * right away so they are verified and retried, waiting
+		 * a little longer each time.
+		 */
+		bool setBaud(const int rate) {
+			struct termios options;
+			speed_t speed = msq_speed(rate);
+
+			// get current options
+			tcgetattr(devfd, &options);
+
+			// flush both
+			tcflush(devfd, TCIOFLUSH);
+
+			//cfsetispeed(&options, 0);  // 0 -> same as ospeed
+			cfsetispeed(&options, speed);
+			cfsetospeed(&options, speed);
+
+			// Control options (c_cflag)
+			options.c_cflag &= ~( PARENB | CSTOPB | CSIZE );
+			options.c_cflag |= CLOCAL | CREAD;
+			// No parity (8N1)
+			options.c_cflag &= ~PARENB;
+			options.c_cflag &= ~CSTOPB;
+			options.c_cflag &= ~CSIZE;
+			options.c_cflag |= CS8;
+
+			// Line options (clflag)
+			options.c_lflag = ~(ICANON | ECHO | ECHOE | ECHONL | IEXTEN | ISIG);
+
+			// Input options (c_iflag)
+			// disable software flow control
+			options.c_iflag &= ~(IXON | IXOFF | IXANY);
+
+			// Output options (c_oflag)
+			options.c_oflag &= ~OPOST;
+
+			// Control characters
+			options.c_cc[VQUIT]    = 0;     /* Ctrl-\ */
+			options.c_cc[VERASE]   = 0;     /* del */
+			options.c_cc[VKILL]    = 0;     /* @ */
+			options.c_cc[VEOF]     = 0;     /* Ctrl-d */
+			options.c_cc[VEOL]     = 0;     /* '\0' */
+			options.c_cc[VMIN]     = 0;
+			options.c_cc[VTIME]    = 0;     /* time outs are done by sread() */
+
+			// write, verify, retry if needed
+			int i = 0;
+			long backoff = 10000;  // us, doubled after each failure
+			struct termios voptions;
+			for (i = 0; i < 5; i++) {
+				if (i > 0) {
+					_udelay(backoff);
+					backoff *= 2;
+				}
+
+				if (-1 == tcsetattr(devfd, TCSANOW, &options)) {
+					perror("tcsetattr failed");
+					continue;  // retry
+				}
+
+				tcgetattr(devfd, &voptions);
+
+				if (speed != cfgetispeed(&voptions)) {
+					cerr << "cfsetispeed failed\n";
+					continue;  // retry
+				}
+
+				if (speed != cfgetospeed(&voptions)) {
+					cerr << "cfsetospeed failed\n";
+					continue;  // retry
+				}
+
+				break;  // success
+			}
+			if (i == 5) {
+				cerr << "failed to configure serial port for " << rate << " baud\n";
+				return true;  // error
+			}
+
+			return false;  // OK
+		}
+		// }}}
+
+		void flush() {
+			tcflush(devfd, TCIOFLUSH);
+		}
+
+		int fd() {
+			return devfd;
+		}
+
+		string name() {
+			return dev_file;
+		}
+};
+// }}}
+
+// {{{ MSQPtyTransport
+/**
+ * The master side of a new pseudo terminal pair.
+ *
+ * The slave side (see slaveName()) is left for another program,
+ * such as an ecu simulator, to open.
+ * A pty has no baud rate, so setBaud() does nothing.
+ */
+class MSQPtyTransport : public MSQTransport {
+	private:
+		int master;
+		string slave;
+
+	public:
+		MSQPtyTransport() {
+			master = -1;
+		}
+
+		~MSQPtyTransport() {
+			if (master > -1)
+				close(master);
+		}
+
+		// {{{ open()
+		bool open() {
+			master = posix_openpt(O_RDWR | O_NOCTTY);
+			if (-1 == master || -1 == grantpt(master) || -1 == unlockpt(master)) {
+				perror("unable to create pty");
+				return true;  // error
+			}
+
+			slave = ptsname(master);
+
+			// raw, so that no bytes are changed
+			struct termios options;
+			tcgetattr(master, &options);
+			cfmakeraw(&options);
+			tcsetattr(master, TCSANOW, &options);
+
+			fcntl(master, F_SETFL, O_NONBLOCK);
+
+			return false;  // OK
+		}
+		// }}}
+
+		bool setBaud(const int rate) {
+			return false;  // OK
+		}
+
+		void flush() {
+			tcflush(master, TCIOFLUSH);
+		}
+
+		int fd() {
+			return master;
+		}
+
+		string name() {
+			return "pty " + slave;
+		}
+
+		/**
+		 * @returns the device for the other program to open
+		 */
+		string slaveName() {
+			return slave;
+		}
+};
+// }}}
+
+// {{{ MSQSimTransport
+/**
+ * A simulated ecu (MSQSimEcu) in the same process, connected
+ * by a socket pair.
+ *
+ * Unless a fixed rate was given (see MSQSimEcu::setBaud()) the
+ * emulated link follows the baud rate set by MSQSerial.
+ */
+class MSQSimTransport : public MSQTransport {
+	private:
+		int sv[2];
+		MSQSimEcu sim;
+		bool fixed_baud;
+
+	public:
+		MSQSimTransport() {
+			sv[0] = -1;
+			sv[1] = -1;
+			fixed_baud = false;
+		}
+
+		~MSQSimTransport() {
+			// closing our end stops the simulator
+			if (sv[0] > -1)
+				close(sv[0]);
+			sim.stop();
+			if (sv[1] > -1)
+				close(sv[1]);
+		}
+
+		// {{{ open()
+		bool open() {
+			if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+				perror("unable to create simulated ecu socket");
+				return true;  // error
+			}
+
+			fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+			return sim.start(sv[1]);
+		}
+		// }}}
+
+		bool setBaud(const int rate) {
+			if (! fixed_baud)
+				sim.setBaud(rate);
+
+			return false;  // OK
+		}
+
+		void flush() {
+			char buf[256];
+			while (read(sv[0], buf, sizeof(buf)) > 0) {}
+		}
+
+		int fd() {
+			return sv[0];
+		}
+
+		string name() {
+			return "simulated ecu";
+		}
+
+		/**
+		 * @returns the simulator, to configure it before open()
+		 */
+		MSQSimEcu& ecu() {
+			return sim;
+		}
+
+		/**
+		 * Emulate a fixed baud rate whatever MSQSerial sets,
+		 * 0 for no wire time.
+		 */
+		void setFixedBaud(const int rate) {
+			fixed_baud = true;
+			sim.setBaud(rate);
+		}
+};
+// }}}
+
+// {{{ msq_transport()
+/**
+ * Create a transport from a device name.
+ *
+ *   /dev/ttyUSB0                    a serial device
+ *   pty                             a new pseudo terminal pair
+ *   sim[:latency=<us>,baud=<rate>]  a simulated ecu
+ *
+ * The simulator adds <us> micro seconds before each response and
+ * emulates a link of <rate> baud (0 for none), by default the
+ * rate that is set by MSQSerial.
+ *
+ * @returns new transport, NULL on error
+ */
+inline MSQTransport* msq_transport(const string& dev) {
+	if ("pty" == dev)
+		return new MSQPtyTransport();
+
+	if (dev != "sim" && dev.compare(0, 4, "sim:") != 0)
+		return new MSQTtyTransport(dev);
+
+	MSQSimTransport* t = new MSQSimTransport();
+
+	stringstream opts((dev.size() > 4) ? dev.substr(4) : "");
+	string opt;
+	while (getline(opts, opt, ',')) {
+		size_t eq = opt.find('=');
+		string key = opt.substr(0, eq);
+		long val = (eq != string::npos) ? atol(opt.substr(eq + 1).c_str()) : -1;
+
+		if ("latency" == key && val >= 0) {
+			t->ecu().setLatency(val);
+		} else if ("baud" == key && val >= 0) {
+			t->setFixedBaud(val);
+		} else {
+			cerr << "invalid simulated ecu option '" << opt << "'\n";
+			delete t;
+			return NULL;
+		}
+	}
+
+	return t;
+}
+// }}}
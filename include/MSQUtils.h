@@ -17,59 +17,380 @@
 
 #pragma once
 
+#include <cmath>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 using std::string;
+using std::vector;
 
-float bufToValue(string type, float add, float mult, char* buf) {
+// {{{ MSQType
+/**
+ * Integer data types used by the ecu, named as in the ini.
+ * All are stored big endian.
+ */
+enum MSQType {
+	MSQ_U08,
+	MSQ_S08,
+	MSQ_U16,
+	MSQ_S16,
+	MSQ_U32,
+	MSQ_S32,
+	MSQ_BAD_TYPE
+};
+
+/**
+ * Convert a type name ("U08", "S16", ...) to its MSQType.
+ *
+ * @returns the type, or MSQ_BAD_TYPE if it is unknown
+ */
+inline MSQType strToType(const string& type) {
+	if ("U08" == type)
+		return MSQ_U08;
+	else if ("S08" == type)
+		return MSQ_S08;
+	else if ("U16" == type)
+		return MSQ_U16;
+	else if ("S16" == type)
+		return MSQ_S16;
+	else if ("U32" == type)
+		return MSQ_U32;
+	else if ("S32" == type)
+		return MSQ_S32;
+
+	return MSQ_BAD_TYPE;
+}
+
+/**
+ * @returns the number of bytes used by a type, 0 if it is unknown
+ */
+inline int typeBytes(const MSQType type) {
+	switch (type) {
+		case MSQ_U08:
+		case MSQ_S08:
+			return 1;
+		case MSQ_U16:
+		case MSQ_S16:
+			return 2;
+		case MSQ_U32:
+		case MSQ_S32:
+			return 4;
+		default:
+			return 0;
+	}
+}
+// }}}
+
+// {{{ decodeRaw<>(), decoderFor()
+/**
+ * Decode the raw integer of a given type stored at buf.
+ *
+ * A separate function is generated for each type so that the
+ * type only has to be resolved once (see decoderFor()) instead
+ * of on every value.
+ */
+template <MSQType TYPE>
+inline double decodeRaw(const char* buf);
+
+template <>
+inline double decodeRaw<MSQ_U08>(const char* buf) {
+	return (unsigned char) buf[0];
+}
+
+template <>
+inline double decodeRaw<MSQ_S08>(const char* buf) {
+	return (signed char) buf[0];
+}
+
+template <>
+inline double decodeRaw<MSQ_U16>(const char* buf) {
+	unsigned short s;
+	s = (unsigned char) buf[0];
+	s = (s << 8) | (unsigned char) buf[1];
+	return s;
+}
+
+template <>
+inline double decodeRaw<MSQ_S16>(const char* buf) {
+	unsigned short s;
+	s = (unsigned char) buf[0];
+	s = (s << 8) | (unsigned char) buf[1];
+	return (short) s;
+}
+
+template <>
+inline double decodeRaw<MSQ_U32>(const char* buf) {
+	unsigned int s;
+	s = (unsigned char) buf[0];
+	s = (s << 8) | (unsigned char) buf[1];
+	s = (s << 8) | (unsigned char) buf[2];
+	s = (s << 8) | (unsigned char) buf[3];
+	return s;
+}
+
+template <>
+inline double decodeRaw<MSQ_S32>(const char* buf) {
+	unsigned int s;
+	s = (unsigned char) buf[0];
+	s = (s << 8) | (unsigned char) buf[1];
+	s = (s << 8) | (unsigned char) buf[2];
+	s = (s << 8) | (unsigned char) buf[3];
+	return (int) s;
+}
+
+template <>
+inline double decodeRaw<MSQ_BAD_TYPE>(const char* buf) {
+	return 0;
+}
+
+typedef double (*MSQDecodeFn)(const char* buf);
+
+/**
+ * Get the decode function for a type.
+ *
+ * An unknown type gets a function which always returns 0,
+ * so the result never has to be checked for NULL.
+ */
+inline MSQDecodeFn decoderFor(const MSQType type) {
+	switch (type) {
+		case MSQ_U08:
+			return &decodeRaw<MSQ_U08>;
+		case MSQ_S08:
+			return &decodeRaw<MSQ_S08>;
+		case MSQ_U16:
+			return &decodeRaw<MSQ_U16>;
+		case MSQ_S16:
+			return &decodeRaw<MSQ_S16>;
+		case MSQ_U32:
+			return &decodeRaw<MSQ_U32>;
+		case MSQ_S32:
+			return &decodeRaw<MSQ_S32>;
+		default:
+			return &decodeRaw<MSQ_BAD_TYPE>;
+	}
+}
+// }}}
+
+// {{{ encodeRaw<>(), encoderFor()
+/*
+ * Store a value as a big endian integer of a number of bytes,
+ * rounded to the nearest integer and limited to the range.
+ */
+inline void msq_put(double v, const double min, const double max,
+						const int bytes, char* buf)
+{
+	if (v < min)
+		v = min;
+	else if (v > max)
+		v = max;
+
+	int64_t r = (int64_t) floor(v + 0.5);
+
+	for (int i = 0; i < bytes; i++)
+		buf[i] = (char) ((r >> (8 * (bytes - 1 - i))) & 0xFF);
+}
+
+/**
+ * Encode a value as the raw integer of a given type at buf,
+ * the reverse of decodeRaw<>().
+ *
+ * The value is rounded, and values beyond the range of the
+ * type are limited to it rather than wrapping around.
+ */
+template <MSQType TYPE>
+inline void encodeRaw(const double v, char* buf);
 
-	double v;
-
-	if ("U16" == type) {
-		unsigned short s;
-		s = *buf & 0xFF;
-		s = (s << 8);
-		s = (*(buf + 1) & 0xFF) | s;
-		v = s;
-	} else if ("S16" == type) {
-		short s;
-		s = *buf & 0xFF;
-		s = (s << 8);
-		s = (*(buf + 1) & 0xFF) | s;
-		v = s;
-	} else if ("U08") {
-		unsigned char c;
-		c = *buf & 0xFF;
-		v = c;
-	} else if ("S08") {
-		char c;
-		c = *buf & 0xFF;
-		v = c;
-	} else if ("U32") {
-		unsigned int s;
-		s = *buf & 0xFF;
-		s = (s << 8);
-		s |= *(buf + 1) & 0xFF;
-		s = (s << 8);
-		s |= *(buf + 2) & 0xFF;
-		s = (s << 8);
-		s |= *(buf + 3) & 0xFF;
-		v = s;
-	} else if ("S32") {
-		int s;
-		s = *buf & 0xFF;
-		s = (s << 8);
-		s |= *(buf + 1) & 0xFF;
-		s = (s << 8);
-		s |= *(buf + 2) & 0xFF;
-		s = (s << 8);
-		s |= *(buf + 3) & 0xFF;
-		v = s;
+template <>
+inline void encodeRaw<MSQ_U08>(const double v, char* buf) {
+	msq_put(v, 0, 255, 1, buf);
+}
+
+template <>
+inline void encodeRaw<MSQ_S08>(const double v, char* buf) {
+	msq_put(v, -128, 127, 1, buf);
+}
+
+template <>
+inline void encodeRaw<MSQ_U16>(const double v, char* buf) {
+	msq_put(v, 0, 65535, 2, buf);
+}
+
+template <>
+inline void encodeRaw<MSQ_S16>(const double v, char* buf) {
+	msq_put(v, -32768, 32767, 2, buf);
+}
+
+template <>
+inline void encodeRaw<MSQ_U32>(const double v, char* buf) {
+	msq_put(v, 0, 4294967295.0, 4, buf);
+}
+
+template <>
+inline void encodeRaw<MSQ_S32>(const double v, char* buf) {
+	msq_put(v, -2147483648.0, 2147483647.0, 4, buf);
+}
+
+template <>
+inline void encodeRaw<MSQ_BAD_TYPE>(const double v, char* buf) {
+}
+
+typedef void (*MSQEncodeFn)(const double v, char* buf);
+
+/**
+ * Get the encode function for a type.
+ *
+ * An unknown type gets a function which stores nothing,
+ * check typeBytes() for 0 first.
+ */
+inline MSQEncodeFn encoderFor(const MSQType type) {
+	switch (type) {
+		case MSQ_U08:
+			return &encodeRaw<MSQ_U08>;
+		case MSQ_S08:
+			return &encodeRaw<MSQ_S08>;
+		case MSQ_U16:
+			return &encodeRaw<MSQ_U16>;
+		case MSQ_S16:
+			return &encodeRaw<MSQ_S16>;
+		case MSQ_U32:
+			return &encodeRaw<MSQ_U32>;
+		case MSQ_S32:
+			return &encodeRaw<MSQ_S32>;
+		default:
+			return &encodeRaw<MSQ_BAD_TYPE>;
 	}
+}
+// }}}
+
+// {{{ bufToValue()
+/**
+ * Decode and translate a value.
+ *
+ * The type is resolved on every call, where speed matters
+ * resolve it once with decoderFor() instead.
+ */
+float bufToValue(string type, float add, float mult, char* buf) {
+
+	double v = decoderFor(strToType(type))(buf);
 
 	v += add;
 	v *= mult;
 
 	return v;
 }
+// }}}
+
+// {{{ crc32()
+/*
+ * Table of the CRC32 of each byte (reflected polynomial 0xEDB88320).
+ * It is a constant rather than built on first use since crc32()
+ * is called from several threads.
+ */
+static const uint32_t msq_crc32_table[256] = {
+	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+	0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+	0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+	0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+	0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+	0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+	0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+	0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+	0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+	0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+	0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+	0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+	0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+	0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+	0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+	0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+	0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+	0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+	0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+	0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+	0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+	0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+	0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+	0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+	0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+	0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+	0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+	0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+	0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+	0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+	0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+	0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+	0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+	0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+	0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+	0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+	0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+	0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+	0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+	0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+	0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+	0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+	0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+/**
+ * Compute the CRC32 of a buffer, the same as is returned by the
+ * ecu for a page (crc32CheckCommand in the ini).
+ *
+ * This is the common (zlib, ethernet) CRC32.
+ *
+ * @arg buffer
+ * @arg number of bytes
+ * @arg crc of any preceding data, to compute it in pieces
+ *
+ * @returns the crc
+ */
+inline uint32_t crc32(const char* buf, const unsigned int len,
+						const uint32_t prev = 0)
+{
+	uint32_t crc = prev ^ 0xFFFFFFFF;
+	for (unsigned int i = 0; i < len; i++)
+		crc = msq_crc32_table[(crc ^ (unsigned char) buf[i]) & 0xFF] ^ (crc >> 8);
+
+	return crc ^ 0xFFFFFFFF;
+}
+// }}}
 
+// {{{ msq_axis()
+/**
+ * Find the two bins of a table axis around a value, as the ecu
+ * does to interpolate.
+ *
+ * @arg bins, in ascending or descending order
+ * @arg value
+ * @arg index of the first bin, the second is i + 1
+ * @arg fraction of the way from the first to the second
+ *
+ * Values outside of the axis go to the nearest bin.
+ */
+inline void msq_axis(const vector<float>& bins, const float v,
+						int& i, float& f)
+{
+	int n = bins.size();
+
+	i = 0;
+	f = 0;
+	if (n < 2)
+		return;
+
+	bool up = bins[n - 1] >= bins[0];
+
+	for (i = 0; i < n - 2; i++) {
+		if (up ? (v < bins[i + 1]) : (v > bins[i + 1]))
+			break;
+	}
+
+	float span = bins[i + 1] - bins[i];
+	f = (0 == span) ? 0 : (v - bins[i]) / span;
+
+	if (f < 0)
+		f = 0;
+	else if (f > 1)
+		f = 1;
+}
+// }}}
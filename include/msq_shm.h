@@ -0,0 +1,471 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * msq_shm - live feed of decoded real time data in shared memory.
+ *
+ * msqdev (-m <name>) publishes each frame of real time data, as
+ * the decoded value of each channel, in to a ring in the POSIX
+ * shared memory object /<name> (/dev/shm/<name> on Linux).
+ * Any number of clients can read the ring without disturbing
+ * msqdev or each other, and msq_shm_wait() wakes them as soon as
+ * a frame is published, so there is no polling of a file.
+ *
+ * This header is plain C (it is also included by msqdev) so that
+ * clients in any language with a C interface can use it.
+ * Link with -lrt on older systems.
+ *
+ * A client:
+ *
+ *   struct msq_shm shm;
+ *   if (msq_shm_open(&shm, "rtdata"))
+ *       ... error
+ *
+ *   float* vals = malloc(msq_shm_num_channels(&shm) * sizeof(float));
+ *   uint64_t n = msq_shm_count(&shm);  // the next frame
+ *   while (0 == msq_shm_wait(&shm, n, 1000000)) {
+ *       if (n < msq_shm_first(&shm))
+ *           n = msq_shm_first(&shm);  // fell behind, frames were lost
+ *       if (0 == msq_shm_read(&shm, n, &tv, vals))
+ *           ... use the values
+ *       n++;
+ *   }
+ *   msq_shm_close(&shm);
+ *
+ * Each slot of the ring is protected by a sequence number
+ * (a seqlock): it is odd while the slot is written, so a reader
+ * which raced with the writer sees that the number changed and
+ * the read fails instead of returning a mix of two frames.
+ *
+ * All values are stored in the native byte order.
+ */
+
+#ifndef MSQ_SHM_H
+#define MSQ_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSQSHM_MAGIC "MSQSHM1"	/* 8 bytes, with the null */
+#define MSQSHM_VERSION 1
+#define MSQSHM_NAME_BYTES 32
+
+#define MSQSHM_FN static __inline__
+
+/* {{{ msq_shm_header, msq_shm_channel, msq_shm_slot */
+/**
+ * The object begins with a header, followed by the name of each
+ * channel, followed by the slots of the ring.
+ */
+struct msq_shm_header {
+	char magic[8];				/* MSQSHM_MAGIC, set last by the writer */
+	uint32_t version;
+	uint32_t header_size;		/* offset of the first slot */
+	uint32_t slot_size;			/* bytes per slot */
+	uint32_t capacity;			/* number of slots */
+	uint32_t num_channels;
+	volatile uint32_t wake;		/* futex, changed after each frame */
+	volatile uint64_t count;	/* total number of frames published */
+	volatile uint32_t closed;	/* set when the writer stops */
+	uint32_t reserved[7];
+};
+
+/**
+ * Name of one channel, such as "rpm", with a null.
+ */
+struct msq_shm_channel {
+	char name[MSQSHM_NAME_BYTES];
+};
+
+/**
+ * Each slot is a sequence number and a time stamp followed
+ * by the value of each channel.
+ */
+struct msq_shm_slot {
+	volatile uint64_t seq;		/* 2n + 1 while frame n is written, then 2n + 2 */
+	uint32_t tv_sec;
+	uint32_t tv_usec;
+	/* float values[num_channels]; */
+};
+/* }}} */
+
+/**
+ * An open ring, for the writer or for a reader.
+ */
+struct msq_shm {
+	char name[256];
+	int writer;
+	size_t size;
+	char* map;
+	struct msq_shm_header* hdr;
+};
+
+/* {{{ _msq_shm_slot(), _msq_shm_futex() */
+MSQSHM_FN struct msq_shm_slot* _msq_shm_slot(struct msq_shm* shm, const uint64_t n) {
+	return (struct msq_shm_slot*) (shm->map + shm->hdr->header_size
+						+ (n % shm->hdr->capacity) * shm->hdr->slot_size);
+}
+
+MSQSHM_FN long _msq_shm_futex(volatile uint32_t* addr, const int op,
+								const uint32_t val, const struct timespec* ts)
+{
+	return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+/* }}} */
+
+/* {{{ msq_shm_create() */
+/**
+ * Create a ring for writing, replacing any existing one.
+ *
+ * @arg ring
+ * @arg name of the shared memory object, without the '/'
+ * @arg number of frames in the ring
+ * @arg number of channels
+ * @arg name of each channel
+ *
+ * @returns 0 on success, -1 on error
+ */
+MSQSHM_FN int msq_shm_create(struct msq_shm* shm, const char* name,
+							const unsigned int capacity,
+							const unsigned int num_channels,
+							const char* const* names)
+{
+	unsigned int i;
+	int fd;
+	void* p;
+
+	memset(shm, 0, sizeof(*shm));
+	shm->writer = 1;
+	snprintf(shm->name, sizeof(shm->name), "/%s", name);
+
+	if (0 == capacity) {
+		fprintf(stderr, "shared memory ring capacity must be non-zero\n");
+		return -1;
+	}
+
+	uint32_t header_size = sizeof(struct msq_shm_header)
+						+ num_channels * sizeof(struct msq_shm_channel);
+	header_size = (header_size + 63) & ~63;
+
+	uint32_t slot_size = sizeof(struct msq_shm_slot) + num_channels * sizeof(float);
+	slot_size = (slot_size + 7) & ~7;
+
+	shm->size = header_size + (size_t) capacity * slot_size;
+
+	/* readers of a previous ring keep it until they reopen */
+	shm_unlink(shm->name);
+
+	fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (-1 == fd) {
+		perror("unable to create shared memory ring");
+		return -1;
+	}
+
+	if (-1 == ftruncate(fd, shm->size)) {
+		perror("unable to size shared memory ring");
+		close(fd);
+		shm_unlink(shm->name);
+		return -1;
+	}
+
+	p = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == p) {
+		perror("unable to map shared memory ring");
+		shm_unlink(shm->name);
+		return -1;
+	}
+
+	shm->map = (char*) p;
+	shm->hdr = (struct msq_shm_header*) p;
+
+	/* the new object is zeroed, so every slot starts out empty */
+	shm->hdr->version = MSQSHM_VERSION;
+	shm->hdr->header_size = header_size;
+	shm->hdr->slot_size = slot_size;
+	shm->hdr->capacity = capacity;
+	shm->hdr->num_channels = num_channels;
+
+	struct msq_shm_channel* chans = (struct msq_shm_channel*)
+									(shm->map + sizeof(struct msq_shm_header));
+	for (i = 0; i < num_channels; i++)
+		strncpy(chans[i].name, names[i], MSQSHM_NAME_BYTES - 1);
+
+	/* readers check the magic, so it must be written last */
+	__sync_synchronize();
+	memcpy(shm->hdr->magic, MSQSHM_MAGIC, sizeof(shm->hdr->magic));
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ msq_shm_publish() */
+/**
+ * Publish a frame, overwriting the oldest one if the ring is
+ * full, and wake the readers.
+ *
+ * @arg ring from msq_shm_create()
+ * @arg time the frame was received
+ * @arg value of each channel
+ */
+MSQSHM_FN void msq_shm_publish(struct msq_shm* shm, const struct timeval* tv,
+								const float* vals)
+{
+	uint64_t n = shm->hdr->count;
+	struct msq_shm_slot* slot = _msq_shm_slot(shm, n);
+
+	slot->seq = 2 * n + 1;
+	__sync_synchronize();
+
+	slot->tv_sec = tv->tv_sec;
+	slot->tv_usec = tv->tv_usec;
+	memcpy((char*) slot + sizeof(struct msq_shm_slot), vals,
+			shm->hdr->num_channels * sizeof(float));
+
+	__sync_synchronize();
+	slot->seq = 2 * n + 2;
+
+	__sync_synchronize();
+	shm->hdr->count = n + 1;
+	shm->hdr->wake = (uint32_t) (n + 1);
+
+	/* a system call, but only a few micro seconds per frame */
+	_msq_shm_futex(&shm->hdr->wake, FUTEX_WAKE, INT_MAX, NULL);
+}
+/* }}} */
+
+/* {{{ msq_shm_open() */
+/**
+ * Open an existing ring for reading.
+ *
+ * @arg ring
+ * @arg name of the shared memory object, without the '/'
+ *
+ * @returns 0 on success, -1 on error
+ */
+MSQSHM_FN int msq_shm_open(struct msq_shm* shm, const char* name) {
+	struct stat st;
+	int fd;
+	void* p;
+
+	memset(shm, 0, sizeof(*shm));
+	snprintf(shm->name, sizeof(shm->name), "/%s", name);
+
+	fd = shm_open(shm->name, O_RDONLY, 0);
+	if (-1 == fd) {
+		perror("unable to open shared memory ring");
+		return -1;
+	}
+
+	if (-1 == fstat(fd, &st) || (size_t) st.st_size < sizeof(struct msq_shm_header)) {
+		fprintf(stderr, "invalid shared memory ring '%s'\n", name);
+		close(fd);
+		return -1;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == p) {
+		perror("unable to map shared memory ring");
+		return -1;
+	}
+
+	shm->map = (char*) p;
+	shm->hdr = (struct msq_shm_header*) p;
+	shm->size = st.st_size;
+
+	if (0 != memcmp(shm->hdr->magic, MSQSHM_MAGIC, sizeof(shm->hdr->magic))
+			|| MSQSHM_VERSION != shm->hdr->version
+			|| 0 == shm->hdr->capacity
+			|| shm->size != shm->hdr->header_size
+							+ (size_t) shm->hdr->capacity * shm->hdr->slot_size)
+	{
+		fprintf(stderr, "invalid shared memory ring '%s'\n", name);
+		munmap(shm->map, shm->size);
+		shm->map = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ msq_shm_close() */
+/**
+ * Close a ring.
+ *
+ * When the writer closes it the readers are woken and the
+ * object is removed; readers keep it until they close it.
+ */
+MSQSHM_FN void msq_shm_close(struct msq_shm* shm) {
+	if (NULL == shm->map)
+		return;
+
+	if (shm->writer) {
+		shm->hdr->closed = 1;
+		__sync_synchronize();
+		shm->hdr->wake++;
+		_msq_shm_futex(&shm->hdr->wake, FUTEX_WAKE, INT_MAX, NULL);
+
+		shm_unlink(shm->name);
+	}
+
+	munmap(shm->map, shm->size);
+	shm->map = NULL;
+	shm->hdr = NULL;
+}
+/* }}} */
+
+/* {{{ msq_shm_count(), msq_shm_first() */
+/**
+ * Total number of frames published, the newest is count - 1.
+ */
+MSQSHM_FN uint64_t msq_shm_count(struct msq_shm* shm) {
+	return shm->hdr->count;
+}
+
+/**
+ * The oldest frame that can still be read.
+ *
+ * When the ring is full the slot written next is not included.
+ */
+MSQSHM_FN uint64_t msq_shm_first(struct msq_shm* shm) {
+	uint64_t n = shm->hdr->count;
+
+	return (n >= shm->hdr->capacity) ? (n - shm->hdr->capacity + 1) : 0;
+}
+/* }}} */
+
+/* {{{ msq_shm_num_channels(), msq_shm_channel() */
+MSQSHM_FN unsigned int msq_shm_num_channels(struct msq_shm* shm) {
+	return shm->hdr->num_channels;
+}
+
+/**
+ * @returns the name of channel i
+ */
+MSQSHM_FN const char* msq_shm_channel(struct msq_shm* shm, const unsigned int i) {
+	const struct msq_shm_channel* chans = (const struct msq_shm_channel*)
+									(shm->map + sizeof(struct msq_shm_header));
+
+	return chans[i].name;
+}
+/* }}} */
+
+/* {{{ msq_shm_read() */
+/**
+ * Read a frame.
+ *
+ * @arg ring
+ * @arg frame number, from msq_shm_first() to msq_shm_count() - 1
+ * @arg time stamp of the frame
+ * @arg buffer for msq_shm_num_channels() values
+ *
+ * @returns 0 on success, -1 if the frame has not been published
+ * yet or was overwritten
+ */
+MSQSHM_FN int msq_shm_read(struct msq_shm* shm, const uint64_t n,
+							struct timeval* tv, float* vals)
+{
+	if (n >= shm->hdr->count)
+		return -1;
+
+	struct msq_shm_slot* slot = _msq_shm_slot(shm, n);
+
+	uint64_t seq = slot->seq;
+	if (seq != 2 * n + 2)
+		return -1;  /* being written or overwritten */
+
+	__sync_synchronize();
+	tv->tv_sec = slot->tv_sec;
+	tv->tv_usec = slot->tv_usec;
+	memcpy(vals, (char*) slot + sizeof(struct msq_shm_slot),
+			shm->hdr->num_channels * sizeof(float));
+	__sync_synchronize();
+
+	if (slot->seq != seq)
+		return -1;  /* overwritten while copying */
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ msq_shm_wait() */
+/**
+ * Wait until frame n has been published.
+ *
+ * @arg ring
+ * @arg frame number
+ * @arg micro seconds to wait, at most
+ *
+ * @returns 0 if it is available, -1 on time out or if the
+ * writer closed the ring
+ */
+MSQSHM_FN int msq_shm_wait(struct msq_shm* shm, const uint64_t n, const long timeout_us) {
+	struct timespec now, end, ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += timeout_us / 1000000;
+	end.tv_nsec += (timeout_us % 1000000) * 1000;
+	if (end.tv_nsec >= 1000000000) {
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000;
+	}
+
+	while (1) {
+		uint32_t wake = shm->hdr->wake;
+		__sync_synchronize();
+
+		if (n < shm->hdr->count)
+			return 0;
+
+		if (shm->hdr->closed)
+			return -1;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ts.tv_sec = end.tv_sec - now.tv_sec;
+		ts.tv_nsec = end.tv_nsec - now.tv_nsec;
+		if (ts.tv_nsec < 0) {
+			ts.tv_sec--;
+			ts.tv_nsec += 1000000000;
+		}
+		if (ts.tv_sec < 0)
+			return -1;  /* timed out */
+
+		/* returns at once if a frame was published since reading wake */
+		if (-1 == _msq_shm_futex(&shm->hdr->wake, FUTEX_WAIT, wake, &ts)
+				&& EAGAIN != errno && EINTR != errno && ETIMEDOUT != errno)
+		{
+			perror("futex wait");
+			return -1;
+		}
+	}
+}
+/* }}} */
+
+#endif /* MSQ_SHM_H */
@@ -5,6 +5,7 @@ use warnings;
 use Carp;
 
 use IO::File;
+use IO::Uncompress::Gunzip qw($GunzipError);
 use Text::CSV;
 
 # DEVNOTE
@@ -44,6 +45,14 @@ the directory containing this package.
 # {{{ new()
 =head2 new()
 
+A file ending in '.gz' is compressed real time data (msqdev -z).
+It can only be read, and only from start to end; seek_last()
+and seek_time() are not supported.
+
+If msqdev wrote an index of the rows ('<file>.idx', see msqdev -ri)
+seek_last() and seek_time() use it instead of reading the whole
+file.
+
 =cut
 
 sub new {
@@ -60,8 +69,20 @@ sub new {
 		return;
 	}
 
+	my $gz = ($file =~ /\.gz$/);
+
 	my $fh = new IO::File;
-	if (-e $file) {
+	if ($gz) {
+		unless (-e $file) {
+			carp("cannot create compressed file '$file'");
+			return;
+		}
+
+		$fh = _open_gz($file) or return;
+
+		# read column names
+		$cols = $csv->getline($fh);
+	} elsif (-e $file) {
 		if (defined $cols) {
 			carp("cannot redefine columns when file already exists");
 			return;
@@ -96,12 +117,94 @@ sub new {
 
 	bless {
 		fh  => $fh,
+		file => $file,
+		gz => $gz,
 		csv => $csv,
 		columns => $cols,
 		columns_hr => \%cols_hr,
+		last => [],  # last value of each column (see getline())
+		index => undef,  # entries of the index (see _load_index())
+		index_at => {},  # base time of each indexed row, by offset
+		base => undef,   # base time of the current run (see time())
+		time => undef,   # time of the last row (see time())
 	}, $class;
 
 }
+
+sub _open_gz {
+	my $file = shift;
+
+	my $fh = IO::Uncompress::Gunzip->new($file, MultiStream => 1);
+	unless ($fh) {
+		carp("unable to open file '$file': $GunzipError");
+		return;
+	}
+
+	return $fh;
+}
+# }}}
+
+# {{{ _load_index()
+#
+# Read the index written by msqdev (MSQRTIndexEntry in
+# include/MSQRealTime.h), 24 bytes per entry in the native
+# byte order: offset of the row, time and base time of its run.
+#
+# Returns an array ref of [offset, time, base] entries, empty if
+# there is no usable index.
+#
+my $INDEX_ENTRY = 24;
+
+sub _load_index {
+	my $self = shift;
+
+	my @entries;
+	$self->{index} = \@entries;
+	$self->{index_at} = {};
+
+	return \@entries if ($self->{gz});
+
+	my $idx = new IO::File;
+	$idx->open("< $self->{file}.idx") or return \@entries;
+	binmode($idx);
+
+	local $/;
+	my $data = <$idx>;
+	$idx->close();
+
+	return \@entries unless (defined $data);
+
+	my $size = -s $self->{fh};
+	my $fh = $self->{fh};
+	my $n = int(length($data) / $INDEX_ENTRY);
+
+	for (my $i = 0; $i < $n; $i++) {
+		my ($offset, $time, $base) = unpack("Q d d",
+									substr($data, $i * $INDEX_ENTRY, $INDEX_ENTRY));
+
+		# the file was replaced, the index does not belong to it
+		if ($offset >= $size) {
+			@entries = ();
+			last;
+		}
+
+		push @entries, [$offset, $time, $base];
+	}
+
+	# a row must start at the last entry
+	if (@entries) {
+		my $c;
+		seek($fh, $entries[-1][0] - 1, 0);
+		read($fh, $c, 1);
+		@entries = () unless (defined $c and $c eq "\n");
+	}
+
+	for my $e (@entries) {
+		$self->{index_at}{$e->[0]} = $e->[2];
+	}
+
+	return \@entries;
+}
 # }}}
 
 # {{{ columns()
@@ -154,10 +257,19 @@ sub seek_start {
 	my $fh = $self->{fh};
 	my $csv = $self->{csv};
 
-	seek($fh, 0, 0);  # start of file
+	if ($self->{gz}) {
+		# can only seek forward, open it again
+		$fh->close();
+		$fh = $self->{fh} = _open_gz($self->{file}) or return;
+	} else {
+		seek($fh, 0, 0);  # start of file
+	}
 
 	$csv->getline($fh);  # skip the column names
 
+	$self->{last} = [];
+	$self->{base} = undef;
+
 	return 1;  # OK
 }
 # }}}
@@ -169,6 +281,11 @@ sub seek_start {
 Seek to the last row so that the next call to getline will return
 the last row of data.
 
+With an index only the rows after its last entry are read,
+otherwise the whole file is.
+Values of decimated channels (msqdev -rd) are carried forward
+from the rows before it, as getline() does.
+
 Returns: TRUE on success, FALSE on error
 
 =cut
@@ -179,20 +296,119 @@ sub seek_last {
 	my $fh = $self->{fh};
 	my $csv = $self->{csv};
 
-	seek($fh, 0, 0);  # start of file
+	if ($self->{gz}) {
+		carp("seek_last() is not supported on compressed files");
+		return;
+	}
+
+	my $index = $self->_load_index();
 
-	# find the last position
-	my @pos;
-	while ($csv->getline($fh)) {
-		push @pos, tell($fh);
+	my $start = 0;
+	if (@$index) {
+		$start = $index->[-1][0];
+		$self->{base} = $index->[-1][2];
+	} else {
+		$self->{base} = undef;
 	}
 
-	seek($fh, $pos[-2], 0);
+	seek($fh, $start, 0);
+	$csv->getline($fh) if (0 == $start);  # skip the column names
+
+	# msqdev writes every value in an indexed row
+	$self->{last} = [];
+
+	# find the start of the last row, and the values before it
+	my $pos = tell($fh);
+	my $last_pos;
+	my $last_vals;
+	while (1) {
+		my @before = @{$self->{last}};
+		$self->getline() or last;
+
+		$last_pos = $pos;
+		$last_vals = \@before;
+		$pos = tell($fh);
+	}
+
+	return unless (defined $last_pos);  # no rows
+
+	seek($fh, $last_pos, 0);
+
+	$self->{last} = $last_vals;
 
 	return 1;  # OK
 }
 # }}}
 
+# {{{ seek_time()
+
+=head2 seek_time()
+
+Seek to the first row received at or after a time, in seconds
+since the epoch, so that the next call to getline will return it.
+
+  # the rows from t0 to t1
+  $rtdata->seek_time($t0);
+  while (my $row = $rtdata->getline()) {
+	last if ($rtdata->time() > $t1);
+	...
+  }
+
+This requires the index (msqdev -ri), it is searched and at most
+the rows between two entries are read.
+A time before the first entry seeks to the first indexed row.
+
+Returns: TRUE on success, FALSE on error or if there is no such row
+
+=cut
+
+sub seek_time {
+	my $self = shift;
+	my $t = shift;
+
+	my $fh = $self->{fh};
+	my $csv = $self->{csv};
+
+	my $index = $self->_load_index();
+	unless (@$index) {
+		carp("seek_time() requires the index '$self->{file}.idx'");
+		return;
+	}
+
+	# last entry at or before the time
+	my ($lo, $hi) = (0, scalar(@$index) - 1);
+	while ($lo < $hi) {
+		my $mid = int(($lo + $hi + 1) / 2);
+		if ($index->[$mid][1] <= $t) {
+			$lo = $mid;
+		} else {
+			$hi = $mid - 1;
+		}
+	}
+
+	seek($fh, $index->[$lo][0], 0);
+	$self->{base} = $index->[$lo][2];
+
+	# msqdev writes every value in an indexed row
+	$self->{last} = [];
+
+	# then forward to the row, keeping the values before it
+	while (1) {
+		my $pos = tell($fh);
+		my @before = @{$self->{last}};
+
+		my $row = $self->getline() or return;
+
+		if ($self->time() >= $t) {
+			seek($fh, $pos, 0);
+			$self->{last} = \@before;
+
+			return 1;  # OK
+		}
+	}
+}
+# }}}
+
 # {{{ seek_end()
 
 =head2 seek_end()
@@ -210,7 +426,19 @@ sub seek_end {
 
 	my $fh = $self->{fh};
 
-	seek($fh, 0, 2);  # end of file
+	if ($self->{gz}) {
+		# read through the remaining data
+		while (defined $fh->getline()) { }
+	} else {
+		seek($fh, 0, 2);  # end of file
+	}
+
+	# new rows belong to the run of the last indexed row
+	my $index = $self->_load_index();
+	$self->{base} = (@$index) ? $index->[-1][2] : undef;
+	seek($fh, 0, 2) unless ($self->{gz});
+
+	$self->{last} = [];
 
 	return 1;  # OK
 }
@@ -227,6 +455,11 @@ Returns: TRUE on success, FALSE on error or EOF
 To determine if an error occured or the end of file was reached
 use eof().
 
+msqdev leaves a value empty when a channel is decimated (-rd) and
+was not logged for that row.  Empty values are filled in with the
+last value read for that column, or left undefined if there has
+been none since the last seek.
+
 =cut
 
 sub getline {
@@ -235,19 +468,60 @@ sub getline {
 	my $csv = $self->{csv};
 	my $fh = $self->{fh};
 
+	# the first row of each run is indexed, with the base time
+	my $index_at = $self->{index_at};
+	if (%$index_at) {
+		my $pos = tell($fh);
+		$self->{base} = $index_at->{$pos} if (exists $index_at->{$pos});
+	}
+
 	my $res = $csv->getline($fh);
 	if (! $res) {
 		if ($csv->eof()) {
-			seek($fh, 0, 1);  # reset eof
+			seek($fh, 0, 1) unless ($self->{gz});  # reset eof
 		} else {
 			carp("getline() error: " . $csv->error_diag());
 		}
+
+		return $res;
 	}
 
+	# carry forward decimated values
+	my $last = $self->{last};
+	for (my $i = 0; $i < @$res; $i++) {
+		if ($res->[$i] eq '') {
+			$res->[$i] = $last->[$i];
+		} else {
+			$last->[$i] = $res->[$i];
+		}
+	}
+
+	$self->{time} = (defined $self->{base}) ? $self->{base} + $res->[0] : undef;
+
 	return $res;
 }
 # }}}
 
+# {{{ time()
+
+=head2 time()
+
+Returns: the time the row last returned by getline() was received,
+in seconds since the epoch, undefined if it is not known
+
+The 'localtime' column is the seconds since msqdev started
+logging, the start is only known from the index, after
+seek_time() or seek_last().
+
+=cut
+
+sub time {
+	my $self = shift;
+
+	return $self->{time};
+}
+# }}}
+
 # {{{ eof()
 
 =head2 eof()
@@ -280,6 +554,11 @@ sub print {
 	my $csv = $self->{csv};
 	my $fh = $self->{fh};
 
+	if ($self->{gz}) {
+		carp("cannot print to a compressed file");
+		return;
+	}
+
 	$csv->print($fh, $colref);
 }
 # }}}
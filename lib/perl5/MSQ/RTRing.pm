@@ -0,0 +1,300 @@
+package MSQ::RTRing;
+
+use strict;
+use warnings;
+use Carp;
+
+use IO::File;
+
+# DEVNOTE
+# The file layout is defined by MSQRingLog in include/MSQRingLog.h
+# and must be kept in sync with it.
+
+=head1 NAME
+
+MSQ::RTRing - msqdev binary real time data ring
+
+=head1 DESCRIPTION
+
+This module reads the binary ring of real time data written
+by msqdev when it is run with the '-rb' option.
+
+Each record in the ring is the raw data from the controller.
+The values are decoded using the channel descriptions stored
+in the file, so no text is parsed.
+
+=head1 SYNOPSIS
+
+  my $ring = MSQ::RTRing->new("rtdata.ring")
+	or die "unable to open ring";
+
+  my %cols = $ring->columns_hr();
+
+  $ring->seek_end();
+  while (1) {
+	while (my $vals = $ring->getline()) {
+		print $vals->[$cols{rpm}], "\n";
+	}
+	# wait for more data
+  }
+
+=head1 OPERATIONS
+
+=cut
+
+my $MAGIC = "MSQRING1";
+my $VERSION = 1;
+my $HEADER_SIZE = 64;   # sizeof(MSQRingHeader)
+my $CHANNEL_SIZE = 48;  # sizeof(MSQRingChannel)
+my $COUNT_OFFSET = 32;  # offset of MSQRingHeader.count
+
+# unpack() formats of each data type, all big endian
+my %UNPACK = (
+	U08 => 'C',
+	S08 => 'c',
+	U16 => 'n',
+	S16 => 's>',
+	U32 => 'N',
+	S32 => 'l>',
+);
+
+# {{{ new()
+=head2 new()
+
+Open an existing ring file.
+
+The first column is always 'time', seconds since the epoch,
+followed by each channel.
+
+=cut
+
+sub new {
+	my $class = shift;
+	my $file = shift;
+
+	my $fh = new IO::File;
+	unless ($fh->open("< $file")) {
+		carp("unable to open file '$file': $!");
+		return;
+	}
+	binmode($fh);
+
+	my $hdr;
+	unless (sysread($fh, $hdr, $HEADER_SIZE) == $HEADER_SIZE) {
+		carp("unable to read header of '$file'");
+		return;
+	}
+
+	my ($magic, $version, $header_size, $frame_bytes, $record_size,
+		$capacity, $num_channels) = unpack("a8 L L L L L L", $hdr);
+
+	unless ($magic eq $MAGIC and $version == $VERSION) {
+		carp("'$file' is not a ring file (or wrong version)");
+		return;
+	}
+
+	my $chans;
+	my $chans_size = $num_channels * $CHANNEL_SIZE;
+	unless (sysread($fh, $chans, $chans_size) == $chans_size) {
+		carp("unable to read channels of '$file'");
+		return;
+	}
+
+	my @cols = ('time');
+	my @decode;  # [offset, unpack format, mult, add]
+	for (my $i = 0; $i < $num_channels; $i++) {
+		my ($name, $type, $offset, $mult, $add) =
+			unpack("Z32 Z4 L f f", substr($chans, $i * $CHANNEL_SIZE, $CHANNEL_SIZE));
+
+		unless (exists $UNPACK{$type}) {
+			carp("unknown type '$type' for channel '$name'");
+			return;
+		}
+
+		push @cols, $name;
+		push @decode, [$offset, $UNPACK{$type}, $mult, $add];
+	}
+
+	my %cols_hr;
+	for (my $i = 0; $i < @cols; $i++) {
+		$cols_hr{$cols[$i]} = $i;
+	}
+
+	my $self = bless {
+		fh => $fh,
+		header_size => $header_size,
+		frame_bytes => $frame_bytes,
+		record_size => $record_size,
+		capacity => $capacity,
+		columns => \@cols,
+		columns_hr => \%cols_hr,
+		decode => \@decode,
+		pos => 0,  # next record to be read
+	}, $class;
+
+	$self->seek_start();
+
+	return $self;
+}
+# }}}
+
+# {{{ columns(), columns_hr()
+
+=head2 columns()
+
+Returns a list of the column names at their corresponding offset.
+
+=cut
+
+sub columns {
+	my $self = shift;
+
+	return @{$self->{columns}};
+}
+
+=head2 columns_hr()
+
+Returns the columns as a hash reference with the key name
+and value of the offset in the row.
+
+=cut
+
+sub columns_hr {
+	my $self = shift;
+
+	return %{$self->{columns_hr}};
+}
+# }}}
+
+# {{{ count(), first()
+
+=head2 count()
+
+Returns the total number of records written to the ring.
+
+=cut
+
+sub count {
+	my $self = shift;
+
+	my $buf;
+	sysseek($self->{fh}, $COUNT_OFFSET, 0);
+	sysread($self->{fh}, $buf, 8);
+
+	return unpack("Q", $buf);
+}
+
+=head2 first()
+
+Returns the number of the oldest record that can still be read.
+
+=cut
+
+sub first {
+	my $self = shift;
+
+	my $n = $self->count();
+	my $cap = $self->{capacity};
+
+	return ($n >= $cap) ? ($n - $cap + 1) : 0;
+}
+# }}}
+
+# {{{ seek_start(), seek_last(), seek_end()
+
+=head2 seek_start()
+
+Seek to the oldest record in the ring.
+
+=cut
+
+sub seek_start {
+	my $self = shift;
+
+	$self->{pos} = $self->first();
+
+	return 1;  # OK
+}
+
+=head2 seek_last()
+
+Seek to the last record so that the next call to getline will return it.
+
+=cut
+
+sub seek_last {
+	my $self = shift;
+
+	my $n = $self->count();
+	$self->{pos} = ($n > 0) ? $n - 1 : 0;
+
+	return 1;  # OK
+}
+
+=head2 seek_end()
+
+Seek to the end and skip any currently present data.
+
+=cut
+
+sub seek_end {
+	my $self = shift;
+
+	$self->{pos} = $self->count();
+
+	return 1;  # OK
+}
+# }}}
+
+# {{{ getline()
+
+=head2 getline()
+
+Get an array reference of the values of the next record.
+
+Returns: FALSE if there are no new records.
+
+If the writer has overwritten records that were not read yet
+they are skipped.
+
+=cut
+
+sub getline {
+	my $self = shift;
+
+	my $fh = $self->{fh};
+
+	my $first = $self->first();
+	$self->{pos} = $first if ($self->{pos} < $first);
+
+	return if ($self->{pos} >= $self->count());
+
+	my $i = $self->{pos};
+	my $at = $self->{header_size}
+				+ ($i % $self->{capacity}) * $self->{record_size};
+
+	my $rec;
+	sysseek($fh, $at, 0);
+	my $n = sysread($fh, $rec, 8 + $self->{frame_bytes});
+	return unless (defined $n and $n == 8 + $self->{frame_bytes});
+
+	# overwritten while it was read, try again from the oldest
+	return $self->getline() if ($i < $self->first());
+
+	$self->{pos}++;
+
+	my ($sec, $usec) = unpack("L L", $rec);
+	my @vals = ($sec + $usec / 1e6);
+
+	foreach my $d (@{$self->{decode}}) {
+		my ($offset, $fmt, $mult, $add) = @$d;
+
+		my $v = unpack("x" . (8 + $offset) . " $fmt", $rec);
+		push @vals, ($v + $add) * $mult;
+	}
+
+	return \@vals;
+}
+# }}}
+
+1;
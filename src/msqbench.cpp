@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * msqbench - benchmarks of the msqdev hot paths.
+ *
+ * Each benchmark runs an operation many times on synthetic
+ * data and prints the average time and the number of heap
+ * allocations (operator new) per operation.
+ *
+ * Commands to the ecu go to a simulated ecu (MSQSimEcu) with
+ * no latency or wire time, so that the time is mostly spent in
+ * msqdev and not waiting on the link.
+ *
+ *   make bench
+ *   ./msqbench [<iterations>]
+ */
+
+#define DEBUG false
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <new>
+#include <string>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "LookUpTable.h"
+#include "MSQData/Table.h"
+#include "MSQRealTime.h"
+#include "MSQSerial.h"
+#include "MSQTransport.h"
+#include "MSQUtils.h"
+
+using namespace std;
+
+volatile double sink;  // keeps results from being optimized away
+
+// {{{ operator new, delete
+/*
+ * Count every allocation made through operator new, including
+ * those of the standard containers and strings.
+ * The simulated ecu runs in another thread, hence the atomic add.
+ */
+static volatile unsigned long num_allocs = 0;
+
+static void* counted_alloc(size_t size) {
+	__sync_fetch_and_add(&num_allocs, 1);
+
+	void* p = malloc(size ? size : 1);
+	if (NULL == p)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+// not inlined, so that gcc does not see malloc() paired with delete
+__attribute__((noinline)) void* operator new(size_t size) throw(std::bad_alloc) {
+	return counted_alloc(size);
+}
+
+__attribute__((noinline)) void* operator new[](size_t size) throw(std::bad_alloc) {
+	return counted_alloc(size);
+}
+
+__attribute__((noinline)) void operator delete(void* p) throw() {
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p) throw() {
+	free(p);
+}
+// }}}
+
+// {{{ now()
+/*
+ * Current time in nano seconds.
+ */
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1.0e9 + ts.tv_nsec;
+}
+// }}}
+
+// {{{ start(), report()
+static double t0;
+static unsigned long allocs0;
+
+/*
+ * Start timing a benchmark.
+ */
+static void start() {
+	allocs0 = num_allocs;
+	t0 = now();
+}
+
+/*
+ * Print the time and allocations per operation since start().
+ */
+static void report(const string name, const long ops) {
+	double ns = now() - t0;
+	unsigned long allocs = num_allocs - allocs0;
+
+	printf("%-36s %10ld ops %12.2f ns/op %8.2f allocs/op\n",
+			name.c_str(), ops, ns / ops, (double) allocs / ops);
+}
+// }}}
+
+// {{{ sim_serial()
+/*
+ * A connected MSQSerial to a simulated ecu with no latency,
+ * wire time or ecu delays.
+ *
+ * @returns serial, NULL on error
+ */
+static MSQSerial* sim_serial() {
+	MSQSerial* serial = new MSQSerial(msq_transport("sim:baud=0"));
+
+	if (serial->connect()) {
+		delete serial;
+		return NULL;
+	}
+	serial->setDelays(0, 0);
+
+	return serial;
+}
+// }}}
+
+// {{{ channels
+/*
+ * The real time channels configured in msqdev.
+ */
+struct BenchChannel {
+	const char* name;
+	const char* type;
+	unsigned int offset;
+	float mult;
+	float add;
+};
+
+static const BenchChannel channels[] = {
+	{ "seconds", "U16", 0, 1, 0 },
+	{ "pulseWidth1", "U16", 2, 0.000666, 0 },
+	{ "pulseWidth2", "U16", 4, 0.000666, 0 },
+	{ "rpm", "U16", 6, 1, 0 },
+	{ "advance", "S16", 8, 0.1, 0 },
+	{ "afrtgt1", "U08", 12, 0.1, 0 },
+	{ "afrtgt2", "U08", 13, 0.1, 0 },
+	{ "barometer", "S16", 16, 0.1, 0 },
+	{ "map", "S16", 18, 0.1, 0 },
+	{ "mat", "S16", 20, 0.05555, -320.0 },
+	{ "coolant", "S16", 22, 0.05555, -320.0 },
+	{ "tps", "S16", 24, 0.1, 0.0 },
+	{ "batteryVoltage", "S16", 26, 0.1, 0.0 },
+	{ "afr1", "S16", 28, 0.1, 0.0 },
+	{ "egoCorrection1", "S16", 34, 0.1, 0.0 },
+	{ "veCurr1", "S16", 50, 0.1, 0.0 },
+	{ "iacstep", "S16", 54, 1.000, 0.0 },
+	{ "idleDC", "S16", 54, 0.39063, 0.0 },
+	{ "tpsDOT", "S16", 58, 0.100, 0.0 },
+	{ "mapDOT", "S16", 60, 1.000, 0.0 },
+	{ "dwell", "U16", 62, 0.0666, 0.0 },
+	{ "mafmap", "S16", 64, 0.100, 0.0 },
+	{ "fuelload", "S16", 66, 0.100, 0.0 },
+	{ "fuelCorrection", "S16", 68, 1.000, 0.0 },
+	{ "looptime", "U16", 82, 0.6667, 0.0 },
+	{ "synccnt", "U08", 94, 1.0, 0.0 },
+	{ "deltaT", "S32", 96, 1.0, 0.0 },
+	{ "rpmdot", "S16", 164, 10, 0.0 }
+};
+
+static const int num_channels = sizeof(channels) / sizeof(channels[0]);
+
+#define FRAME_BYTES 169
+
+/*
+ * The channels as configured in msqdev.
+ */
+static vector<RTConfigScalar*> make_channels() {
+	vector<RTConfigScalar*> rtc;
+
+	for (int c = 0; c < num_channels; c++) {
+		rtc.push_back(new RTConfigScalar(channels[c].name, channels[c].type,
+					channels[c].offset, channels[c].mult, channels[c].add));
+	}
+
+	return rtc;
+}
+
+/*
+ * Fill a frame with repeatable pseudo random data.
+ */
+static void fill_frame(char* frame) {
+	srand(1);
+	for (int i = 0; i < FRAME_BYTES; i++) {
+		frame[i] = rand() & 0xFF;
+	}
+}
+// }}}
+
+// {{{ bench_decode()
+/*
+ * Decode every channel of a frame, resolving the type by name
+ * on every value (bufToValue()), with the decoder resolved
+ * when the channel was configured (RTConfigScalar::value())
+ * and with all channels compiled in to one decoder (RTDecoder).
+ * Times are per value.
+ */
+static void bench_decode(const long iters) {
+	char frame[FRAME_BYTES];
+	fill_frame(frame);
+
+	vector<RTConfigScalar*> rtc = make_channels();
+
+	start();
+	for (long i = 0; i < iters; i++) {
+		for (int c = 0; c < num_channels; c++) {
+			sink = bufToValue(rtc[c]->type, rtc[c]->add, rtc[c]->mult,
+								&frame[rtc[c]->offset]);
+		}
+	}
+	report("decode bufToValue()", iters * num_channels);
+
+	start();
+	for (long i = 0; i < iters; i++) {
+		for (int c = 0; c < num_channels; c++) {
+			sink = rtc[c]->value(frame);
+		}
+	}
+	report("decode RTConfigScalar::value()", iters * num_channels);
+
+	RTDecoder decoder;
+	decoder.compile(rtc, FRAME_BYTES);
+	vector<float> vals(decoder.size());
+
+	start();
+	for (long i = 0; i < iters; i++) {
+		decoder.decode(frame, &vals[0]);
+		sink = vals[0];
+	}
+	report("decode RTDecoder::decode()", iters * num_channels);
+
+	for (int c = 0; c < num_channels; c++) {
+		delete rtc[c];
+	}
+}
+// }}}
+
+// {{{ bench_format()
+/*
+ * Append frames to the real time log (MSQRealTime::append()),
+ * which decodes and formats every value, and read and append
+ * them from the simulated ecu (MSQRealTime::readAppend()).
+ * Times are per frame.
+ */
+static void bench_format(const long iters, const string& dir) {
+	char frame[FRAME_BYTES];
+	fill_frame(frame);
+
+	MSQSerial* serial = sim_serial();
+	if (NULL == serial)
+		return;
+
+	vector<RTConfigScalar*> rtc = make_channels();
+	vector<RTConfig*> config(rtc.begin(), rtc.end());
+
+	string file = dir + "/rtdata";
+	MSQRealTime* rt = new MSQRealTime(serial, file, FRAME_BYTES, config);
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	start();
+	for (long i = 0; i < iters; i++) {
+		frame[6] = i & 0xFF;  // rpm changes every frame
+		tv.tv_usec = (tv.tv_usec + 15000) % 1000000;
+		rt->append(tv, frame);
+	}
+	rt->flush();
+	report("realtime append()", iters);
+
+	long cycles = iters / 10 + 1;  // these do i/o
+
+	start();
+	for (long i = 0; i < cycles; i++) {
+		rt->readAppend();
+	}
+	report("realtime readAppend(), sim", cycles);
+
+	delete rt;
+	unlink(file.c_str());
+
+	for (int c = 0; c < num_channels; c++) {
+		delete rtc[c];
+	}
+	delete serial;
+}
+// }}}
+
+// {{{ bench_table_sync()
+/*
+ * One sync cycle is what msqdev does when a table file changes:
+ * hasChanges() and, if there are any, writeEcu().
+ * The full compare of two tables, which hasChanges() used to do
+ * on every cycle, is shown for reference.
+ */
+static void bench_table_sync(const long iters) {
+	MSQSerial* serial = sim_serial();
+	if (NULL == serial)
+		return;
+
+	const int sizes[] = { 16, 32, 64 };
+	const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+	for (int s = 0; s < num_sizes; s++) {
+		int n = sizes[s];
+		char name[64];
+
+		// both copies start out zeroed, so there are no changes
+		MSQDataTable<float, float> tbl("bench", "bench.table", n, n, serial,
+					9, "U16", 0, 1.0, 0.0,
+					9, "U16", 2 * n, 1.0, 0.0,
+					9, "U08", 4 * n, 1.0, 0.0,
+					"x", "y");
+
+		LookUpTable<float, float> a(n, n, "x", "y");
+		LookUpTable<float, float> b(n, n, "x", "y");
+
+		start();
+		for (long i = 0; i < iters; i++) {
+			sink = (a != b);
+		}
+		snprintf(name, sizeof(name), "table %ix%i full compare", n, n);
+		report(name, iters);
+
+		start();
+		for (long i = 0; i < iters; i++) {
+			if (tbl.hasChanges())
+				tbl.writeEcu();
+		}
+		snprintf(name, sizeof(name), "table %ix%i sync, no change", n, n);
+		report(name, iters);
+
+		long cycles = iters / 10 + 1;  // these do i/o
+
+		start();
+		for (long i = 0; i < cycles; i++) {
+			tbl.setFileValue(i % n, (i / n) % n, (i + 1) & 0x7F);
+			if (tbl.hasChanges())
+				tbl.writeEcu();
+		}
+		snprintf(name, sizeof(name), "table %ix%i sync, 1 cell", n, n);
+		report(name, cycles);
+
+		cycles = cycles / n + 1;
+
+		start();
+		for (long i = 0; i < cycles; i++) {
+			for (int x = 0; x < n; x++)
+				tbl.setFileValue(x, i % n, (i + x + 1) & 0x7F);
+			if (tbl.hasChanges())
+				tbl.writeEcu();
+		}
+		snprintf(name, sizeof(name), "table %ix%i sync, 1 row", n, n);
+		report(name, cycles);
+	}
+
+	delete serial;
+}
+// }}}
+
+// {{{ bench_table_io()
+/*
+ * Read a whole table from the simulated ecu (readEcu()) and
+ * save and load its file (writeFile(), loadFile()).
+ * Only table sizes used by the ecu, which fit in a page, are
+ * read.
+ */
+static void bench_table_io(const long iters, const string& dir) {
+	MSQSerial* serial = sim_serial();
+	if (NULL == serial)
+		return;
+
+	const int sizes[] = { 12, 16 };
+	const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+	string file = dir + "/bench.table";
+
+	for (int s = 0; s < num_sizes; s++) {
+		int n = sizes[s];
+		char name[64];
+
+		MSQDataTable<float, float> tbl("bench", file, n, n, serial,
+					9, "U16", 0, 1.0, 0.0,
+					9, "U16", 2 * n, 1.0, 0.0,
+					9, "U08", 4 * n, 1.0, 0.0,
+					"x", "y");
+
+		long cycles = iters / 10 + 1;  // these do i/o
+
+		start();
+		for (long i = 0; i < cycles; i++) {
+			if (tbl.readEcu()) {
+				cerr << "readEcu() failed\n";
+				break;
+			}
+		}
+		snprintf(name, sizeof(name), "table %ix%i readEcu(), sim", n, n);
+		report(name, cycles);
+
+		tbl.cpEcuToFile();
+
+		start();
+		for (long i = 0; i < cycles; i++) {
+			tbl.writeFile();
+		}
+		snprintf(name, sizeof(name), "table %ix%i save file", n, n);
+		report(name, cycles);
+
+		start();
+		for (long i = 0; i < cycles; i++) {
+			sink = tbl.loadFile();
+		}
+		snprintf(name, sizeof(name), "table %ix%i load file", n, n);
+		report(name, cycles);
+	}
+
+	unlink(file.c_str());
+	delete serial;
+}
+// }}}
+
+int main(int argc, char** argv)
+{
+	long iters = 100000;
+
+	if (argc > 1) {
+		iters = atol(argv[1]);
+		if (iters <= 0) {
+			cerr << "USAGE: msqbench [<iterations>]\n";
+			return 1;  // error
+		}
+	}
+
+	// files are written to a temporary directory
+	char dir[] = "/tmp/msqbench.XXXXXX";
+	if (NULL == mkdtemp(dir)) {
+		perror("unable to create temporary directory");
+		return 1;  // error
+	}
+
+	bench_decode(iters);
+	bench_format(iters, dir);
+	bench_table_sync(iters);
+	bench_table_io(iters, dir);
+
+	rmdir(dir);
+
+	return 0;
+}
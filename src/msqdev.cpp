@@ -17,31 +17,50 @@
 
 #define DEBUG false
 
+#include <cstdio>
+#include <cstdlib>
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <pthread.h>
 #include <signal.h>
 #include <sstream>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "MSQAutoTune.h"
+#include "MSQCellStats.h"
 #include "MSQData.h"
 #include "MSQData/Table.h"
+#include "MSQFrameQueue.h"
+#include "MSQIni.h"
+#include "MSQPageCache.h"
 #include "MSQSerial.h"
 #include "MSQRealTime.h"
+#include "MSQStats.h"
 
 using namespace std;
 
 #define LOG true
 
-static void sig_update(int sig, siginfo_t *siginfo, void *context);
-static void sig_burn(int sig, siginfo_t *siginfo, void *context);
-static void sig_quit(int sig, siginfo_t *siginfo, void *context);
-
 enum { none, file, ecu, burn };
-int update = file;
-bool quit = false;
+volatile int update = file;
+volatile bool quit = false;
+
+// Number of frames of real time data that can be waiting to
+// be written out before new frames are dropped.
+#define RT_QUEUE_FRAMES 1024
+
+// Number of frames in the shared memory feed (-m).
+#define RT_SHM_FRAMES 1024
+
 
 // {{{ log()
 /*
@@ -73,116 +92,336 @@ void log(string msg) {
 }
 // }}}
 
-int main(int argc, char** argv)
-{
-	// {{{ signals 
-	struct sigaction sa_update;
-	sa_update.sa_sigaction = &sig_update;
-	sigemptyset(&sa_update.sa_mask);
-	sa_update.sa_flags = 0;
+// {{{ serial_acquire(), serial_release()
+/*
+ * The serial device is shared by the acquisition thread, which
+ * reads real time data, and the main thread, which updates tables.
+ * The main thread sets serial_wanted so the acquisition thread
+ * steps aside instead of immediately taking the lock again, it
+ * waits on serial_turn until the main thread is done.
+ */
+pthread_mutex_t serial_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t serial_turn = PTHREAD_COND_INITIALIZER;
+volatile bool serial_wanted = false;
 
-	sigaction(SIGHUP, &sa_update, NULL);
+void serial_acquire() {
+	serial_wanted = true;
+	pthread_mutex_lock(&serial_lock);
+}
 
-	struct sigaction sa_burn;
-	sa_burn.sa_sigaction = &sig_burn;
-	sigemptyset(&sa_burn.sa_mask);
-	sa_burn.sa_flags = 0;
+void serial_release() {
+	serial_wanted = false;
+	pthread_cond_broadcast(&serial_turn);
+	pthread_mutex_unlock(&serial_lock);
+}
+// }}}
 
-	sigaction(SIGUSR1, &sa_burn, NULL);
+// {{{ rt_acquire(), rt_output()
+struct RTPipeline {
+	MSQRealTime* rt;
+	MSQFrameQueue* queue;
+	volatile bool done;  // set when acquisition has stopped
 
-	struct sigaction sa_quit;
-	sa_quit.sa_sigaction = &sig_quit;
-	sigemptyset(&sa_quit.sa_mask);
-	sa_quit.sa_flags = 0;
+	int wake_fd;   // eventfd, signaled after frames are queued
+	int timer_fd;  // timerfd setting the sample rate, -1 if unlimited
 
-	sigaction(SIGINT, &sa_quit, NULL);
-	sigaction(SIGTERM, &sa_quit, NULL);
-	// }}}
+	MSQAutoTune<float, int>* tune;  // NULL if not tuning (-at)
+	int tune_fd;   // eventfd, signaled when cells are ready to tune
 
-	// {{{ command line arguments
-	string usage;
-	{
-	stringstream usagess;
-		usagess << " USAGE:\n"
-         	 	<< "   msqdev <device> [<options>]\n"
-        	 	<< "   msqdev /dev/ttyUSB0 -d ./ -uf\n"
-				<< " OPTIONS:\n"
-				<< "   -d           directory of files, default './'\n"
-				<< "   -ue          update ecu from files on startup\n"
-				<< "   -uf          update files from ecu on startup\n"
-				<< "   -h           this help screen\n"
-				<< " SIGNALS:\n"
-				<< "   SIGHUP       triggers update of ecu from files\n"
-				<< "   SIGUSR1      triggers burn of any modified tables\n";
-		usage = usagess.str();
+	vector<MSQCellStats*> cells;  // per cell statistics (-cs)
+};
+
+/*
+ * Acquisition thread: read frames of real time data and queue them.
+ *
+ * Nothing else is done here so that the sample rate does not
+ * depend upon the speed of formatting or of the disk.
+ * Frames are published to the shared memory feed (-m) here,
+ * which only touches memory, so that live clients see them
+ * without waiting for the output thread.
+ */
+static void* rt_acquire(void* arg) {
+	RTPipeline* p = (RTPipeline*) arg;
+	char* frame = new char[p->rt->frameBytes()];
+	struct timeval tv;
+
+	uint64_t n;
+
+	while (! quit) {
+		// wait for the next sample period
+		if (p->timer_fd > -1) {
+			if (read(p->timer_fd, &n, sizeof(n)) < 0 && EINTR != errno) {
+				perror("sample timer");
+				break;
+			}
+		}
+
+		// step aside while the main thread uses the serial device
+		pthread_mutex_lock(&serial_lock);
+		while (serial_wanted && ! quit) {
+			pthread_cond_wait(&serial_turn, &serial_lock);
+		}
+		bool err = p->rt->read(tv, frame);
+		pthread_mutex_unlock(&serial_lock);
+
+		if (! err) {
+			p->rt->publish(tv, frame);
+			p->queue->push(tv, frame);
+
+			n = 1;
+			if (write(p->wake_fd, &n, sizeof(n)) < 0) {
+				perror("wake output thread");
+			}
+		}
 	}
 
-    if (argc < 2) {
-		cout << usage;
-        return 1;  // error
-    }
+	delete[] frame;
 
-	string serial_dev = argv[1];
-	if (serial_dev == "-h") {
-		cout << usage;
-		return 1;  // error
+	p->done = true;
+
+	n = 1;
+	if (write(p->wake_fd, &n, sizeof(n)) < 0) {
+		perror("wake output thread");
 	}
 
-	string dir = "";
+	return NULL;
+}
 
-	for (int i = 2; i < argc; i++) {
-		string arg = argv[i];
+/*
+ * Output thread: decode the queued frames and write them out.
+ *
+ * It sleeps until the acquisition thread signals that frames
+ * are waiting, then writes all of them as one batch with a
+ * single flush.
+ * The decoded frames are also given to the autotune (-at), which
+ * signals the main thread when cells are ready to be changed,
+ * and to the per cell statistics (-cs), but only those that are
+ * steady if there is a transient filter (-rf).
+ * After acquisition stops the queue is drained before returning.
+ */
+static void* rt_output(void* arg) {
+	RTPipeline* p = (RTPipeline*) arg;
+	char* frame = new char[p->rt->frameBytes()];
+	struct timeval tv;
+	unsigned long last_dropped = 0;
+	uint64_t wakes;
+
+	while (1) {
+		// check before draining so that no frame is left behind
+		bool done = p->done;
+
+		int n = 0;
+		bool tune = false;
+		while (! p->queue->pop(tv, frame)) {
+			p->rt->append(tv, frame);
+			n++;
+
+			if (! p->rt->steady())
+				continue;
+
+			if (p->tune != NULL && p->tune->frame(tv, p->rt->values()))
+				tune = true;
+
+			for (unsigned int i = 0; i < p->cells.size(); i++)
+				p->cells[i]->frame(tv, p->rt->values());
+		}
+		if (n > 0) {
+			p->rt->flush();
+		}
 
-		if (arg == "-ue") {
-			update = ecu;
-		} else if (arg == "-uf") {
-			update = file;
-		} else if (arg == "-d") {
-			if ((i + 1) >= argc) {
-				cerr << "the -d option requires a directory" << endl;
-				return 1;  // error
+		if (tune) {
+			uint64_t one = 1;
+			if (write(p->tune_fd, &one, sizeof(one)) < 0) {
+				perror("wake main thread");
 			}
-		} else {
-			cout << "unkown argument: '" << arg << "'\n";
-			return 1;  // error
+		}
+
+		unsigned long dropped = p->queue->dropped();
+		if (dropped != last_dropped) {
+			stringstream msg;
+			msg << "real time queue full, " << (dropped - last_dropped)
+				<< " frames dropped";
+			log(msg.str());
+
+			last_dropped = dropped;
+		}
+
+		if (done)
+			break;
+
+		if (read(p->wake_fd, &wakes, sizeof(wakes)) < 0 && EINTR != errno) {
+			perror("output thread wait");
+			break;
 		}
 	}
-	// }}}
 
-	// {{{ write the pid (process id) to a file
-	{
-	pid_t pid = getpid();
+	delete[] frame;
 
-	string pidfile = dir;
-	if (! pidfile.empty())
-		pidfile += "/";
-	pidfile += "pid";
+	return NULL;
+}
+// }}}
 
-	ofstream pidfd(pidfile.c_str(), ios_base::trunc);
-	if (pidfd.fail()) {
-		perror("unable to open pid file");
-		return 1; // error
+// {{{ handle_signal(), handle_watch(), modified_tables()
+/*
+ * Handle the pending signals from a (non blocking) signalfd.
+ */
+static void handle_signal(int sig_fd) {
+	struct signalfd_siginfo si;
+
+	while (sizeof(si) == read(sig_fd, &si, sizeof(si))) {
+		switch (si.ssi_signo) {
+			case SIGHUP:
+				update = ecu;
+				break;
+			case SIGUSR1:
+				update = burn;
+				break;
+			case SIGINT:
+			case SIGTERM:
+				quit = true;
+				break;
+		}
 	}
-	pidfd << pid << endl;
+}
 
-	pidfd.close();
+/*
+ * Handle the pending events from the inotify watch.
+ *
+ * Each table whose file was written is marked as modified,
+ * the main loop then updates the ecu from just those tables.
+ * Files that msqdev wrote itself (see MSQData::fileWritten())
+ * are left alone.
+ */
+static void handle_watch(int watch_fd, MSQData** tables, int num_tables) {
+	// aligned as required by inotify(7)
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+		for (char* p = buf; p < buf + len; ) {
+			struct inotify_event* ev = (struct inotify_event*) p;
+
+			if (ev->len > 0) {
+				for (int i = 0; i < num_tables; i++) {
+					if (tables[i]->fileName() == ev->name
+							&& ! tables[i]->ownFileWrite())
+					{
+						tables[i]->setFileModified(true);
+					}
+				}
+			}
+
+			p += sizeof(struct inotify_event) + ev->len;
+		}
 	}
-	// }}}
+}
 
-	log("start");
+/*
+ * Have any table files been modified (see handle_watch())?
+ */
+static bool modified_tables(MSQData** tables, int num_tables) {
+	for (int i = 0; i < num_tables; i++) {
+		if (tables[i]->fileModified())
+			return true;
+	}
 
-	MSQSerial serial(serial_dev);
+	return false;
+}
+// }}}
 
-	if (serial.connect()) {
-		//log("unable to open serial device\n");
-		cerr << "unable to open serial device\n";
-		return 1; // error
+// {{{ now_us(), write_stats()
+/*
+ * Monotonic time in micro seconds.
+ */
+static int64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Rewrite the statistics file (-s).
+ *
+ * Each line is "<name>: <value>", histograms are summarized
+ * (see MSQHistogram::summary()) in micro seconds.
+ * The file is written under another name and then renamed so
+ * that a reader never sees a partial file.
+ *
+ * @returns true on error, false otherwise
+ */
+static bool write_stats(const string& file, const time_t started,
+						MSQSerial& serial, MSQRealTime& rt,
+						MSQFrameQueue& queue, const MSQHistogram& sync_times)
+{
+	// the acquisition thread changes these
+	serial_acquire();
+	string latencies = serial.latencyReport();
+	int baud = serial.getBaud();
+	uint64_t sent = serial.bytesSent();
+	uint64_t received = serial.bytesReceived();
+	unsigned long flushes = serial.flushes();
+	unsigned long corrupt = serial.corruptFrames();
+	serial_release();
+
+	string tmp = file + ".tmp";
+	ofstream out(tmp.c_str(), ios_base::trunc);
+	if (out.fail()) {
+		perror("unable to open stats file");
+		return true;  // error
+	}
+
+	time_t now = time(NULL);
+
+	out << "time: " << now << "\n"
+		<< "uptime: " << (now - started) << "\n"
+		<< "rt_frames_read: " << queue.pushed() << "\n"
+		<< "rt_frames_dropped: " << queue.dropped() << "\n"
+		<< "rt_queue_max_depth: " << queue.maxDepth() << "\n"
+		<< "rt_frames_written: " << rt.frames() << "\n"
+		<< "rt_frames_filtered: " << rt.filtered() << "\n"
+		<< "rt_bytes_written: " << rt.bytesWritten() << "\n"
+		<< "serial_baud: " << baud << "\n"
+		<< "serial_bytes_sent: " << sent << "\n"
+		<< "serial_bytes_received: " << received << "\n"
+		<< "serial_flushes: " << flushes << "\n"
+		<< "serial_corrupt_frames: " << corrupt << "\n";
+
+	// one line per command, such as "serial_A: n=... us, failed=0"
+	stringstream report(latencies);
+	string line;
+	while (getline(report, line))
+		out << "serial_" << line << "\n";
+
+	out << "sync: " << sync_times.summary() << " us\n";
+
+	out.close();
+	if (out.fail()) {
+		perror("unable to write stats file");
+		return true;  // error
+	}
+
+	if (-1 == rename(tmp.c_str(), file.c_str())) {
+		perror("unable to rename stats file");
+		return true;  // error
 	}
 
-	MSQData* tables[3];
-	int num_tables = 3;
+	return false;  // OK
+}
+// }}}
 
-	// {{{ define advanceTable1, and read/write
+// {{{ default_tables()
+/*
+ * The tables used when no ini file is given.
+ *
+ * The real time channels of the axes of each table, as the
+ * xBins and yBins of the ini, are added to axes.
+ */
+static void default_tables(MSQSerial* serial,
+							vector<MSQDataTable<float, int>*>& tables,
+							map<string, pair<string, string> >& axes)
+{
+	// {{{ advanceTable1
 	/*
 	 * doc/ini/megasquirt-ii.ms2extra.alpha_3.0.3u_20100522.ini
 	 *
@@ -190,10 +429,13 @@ int main(int argc, char** argv)
 	 *       advanceTable1   = array ,  S16,    000,    [12x12], "deg",      0.10000,   0.00000,-10.00,   90.00,      1 ; * (288 bytes)
 	 *       srpm_table1     = array ,  U16,    576,    [   12], "RPM",      1.00000,   0.00000,  0.00,15000.00,      0 ; * ( 24 bytes)
 	 *       smap_table1     = array ,  S16,    624,    [   12], "%",      0.10000,   0.00000,  0.00,  400.00,      1 ; * ( 24 bytes)
+	 *
+	 *       xBins       = srpm_table1, rpm
+	 *       yBins       = smap_table1, ignload
 	 */
-	MSQDataTable<float, int> advanceTable1("advanceTable1", "advanceTable1",
+	tables.push_back(new MSQDataTable<float, int>("advanceTable1", "advanceTable1",
 			12, 12,  			// x size, y size
-			&serial,
+			serial,
 			10, "U16", 576, 	// x: tbl_idx, type, offset,
 			1, 0,				// mult, add,
 			10, "S16", 624, 	// y: tbl_idx, type, offset,
@@ -201,18 +443,11 @@ int main(int argc, char** argv)
 			10, "S16", 0, 		// values: tbl_idx, type, offset,
 			0.1, 0,
 			"RPM", "map(%)"  	// title (without spaces!)
-			);
-
-	if (DEBUG) { cout << "advanceTable1.readEcu()\n"; }
-	if (advanceTable1.readEcu()) {
-		log("readEcu(), error reading advanceTable1\n");
-		return(1);
-	}
-	if (DEBUG) { cout << "advanceTable1.readFile()\n"; }
-	advanceTable1.readFile();
+			));
+	axes["advanceTable1"] = make_pair(string("rpm"), string("ignload"));
 	// }}}
 
-	// {{{ define veTable1, and read/write
+	// {{{ veTable1
 	/*
 	 * doc/ini/megasquirt-ii.ms2extra.alpha_3.0.3u_20100522.ini
 	 *
@@ -222,10 +457,12 @@ int main(int argc, char** argv)
 	 *       frpm_table1     = array ,  U16,    768,    [   16], "RPM",      1.00000,   0.00000,  0.00,15000.00,      0 ; * ( 24 bytes)
 	 *       fmap_table1     = array ,  S16,    864,    [   16], "%",      0.10000,   0.00000,  0.00,  400.00,      1 ; * ( 24 bytes)
 	 * 
+	 *       xBins       = frpm_table1, rpm
+	 *       yBins       = fmap_table1, fuelload
 	 */
-	MSQDataTable<float, int> veTable1("veTable1", "veTable1",
+	tables.push_back(new MSQDataTable<float, int>("veTable1", "veTable1",
 			16, 16,  			// x size, y size
-			&serial,
+			serial,
 			// frpm_table1
 			9, "U16", 768, 	// tbl_idx, type, offset
 			1, 0,				// mult, add
@@ -236,18 +473,11 @@ int main(int argc, char** argv)
 			9, "U08", 0, 
 			1, 0,
 			"RPM", "FuelLoad(%)"  	// title (without spaces!)
-			);
-
-	if (DEBUG) { cout << "veTable1.readEcu()\n"; }
-	if (veTable1.readEcu()) {
-		log("readEcu(), error reading veTable1\n");
-		return(1);
-	}
-	if (DEBUG) { cout << "veTable1.readFile()\n"; }
-	veTable1.readFile();
+			));
+	axes["veTable1"] = make_pair(string("rpm"), string("fuelload"));
 	// }}}
 
-	// {{{ define afrTable1, and read/write
+	// {{{ afrTable1
 	/*
 	 * doc/ini/megasquirt-ii.ms2extra.alpha_3.0.3u_20100522.ini
 	 * 
@@ -260,10 +490,14 @@ int main(int argc, char** argv)
 	 *       arpm_table1     = array ,  U16,    374,    [   12], "RPM",      1.00000,   0.00000,  0.00,15000.00,      0 ; * ( 24 bytes)
 	 *       amap_table1     = array ,  S16,    422,    [   12], "%",      0.10000,   0.00000,  0.00,  400.00,      1 ; * ( 24 bytes)
 	 * 
+	 * doc/ini/megasquirt-ii.ms2extra.3.1.1_release.ini
+	 *
+	 *       xBins       = arpm_table1, rpm
+	 *       yBins       = amap_table1, afrload1
 	 */
-	MSQDataTable<float, int> afrTable1("afrTable1", "afrTable1",
+	tables.push_back(new MSQDataTable<float, int>("afrTable1", "afrTable1",
 			12, 12,  			// x size, y size
-			&serial,
+			serial,
 			// arpm_table1
 			4, "U16", 374, 		// tbl_idx, type, offset
 			1, 0,				// mult, add
@@ -275,194 +509,1315 @@ int main(int argc, char** argv)
 			0.1, 0,
 			//0.006803, 0,  // lambda
 			"RPM", "map(Kpa)"  	// title (without spaces!)
-			);
-
-	if (DEBUG) { cout << "afrTable1.readEcu()\n"; }
-	if (afrTable1.readEcu()) {
-		log("readEcu(), error reading afrTable1\n");
-		return(1);
-	}
-	if (DEBUG) { cout << "afrTable1.readFile()\n"; }
-	afrTable1.readFile();
+			));
+	axes["afrTable1"] = make_pair(string("rpm"), string("afrload1"));
 	// }}}
+}
+// }}}
 
-	tables[0] = &advanceTable1;
-	tables[1] = &veTable1;
-	tables[2] = &afrTable1;
-
-	// {{{ configure real time data
-	
-	// To configure these items look for the [BurstMode] section
-	// of the MegaSquirt ini file.
-	//
-	// After these are changed the columns in the rtdata file will
-	// be invalid.  Delete the rtdata file and it will be recreated
-	// with the correct columns.
-
-	vector<RTConfig*> rtconfig;
-
+// {{{ default_channels()
+/*
+ * The real time channels used when no ini file is given.
+ */
+static void default_channels(vector<RTConfig*>& rtconfig)
+{
 	// RTConfigScalar(name, type, offset, mult, add)
 
 	// seconds          = scalar, U16,    0, "s",   1.000, 0.0
-	RTConfigScalar seconds("seconds", "U16", 0, 1, 0);
-	rtconfig.push_back(&seconds);
+	rtconfig.push_back(new RTConfigScalar("seconds", "U16", 0, 1, 0));
 
 	// pulseWidth1      = scalar, U16,    2, "s",   0.000666, 0.0
-	RTConfigScalar pulseWidth1("pulseWidth1", "U16", 2, 0.000666, 0);
-	rtconfig.push_back(&pulseWidth1);
+	rtconfig.push_back(new RTConfigScalar("pulseWidth1", "U16", 2, 0.000666, 0));
 
 	// pulseWidth2
-	RTConfigScalar pulseWidth2("pulseWidth2", "U16", 4, 0.000666, 0);
-	rtconfig.push_back(&pulseWidth2);
+	rtconfig.push_back(new RTConfigScalar("pulseWidth2", "U16", 4, 0.000666, 0));
 
 	// rpm
-	RTConfigScalar rpm("rpm", "U16", 6, 1, 0);
-	rtconfig.push_back(&rpm);
+	rtconfig.push_back(new RTConfigScalar("rpm", "U16", 6, 1, 0));
 
 	// advance
-	RTConfigScalar advance("advance", "S16", 8, 0.1, 0);
-	rtconfig.push_back(&advance);
+	rtconfig.push_back(new RTConfigScalar("advance", "S16", 8, 0.1, 0));
 
 	// afrtgt1          = scalar, U08,   12, "AFR", 0.1, 0.0
-	RTConfigScalar afrtgt1("afrtgt1", "U08", 12, 0.1, 0);
-	rtconfig.push_back(&afrtgt1);
+	rtconfig.push_back(new RTConfigScalar("afrtgt1", "U08", 12, 0.1, 0));
    	// afrtgt2          = scalar, U08,   13, "AFR", 0.1, 0.0
-	RTConfigScalar afrtgt2("afrtgt2", "U08", 13, 0.1, 0);
-	rtconfig.push_back(&afrtgt2);
+	rtconfig.push_back(new RTConfigScalar("afrtgt2", "U08", 13, 0.1, 0));
 
-	RTConfigScalar barometer("barometer", "S16", 16, 0.1, 0);
-	rtconfig.push_back(&barometer);
+	rtconfig.push_back(new RTConfigScalar("barometer", "S16", 16, 0.1, 0));
 
-	RTConfigScalar map("map", "S16", 18, 0.1, 0);
-	rtconfig.push_back(&map);
+	rtconfig.push_back(new RTConfigScalar("map", "S16", 18, 0.1, 0));
 
-	RTConfigScalar mat("mat", "S16", 20, 0.05555, -320.0); // degC
-	//RTConfigScalar mat("mat", "S16", 20, 0.1, 0.0);  // degF
-	rtconfig.push_back(&mat);
+	rtconfig.push_back(new RTConfigScalar("mat", "S16", 20, 0.05555, -320.0)); // degC
+	//rtconfig.push_back(new RTConfigScalar("mat", "S16", 20, 0.1, 0.0));  // degF
 
-	RTConfigScalar coolant("coolant", "S16", 22, 0.05555, -320.0); // degC
-	//RTConfigScalar coolant("coolant", "S16", 22, 0.1, 0.0); // degF
-	rtconfig.push_back(&coolant);
+	rtconfig.push_back(new RTConfigScalar("coolant", "S16", 22, 0.05555, -320.0)); // degC
+	//rtconfig.push_back(new RTConfigScalar("coolant", "S16", 22, 0.1, 0.0)); // degF
 
-	RTConfigScalar tps("tps", "S16", 24, 0.1, 0.0);
-	rtconfig.push_back(&tps);
+	rtconfig.push_back(new RTConfigScalar("tps", "S16", 24, 0.1, 0.0));
 
-	RTConfigScalar batteryVoltage("batteryVoltage", "S16", 26, 0.1, 0.0);
-	rtconfig.push_back(&batteryVoltage);
+	rtconfig.push_back(new RTConfigScalar("batteryVoltage", "S16", 26, 0.1, 0.0));
 
-	RTConfigScalar afr1("afr1", "S16", 28, 0.1, 0.0);
-	rtconfig.push_back(&afr1);
+	rtconfig.push_back(new RTConfigScalar("afr1", "S16", 28, 0.1, 0.0));
 
-	RTConfigScalar egoCorrection1("egoCorrection1", "S16", 34, 0.1, 0.0);
-	rtconfig.push_back(&egoCorrection1);
+	rtconfig.push_back(new RTConfigScalar("egoCorrection1", "S16", 34, 0.1, 0.0));
 
-	RTConfigScalar veCurr1("veCurr1", "S16", 50, 0.1, 0.0);
-	rtconfig.push_back(&veCurr1);
+	rtconfig.push_back(new RTConfigScalar("veCurr1", "S16", 50, 0.1, 0.0));
 
-	RTConfigScalar iacstep("iacstep", "S16", 54, 1.000, 0.0);
-	rtconfig.push_back(&iacstep);
+	rtconfig.push_back(new RTConfigScalar("iacstep", "S16", 54, 1.000, 0.0));
 
-	RTConfigScalar idleDC("idleDC", "S16", 54, 0.39063, 0.0);
-	rtconfig.push_back(&idleDC);
+	rtconfig.push_back(new RTConfigScalar("idleDC", "S16", 54, 0.39063, 0.0));
 
-	RTConfigScalar tpsDOT("tpsDOT", "S16", 58, 0.100, 0.0);
-	rtconfig.push_back(&tpsDOT);
+	rtconfig.push_back(new RTConfigScalar("tpsDOT", "S16", 58, 0.100, 0.0));
 
-	RTConfigScalar mapDOT("mapDOT", "S16", 60, 1.000, 0.0);
-	rtconfig.push_back(&mapDOT);
+	rtconfig.push_back(new RTConfigScalar("mapDOT", "S16", 60, 1.000, 0.0));
 
-	RTConfigScalar dwell("dwell", "U16", 62, 0.0666, 0.0);
-	rtconfig.push_back(&dwell);
+	rtconfig.push_back(new RTConfigScalar("dwell", "U16", 62, 0.0666, 0.0));
 
-	RTConfigScalar mafmap("mafmap", "S16", 64, 0.100, 0.0);
-	rtconfig.push_back(&mafmap);
+	rtconfig.push_back(new RTConfigScalar("mafmap", "S16", 64, 0.100, 0.0));
 
-	RTConfigScalar fuelload("fuelload", "S16", 66, 0.100, 0.0);
-	rtconfig.push_back(&fuelload);
+	rtconfig.push_back(new RTConfigScalar("fuelload", "S16", 66, 0.100, 0.0));
 
-	RTConfigScalar fuelCorrection("fuelCorrection", "S16", 68, 1.000, 0.0);
-	rtconfig.push_back(&fuelCorrection);
+	rtconfig.push_back(new RTConfigScalar("fuelCorrection", "S16", 68, 1.000, 0.0));
 
-	RTConfigScalar looptime("looptime", "U16", 82, 0.6667, 0.0);
-	rtconfig.push_back(&looptime);
+	// ignload          = scalar, S16,   90, "%",    0.100, 0.0
+	rtconfig.push_back(new RTConfigScalar("ignload", "S16", 90, 0.100, 0.0));
 
-	RTConfigScalar synccnt("synccnt", "U08", 94, 1.0, 0.0);
-	rtconfig.push_back(&synccnt);
+	rtconfig.push_back(new RTConfigScalar("looptime", "U16", 82, 0.6667, 0.0));
 
-	RTConfigScalar deltaT("deltaT", "S32", 96, 1.0, 0.0);
-	rtconfig.push_back(&deltaT);
+	rtconfig.push_back(new RTConfigScalar("synccnt", "U08", 94, 1.0, 0.0));
 
-	RTConfigScalar rpmdot("rpmdot", "S16", 164, 10, 0.0);
-	rtconfig.push_back(&rpmdot);
+	rtconfig.push_back(new RTConfigScalar("deltaT", "S32", 96, 1.0, 0.0));
 
-	// serial_device, file, buffer length, config(above)
-	MSQRealTime rtData(&serial, "rtdata", 169, rtconfig);
-	// }}}
+	// afrload1         = scalar, S16,  162, "%", 0.1, 0.0
+	rtconfig.push_back(new RTConfigScalar("afrload1", "S16", 162, 0.1, 0.0));
 
-	while (!quit) {
-		if (update == ecu) {
-			update = none;
-			log("updating ecu from files");
+	rtconfig.push_back(new RTConfigScalar("rpmdot", "S16", 164, 10, 0.0));
+}
+// }}}
 
-			for (int i = 0; i < num_tables; i++) {
-				MSQData *table = tables[i];
+// {{{ split_list()
+/*
+ * Split a comma separated list of names.
+ */
+static vector<string> split_list(const string& list) {
+	vector<string> names;
+	stringstream ss(list);
+	string name;
+
+	while (getline(ss, name, ',')) {
+		if (! name.empty())
+			names.push_back(name);
+	}
 
-				if (table->readFile()) {
-					cerr << "hard fault trying to read table\n";
-					return(1);
-				}
+	return names;
+}
+// }}}
 
-				if (table->hasChanges()) {
-					if (table->writeEcu()) {
-						log("error writeEcu()");
-					}
-				}
-			}
-		} else if (update == file) {
-			update = none;
-			log("updating files from ecu");
+// {{{ ini_tables()
+/*
+ * Build tables from an ini file.
+ *
+ * @arg ini
+ * @arg names of the tables (zBins in the [TableEditor])
+ * @arg serial device
+ * @arg tables that were built
+ * @arg real time channels of the x and y axes of each table
+ *
+ * @returns true on error, false otherwise
+ */
+static bool ini_tables(MSQIni& ini, const vector<string>& names,
+						MSQSerial* serial,
+						vector<MSQDataTable<float, int>*>& tables,
+						map<string, pair<string, string> >& axes)
+{
+	for (unsigned int i = 0; i < names.size(); i++) {
+		const MSQIniTable* t = ini.table(names[i]);
+		if (NULL == t) {
+			cerr << "table '" << names[i] << "' is not in the ini\n";
+			return true;  // error
+		}
 
-			for (int i = 0; i < num_tables; i++) {
-				MSQData *table = tables[i];
+		const MSQIniConstant* x = ini.constant(t->x_bins);
+		const MSQIniConstant* y = ini.constant(t->y_bins);
+		const MSQIniConstant* z = ini.constant(t->z_bins);
+		if (NULL == x || NULL == y || NULL == z) {
+			cerr << "table '" << names[i] << "' is incomplete in the ini\n";
+			return true;  // error
+		}
 
-				if (DEBUG) { cout << "hasChanges()?\n"; }
-				if (table->hasChanges()) {
-					table->cpEcuToFile();
-					table->writeFile();
-				}
+		// the file is named after the values, as the defaults are
+		tables.push_back(new MSQDataTable<float, int>(z->name, z->name,
+				z->x_size, z->y_size,
+				serial,
+				x->tbl_idx, x->type, x->offset,
+				x->scale, x->translate,
+				y->tbl_idx, y->type, y->offset,
+				y->scale, y->translate,
+				z->tbl_idx, z->type, z->offset,
+				z->scale, z->translate,
+				t->x_channel, t->y_channel
+				));
+		axes[z->name] = make_pair(t->x_channel, t->y_channel);
+	}
+
+	return false;  // OK
+}
+// }}}
+
+// {{{ ini_channels()
+/*
+ * Build real time channels from an ini file.
+ *
+ * @arg ini
+ * @arg names of the channels, all scalar channels if empty
+ * @arg channels that were built
+ *
+ * @returns true on error, false otherwise
+ */
+static bool ini_channels(MSQIni& ini, const vector<string>& names,
+							vector<RTConfig*>& rtconfig)
+{
+	const vector<MSQIniChannel>& all = ini.outputChannels();
+
+	vector<const MSQIniChannel*> chans;
+	if (names.empty()) {
+		for (unsigned int i = 0; i < all.size(); i++) {
+			if ("scalar" == all[i].cls)
+				chans.push_back(&all[i]);
+		}
+	} else {
+		for (unsigned int i = 0; i < names.size(); i++) {
+			const MSQIniChannel* c = ini.channel(names[i]);
+			if (NULL == c || "scalar" != c->cls) {
+				cerr << "'" << names[i] << "' is not a scalar channel in the ini\n";
+				return true;  // error
 			}
-		} else if (update == burn) {
-			update = none;
-			log("burning changes to ecu flash");
+			chans.push_back(c);
+		}
+	}
 
-			for (int i = 0; i < num_tables; i++) {
-				MSQData *table = tables[i];
+	for (unsigned int i = 0; i < chans.size(); i++) {
+		const MSQIniChannel* c = chans[i];
 
-				if (table->needBurn()) {
-					table->burnEcu();
-				}
+		rtconfig.push_back(new RTConfigScalar(c->name, c->type, c->offset,
+												c->scale, c->translate));
+	}
+
+	return false;  // OK
+}
+// }}}
+
+// {{{ decimate_channels()
+/*
+ * Set the divisor and deadband of channels.
+ *
+ * @arg list of "<name>:<divisor>[:<deadband>]"
+ * @arg channels
+ *
+ * @returns true on error, false otherwise
+ */
+static bool decimate_channels(const vector<string>& decimations,
+								vector<RTConfig*>& rtconfig)
+{
+	for (unsigned int i = 0; i < decimations.size(); i++) {
+		string name = decimations[i];
+		string div;
+		string band;
+
+		string::size_type colon = name.find(':');
+		if (string::npos != colon) {
+			div = name.substr(colon + 1);
+			name = name.substr(0, colon);
+
+			colon = div.find(':');
+			if (string::npos != colon) {
+				band = div.substr(colon + 1);
+				div = div.substr(0, colon);
 			}
-		} else {
-			rtData.readAppend();
+		}
+
+		RTConfigScalar* rtc = NULL;
+		for (unsigned int j = 0; j < rtconfig.size(); j++) {
+			if (rtconfig[j]->name == name)
+				rtc = dynamic_cast<RTConfigScalar*>(rtconfig[j]);
+		}
 
-			// It will work without at delay but it is
-			// slowed down with the delay to reduce
-			// the amount of data.
-			//usleep(1e5);
+		int divisor = atoi(div.c_str());
+		float deadband = band.empty() ? -1 : atof(band.c_str());
+		if (NULL == rtc || divisor <= 0 || (! band.empty() && deadband < 0)) {
+			cerr << "invalid decimation '" << decimations[i] << "'\n";
+			return true;  // error
 		}
+
+		rtc->divisor = divisor;
+		rtc->deadband = deadband;
 	}
 
-    return 0;
+	return false;  // OK
 }
+// }}}
 
-static void sig_update(int sig, siginfo_t *siginfo, void *context) {
-	update = ecu;
-}
+// {{{ transient_filter()
+/*
+ * Configure the transient filter (-rf).
+ *
+ * @arg comma separated settings, "tag" or "drop" and any of
+ * "<limit>=<value>" (see the usage)
+ * @arg channels
+ * @arg filter
+ *
+ * @returns true on error, false otherwise
+ */
+static bool transient_filter(const string& spec,
+								const vector<RTConfig*>& rtconfig,
+								RTFilter& filter)
+{
+	vector<string> settings = split_list(spec);
+
+	for (unsigned int i = 0; i < settings.size(); i++) {
+		string key = settings[i];
+		string val;
 
-static void sig_burn(int sig, siginfo_t *siginfo, void *context) {
-	update = burn;
+		string::size_type eq = key.find('=');
+		if (string::npos != eq) {
+			val = key.substr(eq + 1);
+			key = key.substr(0, eq);
+		}
+		float v = atof(val.c_str());
+
+		// the channel that must be logged to check a limit
+		string channel;
+
+		if ("tag" == key && val.empty()) {
+			filter.drop = false;
+		} else if ("drop" == key && val.empty()) {
+			filter.drop = true;
+		} else if ("rpmdot" == key && v >= 0) {
+			filter.max_rpmdot = v;
+			channel = "rpmdot";
+		} else if ("tpsDOT" == key && v >= 0) {
+			filter.max_tpsdot = v;
+			channel = "tpsDOT";
+		} else if ("mapDOT" == key && v >= 0) {
+			filter.max_mapdot = v;
+			channel = "mapDOT";
+		} else if ("overrun" == key && v >= 0) {
+			filter.overrun_rpm = v;
+			channel = "tps";
+		} else if ("coolant" == key && ! val.empty()) {
+			filter.min_coolant = v;
+			channel = "coolant";
+		} else if ("delay" == key && v >= 0) {
+			filter.delay = v;
+		} else {
+			cerr << "invalid transient filter setting '" << settings[i] << "'\n";
+			return true;  // error
+		}
+
+		if (channel.empty() || 0 == v)
+			continue;
+
+		bool found = false;
+		for (unsigned int j = 0; j < rtconfig.size(); j++) {
+			if (rtconfig[j]->name == channel)
+				found = true;
+		}
+
+		if (! found) {
+			cerr << "the transient filter " << key << " setting requires the "
+				<< channel << " channel\n";
+			return true;  // error
+		}
+	}
+
+	return false;  // OK
 }
+// }}}
+
+// {{{ cell_stats(), write_cells()
+/*
+ * Create the per cell statistics (-cs).
+ *
+ * The axes of a table are the channels given in the ini file,
+ * or those of the built in tables (default_tables()).
+ *
+ * @arg list of "<table>:<channel>"
+ * @arg tables
+ * @arg real time channels of the x and y axes of each table
+ * @arg real time data
+ * @arg statistics that were created
+ * @arg file of each, "<table>.<channel>.cells"
+ *
+ * @returns true on error, false otherwise
+ */
+static bool cell_stats(const vector<string>& specs,
+						vector<MSQDataTable<float, int>*>& tables,
+						const map<string, pair<string, string> >& axes,
+						MSQRealTime& rt, vector<MSQCellStats*>& stats,
+						vector<string>& files)
+{
+	for (unsigned int i = 0; i < specs.size(); i++) {
+		string name = specs[i];
+		string channel;
+
+		string::size_type colon = name.find(':');
+		if (string::npos != colon) {
+			channel = name.substr(colon + 1);
+			name = name.substr(0, colon);
+		}
+
+		MSQDataTable<float, int>* table = NULL;
+		for (unsigned int j = 0; j < tables.size(); j++) {
+			if (tables[j]->getName() == name)
+				table = tables[j];
+		}
+
+		map<string, pair<string, string> >::const_iterator ax = axes.find(name);
+		if (NULL == table || axes.end() == ax) {
+			cerr << "invalid cell statistics '" << specs[i] << "'\n";
+			return true;  // error
+		}
+
+		string x_name = ax->second.first;
+		string y_name = ax->second.second;
+
+		int x_ch = rt.channelIndex(x_name);
+		int y_ch = rt.channelIndex(y_name);
+		int value_ch = rt.channelIndex(channel);
+
+		if (-1 == value_ch) {
+			cerr << "invalid cell statistics '" << specs[i] << "'\n";
+			return true;  // error
+		}
+
+		if (-1 == x_ch || -1 == y_ch) {
+			cerr << "cell statistics of " << name << " require the "
+				<< x_name << " and " << y_name << " channels\n";
+			return true;  // error
+		}
+
+		vector<float> x_bins;
+		for (int x = 0; x < table->xSize(); x++)
+			x_bins.push_back(table->fileXCoord(x));
+
+		vector<float> y_bins;
+		for (int y = 0; y < table->ySize(); y++)
+			y_bins.push_back(table->fileYCoord(y));
+
+		stats.push_back(new MSQCellStats(x_bins, y_bins, x_ch, y_ch, value_ch));
+		files.push_back(name + "." + channel + ".cells");
+	}
+
+	return false;  // OK
+}
+
+/*
+ * Write a snapshot of each of the per cell statistics.
+ */
+static void write_cells(const vector<MSQCellStats*>& stats,
+						const vector<string>& files)
+{
+	for (unsigned int i = 0; i < stats.size(); i++)
+		stats[i]->writeFile(files[i]);
+}
+// }}}
+
+int main(int argc, char** argv)
+{
+	// {{{ signals
+	// Signals are blocked and received through a signalfd
+	// by the main event loop (see below).
+	// The mask is inherited by all threads created later.
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+
+	if (-1 == sigprocmask(SIG_BLOCK, &sigs, NULL)) {
+		perror("unable to block signals");
+		return 1;  // error
+	}
+
+	int sig_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (-1 == sig_fd) {
+		perror("unable to create signalfd");
+		return 1;  // error
+	}
+	// }}}
+
+	// {{{ command line arguments
+	string usage;
+	{
+	stringstream usagess;
+		usagess << " USAGE:\n"
+         	 	<< "   msqdev <device> [<options>]\n"
+        	 	<< "   msqdev /dev/ttyUSB0 -d ./ -uf\n"
+				<< " DEVICES:\n"
+				<< "   /dev/ttyUSB0 a serial device\n"
+				<< "   pty          a new pseudo terminal, for another\n"
+				<< "                program to open as the ecu\n"
+				<< "   sim[:latency=<us>,baud=<rate>]\n"
+				<< "                a simulated ecu, with <us> added to\n"
+				<< "                each response and emulating a link of\n"
+				<< "                <rate> baud (0 for none)\n"
+				<< " OPTIONS:\n"
+				<< "   -d           directory of files, default './'\n"
+				<< "   -b <rates>   comma separated baud rates to try, in\n"
+				<< "                order, until the ecu answers, default\n"
+				<< "                115200 without trying\n"
+				<< "   -F <bytes>   use the framed (newserial) protocol with\n"
+				<< "                crc checks, reading <bytes> per frame\n"
+				<< "   -ue          update ecu from files on startup\n"
+				<< "   -i <ini>     read the tables and real time channels\n"
+				<< "                from a MegaSquirt ini file\n"
+				<< "   -D <sym>     set an ini symbol, such as CELSIUS\n"
+				<< "   -t <names>   with -i, comma separated tables (zBins),\n"
+				<< "                default 'advanceTable1,veTable1,afrTable1'\n"
+				<< "   -l <names>   with -i, comma separated real time\n"
+				<< "                channels, default all\n"
+				<< "   -c <dir>     keep a copy of the ecu pages in <dir>,\n"
+				<< "                unchanged pages are not read on startup\n"
+				<< "   -uf          update files from ecu on startup\n"
+				<< "   -r <num>     real time samples per second, default\n"
+				<< "                as fast as the ecu responds\n"
+				<< "   -rp <num>    pipeline real time requests, keep <num>\n"
+				<< "                requests outstanding (1 or 2, not with -r)\n"
+				<< "   -rd <name>:<div>[:<band>]\n"
+				<< "                log channel <name> only every <div>'th\n"
+				<< "                sample and, if <band> is given, only when\n"
+				<< "                it moved <band> (0 for any change)\n"
+				<< "   -z           compress the real time data, 'rtdata.gz',\n"
+				<< "                read it with msq-rtdata_cat or zcat\n"
+				<< "   -ri <rows>   rows of real time data between entries of\n"
+				<< "                its index 'rtdata.idx', 0 for no index,\n"
+				<< "                default 100 (not with -z)\n"
+				<< "   -rf <settings>\n"
+				<< "                filter transients from the real time data,\n"
+				<< "                comma separated: 'tag' (default) adds a\n"
+				<< "                'steady' column of 1 or 0, 'drop' only\n"
+				<< "                logs steady rows, the limits are\n"
+				<< "                rpmdot=400, tpsDOT=50, mapDOT=0,\n"
+				<< "                overrun=3000 (rpm with a closed throttle),\n"
+				<< "                coolant=0 (least, in its units) and\n"
+				<< "                delay=3 (seconds after a transient),\n"
+				<< "                0 is not checked; -at and -cs only use\n"
+				<< "                steady frames\n"
+				<< "   -rb <num>    also log raw real time data to the binary\n"
+				<< "                ring file 'rtdata.ring' of <num> records\n"
+				<< "   -at <afr>    autotune veTable1 to an air fuel ratio, from\n"
+				<< "                the rpm, fuelload and afr1 channels,\n"
+				<< "                the table file is saved after each change\n"
+				<< "   -cs <table>:<channel>\n"
+				<< "                keep the weighted mean, variance and\n"
+				<< "                dwell time of <channel> in each cell of\n"
+				<< "                <table>, written to '<table>.<channel>.cells'\n"
+				<< "                with the statistics file (-s) and on exit\n"
+				<< "   -m <name>    publish decoded real time data live to the\n"
+				<< "                shared memory ring /<name>, read it with\n"
+				<< "                msqshmcat (see msq_shm.h)\n"
+				<< "   -s <secs>    rewrite the statistics file 'stats' every\n"
+				<< "                <secs> seconds (frames, serial latency\n"
+				<< "                and errors, table sync times)\n"
+				<< "   -h           this help screen\n"
+				<< " SIGNALS:\n"
+				<< "   SIGHUP       triggers update of ecu from files\n"
+				<< "   SIGUSR1      triggers burn of any modified tables\n"
+				<< " FILES:\n"
+				<< "   Writing a table file triggers an update of the ecu\n"
+				<< "   from that file only.\n";
+		usage = usagess.str();
+	}
+
+    if (argc < 2) {
+		cout << usage;
+        return 1;  // error
+    }
+
+	string serial_dev = argv[1];
+	if (serial_dev == "-h") {
+		cout << usage;
+		return 1;  // error
+	}
+
+	string dir = "";
+	int ring_records = 0;  // binary real time ring, 0 -> disabled
+	string cache_dir = "";  // ecu page cache, empty -> disabled
+	string ini_file = "";  // empty -> built in tables and channels
+	MSQIni ini;
+	vector<string> table_names = split_list("advanceTable1,veTable1,afrTable1");
+	vector<string> channel_names;  // empty -> all
+	vector<string> decimations;  // -rd <name>:<div>[:<band>]
+	double sample_rate = 0;  // samples per second, 0 -> unlimited
+	string rtdata_file = "rtdata";  // "rtdata.gz" -> compressed (-z)
+	int pipeline_depth = 0;  // outstanding real time requests (-rp)
+	vector<int> bauds;  // -b, empty -> 115200 without probing
+	int frame_block = 0;  // -F, 0 -> legacy unframed protocol
+	int stats_period = 0;  // -s, seconds, 0 -> no stats file
+	string shm_name = "";  // -m, empty -> no shared memory feed
+	int index_rows = 100;  // -ri, 0 -> no index of the real time data
+	float tune_afr = 0;  // -at, 0 -> no autotune
+	vector<string> cell_specs;  // -cs <table>:<channel>
+	string filter_spec = "";  // -rf, empty -> no transient filter
+
+	for (int i = 2; i < argc; i++) {
+		string arg = argv[i];
+
+		if (arg == "-ue") {
+			update = ecu;
+		} else if (arg == "-uf") {
+			update = file;
+		} else if (arg == "-i" || arg == "-D" || arg == "-t" || arg == "-l") {
+			if ((i + 1) >= argc) {
+				cerr << "the " << arg << " option requires an argument" << endl;
+				return 1;  // error
+			}
+			i++;
+
+			if (arg == "-i")
+				ini_file = argv[i];
+			else if (arg == "-D")
+				ini.define(argv[i]);
+			else if (arg == "-t")
+				table_names = split_list(argv[i]);
+			else
+				channel_names = split_list(argv[i]);
+		} else if (arg == "-c") {
+			if ((i + 1) >= argc) {
+				cerr << "the -c option requires a directory" << endl;
+				return 1;  // error
+			}
+			i++;
+			cache_dir = argv[i];
+		} else if (arg == "-rd") {
+			if ((i + 1) >= argc) {
+				cerr << "the -rd option requires <name>:<div>[:<band>]" << endl;
+				return 1;  // error
+			}
+			i++;
+			decimations.push_back(argv[i]);
+		} else if (arg == "-b") {
+			if ((i + 1) >= argc) {
+				cerr << "the -b option requires a list of baud rates" << endl;
+				return 1;  // error
+			}
+			i++;
+
+			vector<string> rates = split_list(argv[i]);
+			bauds.clear();
+			for (unsigned int j = 0; j < rates.size(); j++)
+				bauds.push_back(atoi(rates[j].c_str()));
+		} else if (arg == "-F") {
+			if ((i + 1) >= argc) {
+				cerr << "the -F option requires a block size" << endl;
+				return 1;  // error
+			}
+			i++;
+			frame_block = atoi(argv[i]);
+			if (frame_block <= 0) {
+				cerr << "invalid block size '" << argv[i] << "'" << endl;
+				return 1;  // error
+			}
+		} else if (arg == "-rp") {
+			if ((i + 1) >= argc) {
+				cerr << "the -rp option requires a number of requests" << endl;
+				return 1;  // error
+			}
+			i++;
+			pipeline_depth = atoi(argv[i]);
+			if (pipeline_depth <= 0) {
+				cerr << "invalid number of requests '" << argv[i] << "'" << endl;
+				return 1;  // error
+			}
+		} else if (arg == "-z") {
+			rtdata_file = "rtdata.gz";
+		} else if (arg == "-rb") {
+			if ((i + 1) >= argc) {
+				cerr << "the -rb option requires a number of records" << endl;
+				return 1;  // error
+			}
+			i++;
+			ring_records = atoi(argv[i]);
+			if (ring_records <= 0) {
+				cerr << "invalid number of records '" << argv[i] << "'" << endl;
+				return 1;  // error
+			}
+		} else if (arg == "-at") {
+			if ((i + 1) >= argc) {
+				cerr << "the -at option requires an air fuel ratio" << endl;
+				return 1;  // error
+			}
+			i++;
+			tune_afr = atof(argv[i]);
+			if (tune_afr <= 0) {
+				cerr << "invalid air fuel ratio '" << argv[i] << "'" << endl;
+				return 1;  // error
+			}
+		} else if (arg == "-rf") {
+			if ((i + 1) >= argc) {
+				cerr << "the -rf option requires settings, such as 'tag'" << endl;
+				return 1;  // error
+			}
+			i++;
+			filter_spec = argv[i];
+		} else if (arg == "-cs") {
+			if ((i + 1) >= argc) {
+				cerr << "the -cs option requires <table>:<channel>" << endl;
+				return 1;  // error
+			}
+			i++;
+			cell_specs.push_back(argv[i]);
+		} else if (arg == "-ri") {
+			if ((i + 1) >= argc) {
+				cerr << "the -ri option requires a number of rows" << endl;
+				return 1;  // error
+			}
+			i++;
+			index_rows = atoi(argv[i]);
+			if (index_rows < 0) {
+				cerr << "invalid number of rows '" << argv[i] << "'" << endl;
+				return 1;  // error
+			}
+		} else if (arg == "-m") {
+			if ((i + 1) >= argc) {
+				cerr << "the -m option requires a name" << endl;
+				return 1;  // error
+			}
+			i++;
+			shm_name = argv[i];
+		} else if (arg == "-s") {
+			if ((i + 1) >= argc) {
+				cerr << "the -s option requires a number of seconds" << endl;
+				return 1;  // error
+			}
+			i++;
+			stats_period = atoi(argv[i]);
+			if (stats_period <= 0) {
+				cerr << "invalid number of seconds '" << argv[i] << "'" << endl;
+				return 1;  // error
+			}
+		} else if (arg == "-r") {
+			if ((i + 1) >= argc) {
+				cerr << "the -r option requires a sample rate" << endl;
+				return 1;  // error
+			}
+			i++;
+			sample_rate = atof(argv[i]);
+			if (sample_rate <= 0) {
+				cerr << "invalid sample rate '" << argv[i] << "'" << endl;
+				return 1;  // error
+			}
+		} else if (arg == "-d") {
+			if ((i + 1) >= argc) {
+				cerr << "the -d option requires a directory" << endl;
+				return 1;  // error
+			}
+		} else {
+			cout << "unkown argument: '" << arg << "'\n";
+			return 1;  // error
+		}
+	}
+	// }}}
+
+	// {{{ ini file
+	int frame_bytes = 169;  // ochBlockSize
+	string ini_msg;  // logged once logging has started
+
+	if (! ini_file.empty()) {
+		struct timeval start, end;
+		gettimeofday(&start, NULL);
+
+		if (ini.load(ini_file)) {
+			cerr << "errors in ini file '" << ini_file << "'\n";
+			return 1;  // error
+		}
+
+		gettimeofday(&end, NULL);
+
+		if ("A" != ini.burstCommand()) {
+			cerr << "only the 'A' burst command is supported\n";
+			return 1;  // error
+		}
+		frame_bytes = ini.ochBlockSize();
+
+		long ms = (end.tv_sec - start.tv_sec) * 1000
+					+ (end.tv_usec - start.tv_usec) / 1000;
+
+		stringstream msg;
+		msg << "read ini file '" << ini_file << "' in " << ms << " ms, "
+			<< ini.numConstants() << " constants, "
+			<< ini.outputChannels().size() << " channels, "
+			<< ini.numTables() << " tables";
+		ini_msg = msg.str();
+	}
+	// }}}
+
+	// {{{ write the pid (process id) to a file
+	{
+	pid_t pid = getpid();
+
+	string pidfile = dir;
+	if (! pidfile.empty())
+		pidfile += "/";
+	pidfile += "pid";
+
+	ofstream pidfd(pidfile.c_str(), ios_base::trunc);
+	if (pidfd.fail()) {
+		perror("unable to open pid file");
+		return 1; // error
+	}
+	pidfd << pid << endl;
+
+	pidfd.close();
+	}
+	// }}}
+
+	log("start");
+	time_t started = time(NULL);
+	if (! ini_msg.empty())
+		log(ini_msg);
+
+	MSQSerial serial(serial_dev);
+
+	if (! bauds.empty() && serial.setBauds(bauds)) {
+		return 1; // error
+	}
+
+	if (serial.connect()) {
+		//log("unable to open serial device\n");
+		cerr << "unable to open serial device\n";
+		return 1; // error
+	}
+
+	log("device " + serial.deviceName());
+
+	if (frame_block > 0)
+		serial.setFramed(true, frame_block);
+
+	if (! bauds.empty()) {
+		if (serial.probe()) {
+			cerr << "no response from the ecu\n";
+			return 1; // error
+		}
+
+		stringstream msg;
+		msg << "connected at " << serial.getBaud() << " baud";
+		log(msg.str());
+	}
+
+	/*
+	 * doc/ini/megasquirt-ii.ms2extra.3.1.1_release.ini
+	 *
+	 *    pageActivationDelay = 50 ; Milliseconds delay after burn command.
+	 *    interWriteDelay = 	5    ; 5 from Lance
+	 */
+	if (ini_file.empty())
+		serial.setDelays(50, 5);  // page activation, inter write (ms)
+	else
+		serial.setDelays(ini.pageActivationDelay(), ini.interWriteDelay());
+
+	// {{{ page cache
+	/*
+	 *    pageSize = 1024, 1024, ...
+	 *    crc32CheckCommand = "k\x00\x04\x00\x00\x00\x04", ...
+	 */
+	MSQPageCache* cache = NULL;
+	if (! cache_dir.empty()) {
+		cache = new MSQPageCache(cache_dir, &serial);
+		if (! ini_file.empty()) {
+			const vector<int>& ids = ini.pageIds();
+			for (unsigned int i = 0; i < ids.size(); i++)
+				cache->setPageSize(ids[i], ini.pageSize(ids[i]));
+		}
+
+		if (cache->open()) {
+			log("unable to open page cache, reading the ecu directly");
+			delete cache;
+			cache = NULL;
+		}
+	}
+	// }}}
+
+	// {{{ define the tables, and read/write
+	vector<MSQDataTable<float, int>*> ecu_tables;
+	map<string, pair<string, string> > table_axes;
+
+	if (ini_file.empty()) {
+		default_tables(&serial, ecu_tables, table_axes);
+	} else if (ini_tables(ini, table_names, &serial, ecu_tables, table_axes)) {
+		return 1;  // error
+	}
+
+	vector<MSQData*> tables;
+	for (unsigned int i = 0; i < ecu_tables.size(); i++) {
+		MSQDataTable<float, int>* table = ecu_tables[i];
+
+		table->setCache(cache);
+
+		if (DEBUG) { cout << table->getName() << ".readEcu()\n"; }
+		if (table->readEcu()) {
+			log("readEcu(), error reading " + table->getName() + "\n");
+			return(1);
+		}
+		if (DEBUG) { cout << table->getName() << ".readFile()\n"; }
+		table->readFile();
+
+		tables.push_back(table);
+	}
+	int num_tables = tables.size();
+	// }}}
+
+	if (cache != NULL) {
+		stringstream msg;
+		msg << "page cache: " << cache->verified() << " pages unchanged, "
+			<< cache->fetched() << " pages read";
+		log(msg.str());
+	}
+
+	// {{{ configure real time data
+	
+	// The channels come from the [OutputChannels] section of the
+	// ini file (-i), or the built in ones (default_channels()).
+	//
+	// After these are changed (or the steady column of -rf) the
+	// columns of the rtdata file no longer match, the old file is
+	// then moved aside and a new one started (see MSQRealTime).
+
+	vector<RTConfig*> rtconfig;
+
+	if (ini_file.empty()) {
+		default_channels(rtconfig);
+	} else if (ini_channels(ini, channel_names, rtconfig)) {
+		return 1;  // error
+	}
+
+	if (decimate_channels(decimations, rtconfig)) {
+		return 1;  // error
+	}
+
+	RTFilter filter;
+	if (! filter_spec.empty() && transient_filter(filter_spec, rtconfig, filter)) {
+		return 1;  // error
+	}
+
+	// serial_device, file, buffer length, config(above), filter
+	MSQRealTime rtData(&serial, rtdata_file, frame_bytes, rtconfig,
+						filter_spec.empty() ? NULL : &filter);
+
+	if (ring_records > 0) {
+		if (rtData.openRing("rtdata.ring", ring_records)) {
+			cerr << "unable to open real time ring file\n";
+			return 1;  // error
+		}
+	}
+
+	// the compressed file can not be seeked, so it is not indexed
+	if (index_rows > 0 && "rtdata" == rtdata_file) {
+		if (rtData.openIndex(index_rows))
+			log("unable to open the real time data index, continuing without");
+	}
+
+	if (! shm_name.empty()) {
+		if (rtData.openShm(shm_name, RT_SHM_FRAMES)) {
+			cerr << "unable to create shared memory feed\n";
+			return 1;  // error
+		}
+	}
+	// }}}
+
+	// {{{ autotune
+	MSQDataTable<float, int>* tune_table = NULL;
+	MSQAutoTune<float, int>* tune = NULL;
+
+	if (tune_afr > 0) {
+		for (unsigned int i = 0; i < ecu_tables.size(); i++) {
+			if ("veTable1" == ecu_tables[i]->getName())
+				tune_table = ecu_tables[i];
+		}
+
+		int rpm_ch = rtData.channelIndex("rpm");
+		int load_ch = rtData.channelIndex("fuelload");
+		int afr_ch = rtData.channelIndex("afr1");
+
+		if (NULL == tune_table || -1 == rpm_ch || -1 == load_ch || -1 == afr_ch) {
+			cerr << "autotune requires the veTable1 table and the rpm,"
+				<< " fuelload and afr1 channels\n";
+			return 1;  // error
+		}
+
+		// the transient filter already checks each frame
+		bool filtered = ! filter_spec.empty();
+
+		tune = new MSQAutoTune<float, int>(tune_table, rpm_ch, load_ch, afr_ch,
+								filtered ? -1 : rtData.channelIndex("rpmdot"),
+								filtered ? -1 : rtData.channelIndex("tpsDOT"),
+								filtered ? -1 : rtData.channelIndex("tps"));
+		tune->setGoal(tune_afr);
+
+		stringstream msg;
+		msg << "autotune veTable1 to " << tune_afr << " afr";
+		log(msg.str());
+	}
+	// }}}
+
+	// {{{ per cell statistics
+	vector<MSQCellStats*> cells;
+	vector<string> cell_files;
+
+	if (cell_stats(cell_specs, ecu_tables, table_axes,
+					rtData, cells, cell_files))
+	{
+		return 1;  // error
+	}
+	// }}}
+
+	// {{{ real time data pipeline
+	MSQFrameQueue rtQueue(RT_QUEUE_FRAMES, rtData.frameBytes());
+
+	RTPipeline pipeline;
+	pipeline.rt = &rtData;
+	pipeline.queue = &rtQueue;
+	pipeline.done = false;
+
+	pipeline.wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (-1 == pipeline.wake_fd) {
+		perror("unable to create eventfd");
+		return 1;  // error
+	}
+
+	pipeline.tune = tune;
+	pipeline.cells = cells;
+	pipeline.tune_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (-1 == pipeline.tune_fd) {
+		perror("unable to create eventfd");
+		return 1;  // error
+	}
+
+	pipeline.timer_fd = -1;
+	if (sample_rate > 0) {
+		pipeline.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (-1 == pipeline.timer_fd) {
+			perror("unable to create timerfd");
+			return 1;  // error
+		}
+
+		long period = (long) (1.0e9 / sample_rate);  // nano seconds
+
+		struct itimerspec its;
+		its.it_interval.tv_sec = period / 1000000000;
+		its.it_interval.tv_nsec = period % 1000000000;
+		its.it_value = its.it_interval;
+
+		if (-1 == timerfd_settime(pipeline.timer_fd, 0, &its, NULL)) {
+			perror("unable to set sample timer");
+			return 1;  // error
+		}
+	}
+
+	// A pipelined frame would be requested a whole sample period
+	// before it is used, so it only makes sense when unlimited.
+	if (pipeline_depth > 0) {
+		if (sample_rate > 0)
+			cerr << "-rp is ignored with -r\n";
+		else
+			serial.setPipelined(pipeline_depth);
+	}
+
+	// }}}
+
+	// {{{ event loop setup
+	// The main thread sleeps in epoll_wait() until a signal
+	// arrives or a table file is written.
+	int watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (-1 == watch_fd) {
+		perror("unable to create inotify instance");
+		return 1;  // error
+	}
+
+	// Watch the directory rather than each file so that tables
+	// which are replaced (written then renamed) are still seen.
+	if (-1 == inotify_add_watch(watch_fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		perror("unable to watch table files");
+		return 1;  // error
+	}
+
+	int epoll_fd = epoll_create(2);
+	if (-1 == epoll_fd) {
+		perror("unable to create epoll instance");
+		return 1;  // error
+	}
+
+	{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = sig_fd;
+	if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sig_fd, &ev)) {
+		perror("epoll_ctl signalfd");
+		return 1;  // error
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = watch_fd;
+	if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watch_fd, &ev)) {
+		perror("epoll_ctl inotify");
+		return 1;  // error
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = pipeline.tune_fd;
+	if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipeline.tune_fd, &ev)) {
+		perror("epoll_ctl autotune");
+		return 1;  // error
+	}
+	}
+	// }}}
+
+	// {{{ statistics timer
+	MSQHistogram sync_times;  // tables updates, micro seconds
+	string stats_file = "stats";
+
+	int stats_fd = -1;
+	if (stats_period > 0) {
+		stats_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (-1 == stats_fd) {
+			perror("unable to create timerfd");
+			return 1;  // error
+		}
+
+		struct itimerspec its;
+		its.it_interval.tv_sec = stats_period;
+		its.it_interval.tv_nsec = 0;
+		its.it_value = its.it_interval;
+
+		if (-1 == timerfd_settime(stats_fd, 0, &its, NULL)) {
+			perror("unable to set stats timer");
+			return 1;  // error
+		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = stats_fd;
+		if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stats_fd, &ev)) {
+			perror("epoll_ctl stats timer");
+			return 1;  // error
+		}
+	}
+	// }}}
+
+	// {{{ start the real time data threads
+	// Started after everything else is set up, from here on the
+	// threads must be stopped (quit) and joined before returning.
+	pthread_t acquire_thread;
+	pthread_t output_thread;
+
+	if (0 != pthread_create(&acquire_thread, NULL, rt_acquire, &pipeline)) {
+		cerr << "unable to start real time data threads\n";
+		return 1;  // error
+	}
+
+	if (0 != pthread_create(&output_thread, NULL, rt_output, &pipeline)) {
+		cerr << "unable to start real time data threads\n";
+		quit = true;
+		pthread_join(acquire_thread, NULL);
+		return 1;  // error
+	}
+	// }}}
+
+	int ret = 0;  // exit status
+
+	while (!quit) {
+		int64_t sync_start = now_us();
+		bool sync = true;  // false while waiting for events
+
+		if (update == ecu) {
+			update = none;
+			log("updating ecu from files");
+
+			serial_acquire();
+			for (int i = 0; i < num_tables; i++) {
+				MSQData *table = tables[i];
+
+				if (table->readFile()) {
+					cerr << "hard fault trying to read table\n";
+					ret = 1;
+					quit = true;
+					break;
+				}
+
+				if (table->hasChanges()) {
+					if (table->writeEcu()) {
+						log("error writeEcu()");
+					}
+				}
+			}
+			serial_release();
+		} else if (update == file) {
+			update = none;
+			log("updating files from ecu");
+
+			for (int i = 0; i < num_tables; i++) {
+				MSQData *table = tables[i];
+
+				if (DEBUG) { cout << "hasChanges()?\n"; }
+				if (table->hasChanges()) {
+					table->cpEcuToFile();
+					table->writeFile();
+					table->fileWritten();
+				}
+			}
+		} else if (update == burn) {
+			update = none;
+			log("burning changes to ecu flash");
+
+			serial_acquire();
+			for (int i = 0; i < num_tables; i++) {
+				MSQData *table = tables[i];
+
+				if (table->needBurn()) {
+					table->burnEcu();
+				}
+			}
+			serial_release();
+		} else if (modified_tables(&tables[0], num_tables)) {
+			// Only the tables whose files were written are read.
+			// The file is complete (it was closed) so it is not
+			// retried, a bad file just waits for the next write.
+			serial_acquire();
+			for (int i = 0; i < num_tables; i++) {
+				MSQData *table = tables[i];
+
+				if (! table->fileModified())
+					continue;
+
+				log("updating ecu from file " + table->fileName());
+
+				if (table->loadFile()) {
+					log("unable to read " + table->fileName());
+					continue;
+				}
+
+				if (table->hasChanges()) {
+					if (table->writeEcu()) {
+						log("error writeEcu()");
+					}
+				}
+			}
+			serial_release();
+		} else {
+			// Real time data is handled by the other threads,
+			// wait for something to do.
+			sync = false;
+			struct epoll_event events[4];
+
+			int n = epoll_wait(epoll_fd, events, 4, -1);
+			if (n < 0) {
+				if (EINTR == errno)
+					continue;
+
+				perror("epoll_wait");
+				ret = 1;
+				quit = true;
+				break;
+			}
+
+			for (int i = 0; i < n; i++) {
+				if (events[i].data.fd == sig_fd) {
+					handle_signal(sig_fd);
+				} else if (events[i].data.fd == watch_fd) {
+					handle_watch(watch_fd, &tables[0], num_tables);
+				} else if (events[i].data.fd == pipeline.tune_fd) {
+					// Only the changed cells are written, in as
+					// few commands as possible (see writeEcu()).
+					// The file is saved as well, so that a reload
+					// (SIGHUP, or another table file being written)
+					// does not undo the changes and a crash does
+					// not lose them.
+					uint64_t ready;
+					if (read(pipeline.tune_fd, &ready, sizeof(ready)) > 0
+							&& tune->apply() > 0)
+					{
+						serial_acquire();
+						if (tune_table->hasChanges() && tune_table->writeEcu())
+							log("error writeEcu()");
+						serial_release();
+
+						tune_table->writeFile();
+						tune_table->fileWritten();
+					}
+				} else if (events[i].data.fd == stats_fd) {
+					uint64_t expired;
+					if (read(stats_fd, &expired, sizeof(expired)) > 0) {
+						write_stats(stats_file, started, serial, rtData,
+									rtQueue, sync_times);
+						write_cells(cells, cell_files);
+					}
+				}
+			}
+		}
+
+		if (sync)
+			sync_times.record(now_us() - sync_start);
+	}
+
+	pthread_join(acquire_thread, NULL);
+	pthread_join(output_thread, NULL);
+
+	close(epoll_fd);
+	close(watch_fd);
+	close(sig_fd);
+	close(pipeline.wake_fd);
+	close(pipeline.tune_fd);
+	if (pipeline.timer_fd > -1)
+		close(pipeline.timer_fd);
+	if (stats_fd > -1) {
+		close(stats_fd);
+		write_stats(stats_file, started, serial, rtData, rtQueue, sync_times);
+	}
+
+	{
+	stringstream msg;
+	msg << "real time frames: " << rtQueue.pushed()
+		<< ", dropped: " << rtQueue.dropped()
+		<< ", not steady: " << rtData.filtered()
+		<< ", max queue depth: " << rtQueue.maxDepth();
+	log(msg.str());
+	}
+
+	{
+	// latency of each type of serial command
+	stringstream report(serial.latencyReport());
+	string line;
+	while (getline(report, line))
+		log("serial " + line);
+
+	if (sync_times.count() > 0)
+		log("table sync " + sync_times.summary() + " us");
+
+	if (serial.corruptFrames() > 0) {
+		stringstream msg;
+		msg << "serial corrupt frames retried: " << serial.corruptFrames();
+		log(msg.str());
+	}
+	}
+
+	if (tune != NULL) {
+		stringstream msg;
+		msg << "autotune changed " << tune->changes() << " cells";
+		log(msg.str());
+
+		delete tune;
+	}
+
+	write_cells(cells, cell_files);
+	for (unsigned int i = 0; i < cells.size(); i++)
+		delete cells[i];
+
+	if (cache != NULL)
+		delete cache;
+
+	log("stop");
 
-static void sig_quit(int sig, siginfo_t *siginfo, void *context) {
-	quit = true;
+    return ret;
 }
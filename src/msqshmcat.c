@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2011 Jeremiah Mahler <jmmahler@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * msqshmcat - print the live real time data feed of msqdev.
+ *
+ * Each frame published to the shared memory ring (msqdev -m)
+ * is printed as it arrives, in the same comma separated format
+ * as the rtdata file, so tools which read rtdata can read a
+ * pipe from this instead.
+ *
+ * It is written in C as an example of a client of msq_shm.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msq_shm.h"
+
+static void usage(void) {
+	fprintf(stderr,
+		" USAGE:\n"
+		"   msqshmcat [-l] <name> [<channel> ...]\n"
+		"   msqdev sim -m rtdata &\n"
+		"   msqshmcat rtdata rpm map\n"
+		" OPTIONS:\n"
+		"   -l           add a column with the micro seconds from\n"
+		"                the frame being received to it being printed\n"
+		"   <channel>    channels to print, default all\n");
+}
+
+int main(int argc, char** argv)
+{
+	struct msq_shm shm;
+	const char* name = NULL;
+	int show_latency = 0;
+	const char** names;  /* of the channels to print */
+	int num_sel = 0;
+	int* sel;
+	float* vals;
+	int i, j;
+
+	names = malloc(argc * sizeof(char*));
+
+	/* {{{ command line arguments */
+	for (i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "-h")) {
+			usage();
+			free(names);
+			return 1;
+		} else if (0 == strcmp(argv[i], "-l")) {
+			show_latency = 1;
+		} else if (NULL == name) {
+			name = argv[i];
+		} else {
+			names[num_sel++] = argv[i];  /* resolved once the ring is open */
+		}
+	}
+
+	if (NULL == name) {
+		usage();
+		free(names);
+		return 1;
+	}
+	/* }}} */
+
+	if (msq_shm_open(&shm, name)) {
+		free(names);
+		return 1;
+	}
+
+	unsigned int num_channels = msq_shm_num_channels(&shm);
+	vals = malloc((num_channels + 1) * sizeof(float));
+
+	/* all of the channels if none are named */
+	sel = malloc((num_sel + num_channels + 1) * sizeof(int));
+
+	/* {{{ select the channels */
+	for (i = 0; i < num_sel; i++) {
+		const char* ch = names[i];
+
+		for (j = 0; j < (int) num_channels; j++) {
+			if (0 == strcmp(ch, msq_shm_channel(&shm, j)))
+				break;
+		}
+
+		if (j == (int) num_channels) {
+			fprintf(stderr, "unknown channel '%s'\n", ch);
+			msq_shm_close(&shm);
+			free(vals);
+			free(sel);
+			free(names);
+			return 1;
+		}
+		sel[i] = j;
+	}
+
+	if (0 == num_sel) {
+		for (j = 0; j < (int) num_channels; j++)
+			sel[num_sel++] = j;
+	}
+	/* }}} */
+
+	printf("localtime");
+	for (i = 0; i < num_sel; i++)
+		printf(",%s", msq_shm_channel(&shm, sel[i]));
+	if (show_latency)
+		printf(",latency_us");
+	printf("\n");
+	fflush(stdout);
+
+	/* start with the next frame */
+	uint64_t n = msq_shm_count(&shm);
+	time_t first_time = 0;
+
+	while (0 == msq_shm_wait(&shm, n, 1000000) || ! shm.hdr->closed) {
+		if (n >= msq_shm_count(&shm))
+			continue;  /* timed out, msqdev may be waiting on the ecu */
+
+		if (n < msq_shm_first(&shm)) {
+			fprintf(stderr, "fell behind, %lu frames lost\n",
+					(unsigned long) (msq_shm_first(&shm) - n));
+			n = msq_shm_first(&shm);
+		}
+
+		struct timeval tv, now;
+		if (msq_shm_read(&shm, n, &tv, vals)) {
+			n++;
+			continue;  /* overwritten */
+		}
+		n++;
+
+		gettimeofday(&now, NULL);
+
+		if (0 == first_time)
+			first_time = tv.tv_sec;
+
+		printf("%g", (tv.tv_sec - first_time) + tv.tv_usec / 1.0e6);
+		for (i = 0; i < num_sel; i++)
+			printf(",%g", vals[sel[i]]);
+		if (show_latency) {
+			printf(",%ld", (now.tv_sec - tv.tv_sec) * 1000000L
+							+ (now.tv_usec - tv.tv_usec));
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	msq_shm_close(&shm);
+	free(vals);
+	free(sel);
+	free(names);
+
+	return 0;
+}